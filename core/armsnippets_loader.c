@@ -89,9 +89,11 @@ bool armloader_load_snippet(enum SNIPPETS snippet, struct armloader_load_params
         }
     }
     armloader_cb_ptr = callback;
-    uint32_t *flags = &RAM_FLAGS(virt_mem_ptr(orig_pc, 4));
+    void *orig_ptr = virt_mem_ptr(orig_pc, 4);
+    uint32_t *flags = &RAM_FLAGS(orig_ptr);
     if (*flags & RF_CODE_TRANSLATED) flush_translations();
     *flags |= RF_ARMLOADER_CB;
+    RAM_PAGE_FLAGS(orig_ptr) |= RPF_BREAKPOINT;
 
     // for debugging
     /*flags = &RAM_FLAGS(virt_mem_ptr(arm.reg[15], 4));
@@ -29,6 +29,7 @@ uint32_t FASTCALL read_word(uint32_t addr)
         }
     }
 
+    mem_stats.ac_hits[0]++;
     entry += addr;
 
     return *(uint32_t*)entry;
@@ -54,6 +55,7 @@ uint32_t FASTCALL read_byte(uint32_t addr)
         }
     }
 
+    mem_stats.ac_hits[0]++;
     entry += addr;
 
     return *(uint8_t*)entry;
@@ -80,6 +82,7 @@ uint32_t FASTCALL read_half(uint32_t addr)
         }
     }
 
+    mem_stats.ac_hits[0]++;
     entry += addr;
 
     return *(uint16_t*)entry;
@@ -105,6 +108,7 @@ void FASTCALL write_byte(uint32_t addr, uint32_t value)
         }
     }
 
+    mem_stats.ac_hits[1]++;
     entry += addr;
 
     if(RAM_FLAGS(entry & ~3) & DO_WRITE_ACTION)
@@ -133,6 +137,7 @@ void FASTCALL write_half(uint32_t addr, uint32_t value)
         }
     }
 
+    mem_stats.ac_hits[1]++;
     entry += addr;
 
     if(RAM_FLAGS(entry & ~3) & DO_WRITE_ACTION)
@@ -159,6 +164,7 @@ void FASTCALL write_word(uint32_t addr, uint32_t value)
             return mmio_write_word(entry, value);
         }
     }
+    mem_stats.ac_hits[1]++;
     entry += addr;
 
     if(RAM_FLAGS(entry & ~3) & DO_WRITE_ACTION)
@@ -76,6 +76,7 @@ struct omap_timer {
     // low 20 bits implicit in time remaining to next sched. event
     // This is an arbitrary division to prevent integer overflows
 } omap_timer[3];
+static int omap_timer_item[3]; // Scheduler item indices
 
 uint32_t omap_timer_read_word(int which, uint32_t addr) {
     struct omap_timer *t = &omap_timer[which];
@@ -86,7 +87,7 @@ uint32_t omap_timer_read_word(int which, uint32_t addr) {
             sched_process_pending_events();
             if (t->control & 1) { // timer running
                 int scale = 1 + (t->control >> 2 & 7);
-                return t->value + (event_ticks_remaining(SCHED_CASPLUS_TIMER1 + which) >> scale);
+                return t->value + (event_ticks_remaining(omap_timer_item[which]) >> scale);
             }
             return t->value;
     }
@@ -103,10 +104,10 @@ void omap_timer_write_word(int which, uint32_t addr, uint32_t value) {
                 if (value & 1) { // starting timer
                     t->value = t->load & 0xfff00000;
                     uint32_t ticks = ((t->load & 0xfffff) + 1) << scale;
-                    event_set(SCHED_CASPLUS_TIMER1 + which, ticks);
+                    event_set(omap_timer_item[which], ticks);
                 } else { // stopping timer
-                    t->value += event_ticks_remaining(SCHED_CASPLUS_TIMER1 + which) >> scale;
-                    event_clear(SCHED_CASPLUS_TIMER1 + which);
+                    t->value += event_ticks_remaining(omap_timer_item[which]) >> scale;
+                    event_clear(omap_timer_item[which]);
                 }
             }
             t->control = value & 0x3F;
@@ -119,7 +120,9 @@ void omap_timer_write_word(int which, uint32_t addr, uint32_t value) {
 }
 
 void omap_timer_event(int index) {
-    int which = index - SCHED_CASPLUS_TIMER1;
+    int which = 0;
+    while (omap_timer_item[which] != index)
+        which++;
     struct omap_timer *t = &omap_timer[which];
 
     int scale = 1 + (t->control >> 2 & 7);
@@ -329,7 +332,7 @@ void omap_write_word(uint32_t addr, uint32_t value) {
     switch (addr) {
         case 0xFFFEC000: lcd_control = value; return;
         case 0xFFFECC0C: nand.nand_writable = value & 1; return; // EMIFS_CONFIG
-        case 0xFFFECE10: cpu_events |= EVENT_RESET; return;
+        case 0xFFFECE10: cpu_events_set(EVENT_RESET); return;
     }
     //bad_write_word(addr, value);
 }
@@ -342,9 +345,7 @@ void casplus_reset() {
     for (i = 0; i < 3; i++) {
         omap_timer[i].control = 0;
         omap_timer[i].load = 0xffffffff; // hack for U-Boot
-        sched.items[SCHED_CASPLUS_TIMER1+i].clock = CLOCK_AHB;
-        sched.items[SCHED_CASPLUS_TIMER1+i].second = -1;
-        sched.items[SCHED_CASPLUS_TIMER1+i].proc = omap_timer_event;
+        omap_timer_item[i] = sched_register(CLOCK_AHB, omap_timer_event);
     }
 
     omap_keypad_row_mask = 0xFFFF;
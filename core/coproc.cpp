@@ -105,11 +105,12 @@ void do_cp15_mcr(uint32_t insn)
             arm.fault_address = value;
             break;
         case 0x070080: /* MCR p15, 0, <Rd>, c7, c0, 4: Wait for interrupt */
-            cycle_count_delta = 0;
             if (arm.interrupts == 0) {
+                // The CPU loop stops because of the event, emu_loop then lets time pass
                 arm.reg[15] -= 4;
-                cpu_events |= EVENT_WAITING;
-            }
+                cpu_events_set(EVENT_WAITING);
+            } else
+                cycle_count_delta = 0;
             break;
         case 0x080005: /* MCR p15, 0, <Rd>, c8, c5, 0: Invalidate instruction TLB */
         case 0x080007: /* MCR p15, 0, <Rd>, c8, c7, 0: Invalidate TLB */
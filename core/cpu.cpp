@@ -1,6 +1,5 @@
 #include <algorithm>
 #include <cassert>
-#include <mutex>
 
 // Uncomment the following line to measure the time until the OS is loaded
 // #define BENCHMARK
@@ -13,6 +12,7 @@
 #include "cpu.h"
 #include "cpudefs.h"
 #include "debug.h"
+#include "cycles.h"
 #include "emu.h"
 #include "mem.h"
 #include "mmu.h"
@@ -97,11 +97,15 @@ void cpu_arm_loop()
             continue;
         }
 
-	*flags_ptr |= RF_CODE_EXECUTED;
+	if(!(*flags_ptr & RF_CODE_EXECUTED))
+	{
+		*flags_ptr |= RF_CODE_EXECUTED;
+		RAM_PAGE_FLAGS(p) |= RPF_CODE;
+	}
 #endif
 
         arm.reg[15] += 4; // Increment now to account for the pipeline
-        ++cycle_count_delta;
+        cycle_count_delta += arm_insn_cycles(p->raw);
         do_arm_instruction(*p);
     }
 }
@@ -210,18 +214,17 @@ void * FASTCALL read_instruction(uint32_t addr)
 // Update cpu_events
 void cpu_int_check()
 {
-    static std::mutex mut;
-    std::lock_guard<std::mutex> lg(mut);
-
+    uint32_t pending = 0;
     if (arm.interrupts & ~arm.cpsr_low28 & 0x80)
-        cpu_events |= EVENT_IRQ;
-    else
-        cpu_events &= ~EVENT_IRQ;
-
+        pending |= EVENT_IRQ;
     if (arm.interrupts & ~arm.cpsr_low28 & 0x40)
-        cpu_events |= EVENT_FIQ;
-    else
-        cpu_events &= ~EVENT_FIQ;
+        pending |= EVENT_FIQ;
+
+    if ((cpu_events & (EVENT_IRQ | EVENT_FIQ)) == pending)
+        return;
+
+    cpu_events_set(pending);
+    cpu_events_clear(~pending & (EVENT_IRQ | EVENT_FIQ));
 }
 
 static const constexpr uint8_t exc_flags[] = {
@@ -437,7 +440,7 @@ void cpu_reset()
     memset(&arm, 0, sizeof arm);
     arm.control = 0x00050078;
     arm.cpsr_low28 = MODE_SVC | 0xC0;
-    cpu_events &= EVENT_DEBUG_STEP;
+    cpu_events_clear(~(EVENT_DEBUG_STEP | EVENT_ASYNC));
 
     addr_cache_flush();
     flush_translations();
@@ -445,8 +448,14 @@ void cpu_reset()
 
 bool cpu_resume(const emu_snapshot *s)
 {
-    return snapshot_read(s, &arm, sizeof(arm))
-           && snapshot_read(s, &cpu_events, sizeof(cpu_events));
+    uint32_t events;
+    if(!snapshot_read(s, &arm, sizeof(arm))
+       || !snapshot_read(s, &events, sizeof(events)))
+        return false;
+
+    cpu_events_clear(~EVENT_ASYNC);
+    cpu_events_set(events & ~EVENT_ASYNC);
+    return true;
 }
 
 bool cpu_suspend(emu_snapshot *s)
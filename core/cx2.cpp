@@ -86,7 +86,7 @@ void aladdin_pmu_write(uint32_t addr, uint32_t value) {
     case 0x20:
       if (value & 2) {
         /* enter sleep, jump to 0 when On pressed. */
-        cpu_events |= EVENT_SLEEP;
+        cpu_events_set(EVENT_SLEEP);
         // Without this, the clocks are wrong
         aladdin_pmu_reset();
       } else
@@ -216,60 +216,249 @@ void cx2_lcd_spi_write(uint32_t addr, uint32_t value) {
   }
 }
 
-/* BC000000: An FTDMAC020 */
+/* BC000000: An FTDMAC020
+ * Only one channel transfers at a time, like on the single bus of the real
+ * thing. The data of a block is moved when the block is done, which is
+ * scheduled according to the number of bus cycles it needs.
+ * The interrupt output isn't connected, its line on the VIC is unknown. */
 static dma_state dma;
 
-void dma_cx2_reset() { memset(&dma, 0, sizeof(dma)); }
+enum : uint32_t {
+  // Channel CSR
+  DMA_CSR_EN = 1u << 0,
+  DMA_CSR_ABT = 1u << 15,
+  DMA_CSR_TC_MSK = 1u << 31,
+  // Channel CFG
+  DMA_CFG_INT_TC_MSK = 1u << 0,
+  DMA_CFG_INT_ERR_MSK = 1u << 1,
+  DMA_CFG_INT_ABT_MSK = 1u << 2,
+  DMA_CFG_BUSY = 1u << 8,
+  DMA_CFG_LLP_CNT = 0xFu << 16,
+};
 
 enum class DMAMemDir { INC = 0, DEC = 1, FIX = 2 };
 
-static void dma_cx2_update() {
-  if (!(dma.csr & 1)) // Enabled?
+static void dma_cx2_event(int index);
+
+void dma_cx2_reset() {
+  memset(&dma, 0, sizeof(dma));
+  dma.active = -1;
+
+  sched_init_item(SCHED_DMA, CLOCK_AHB, dma_cx2_event, false);
+}
+
+static uint32_t dma_cx2_read(uint32_t addr, uint32_t bytes) {
+  switch (bytes) {
+  case 1:
+    return mmio_read_byte(addr);
+  case 2:
+    return mmio_read_half(addr);
+  default:
+    return mmio_read_word(addr);
+  }
+}
+
+static void dma_cx2_write(uint32_t addr, uint32_t bytes, uint32_t value) {
+  switch (bytes) {
+  case 1:
+    return mmio_write_byte(addr, value);
+  case 2:
+    return mmio_write_half(addr, value);
+  default:
+    return mmio_write_word(addr, value);
+  }
+}
+
+static uint32_t dma_cx2_step(DMAMemDir dir, uint32_t bytes) {
+  return dir == DMAMemDir::INC ? bytes : dir == DMAMemDir::DEC ? -bytes : 0;
+}
+
+/* Like memmove into RAM, but calls write_action where needed. That's only
+ * checked word by word in pages which may have translations or breakpoints. */
+static void dma_cx2_copy_to_ram(uint8_t *dst, const uint8_t *src, size_t size) {
+  while (size) {
+    size_t chunk = RAM_PAGE_SIZE - (dst - mem_and_flags) % RAM_PAGE_SIZE;
+    if (chunk > size)
+      chunk = size;
+
+    uint8_t page_flags = RAM_PAGE_FLAGS(dst);
+    if (!(page_flags & RPF_READ_ONLY)) {
+      if (page_flags & (RPF_BREAKPOINT | RPF_TRANSLATED | RPF_CODE)) {
+        for (uintptr_t word = (uintptr_t)dst & ~3; word < (uintptr_t)(dst + chunk); word += 4) {
+          if (RAM_FLAGS(word) & DO_WRITE_ACTION)
+            write_action((void *)word);
+        }
+      }
+      memmove(dst, src, chunk);
+    }
+
+    dst += chunk;
+    src += chunk;
+    size -= chunk;
+  }
+}
+
+static bool dma_cx2_widths(uint32_t control, uint32_t *srcbytes, uint32_t *dstbytes) {
+  uint32_t dstwidth = (control >> 8) & 7, srcwidth = (control >> 11) & 7;
+  if (dstwidth > 2 || srcwidth > 2)
+    return false;
+
+  *srcbytes = 1 << srcwidth;
+  *dstbytes = 1 << dstwidth;
+  return true;
+}
+
+/* Number of AHB cycles for the current block: a read and a write per beat */
+static uint32_t dma_cx2_block_cycles(int ch) {
+  auto &channel = dma.channels[ch];
+  uint32_t srcbytes, dstbytes;
+  if (!dma_cx2_widths(channel.control, &srcbytes, &dstbytes))
+    return 1;
+
+  return channel.len + channel.len * srcbytes / dstbytes + 1;
+}
+
+/* Moves the data of the current block. Returns false for invalid settings. */
+static bool dma_cx2_transfer(int ch) {
+  auto &channel = dma.channels[ch];
+
+  auto dstdir = DMAMemDir((channel.control >> 3) & 3),
+       srcdir = DMAMemDir((channel.control >> 5) & 3);
+  uint32_t srcbytes, dstbytes;
+  if (dstdir > DMAMemDir::FIX || srcdir > DMAMemDir::FIX ||
+      !dma_cx2_widths(channel.control, &srcbytes, &dstbytes))
+    return false;
+
+  uint32_t total_len = channel.len * srcbytes;
+  if (total_len % dstbytes)
+    return false;
+
+  // Memory to memory in bulk
+  if (srcdir == DMAMemDir::INC && dstdir == DMAMemDir::INC) {
+    uint8_t *srcp = (uint8_t *)phys_mem_ptr(channel.src, total_len),
+            *dstp = (uint8_t *)phys_mem_ptr(channel.dest, total_len);
+    if (srcp && dstp) {
+      dma_cx2_copy_to_ram(dstp, srcp, total_len);
+      channel.src += total_len;
+      channel.dest += total_len;
+      channel.len = 0;
+      return true;
+    }
+  }
+
+  // Otherwise beat by beat, e.g. from or to a FIFO
+  uint32_t unit = srcbytes > dstbytes ? srcbytes : dstbytes;
+  for (uint32_t done = 0; done < total_len; done += unit) {
+    uint32_t value = 0;
+    for (uint32_t i = 0; i < unit; i += srcbytes) {
+      value |= dma_cx2_read(channel.src, srcbytes) << (i * 8);
+      channel.src += dma_cx2_step(srcdir, srcbytes);
+    }
+    for (uint32_t i = 0; i < unit; i += dstbytes) {
+      dma_cx2_write(channel.dest, dstbytes, value >> (i * 8));
+      channel.dest += dma_cx2_step(dstdir, dstbytes);
+    }
+  }
+
+  channel.len = 0;
+  return true;
+}
+
+/* Loads the next block of a scatter/gather chain */
+static void dma_cx2_load_llp(int ch) {
+  auto &channel = dma.channels[ch];
+  uint32_t lli = channel.llp & ~3;
+
+  uint32_t control = mmio_read_word(lli + 0x0C);
+  channel.src = mmio_read_word(lli + 0x00);
+  channel.dest = mmio_read_word(lli + 0x04);
+  channel.llp = mmio_read_word(lli + 0x08);
+  channel.len = mmio_read_word(lli + 0x10) & 0x003fffff;
+
+  // The descriptor has the same fields as the CSR, but packed differently
+  const uint32_t lli_fields = DMA_CSR_TC_MSK | (0x3F << 8) | (0xF << 3) | (3 << 1);
+  channel.control = (channel.control & ~lli_fields) |
+                    ((control >> 28) & 1) << 31 | // TC_MSK
+                    ((control >> 25) & 7) << 11 | // SRC_WIDTH
+                    ((control >> 22) & 7) << 8 |  // DST_WIDTH
+                    ((control >> 20) & 3) << 5 |  // SRCAD_CTL
+                    ((control >> 18) & 3) << 3 |  // DSTAD_CTL
+                    ((control >> 17) & 1) << 2 |  // SRC_SEL
+                    ((control >> 16) & 1) << 1;   // DST_SEL
+
+  channel.config = (channel.config & ~DMA_CFG_LLP_CNT) |
+                   ((channel.config + (1 << 16)) & DMA_CFG_LLP_CNT);
+}
+
+/* Schedules the highest priority enabled channel if the bus is free.
+ * Has to use event_repeat if called from the event itself. */
+static void dma_cx2_start_next(bool from_event) {
+  if (dma.active >= 0 || !(dma.csr & 1)) // Busy or disabled?
     return;
 
   if (dma.csr & 0b110) // Big-endian?
     return;
 
-  for (auto &channel : dma.channels) {
-    if (!(channel.control & 1)) // Start?
+  for (int ch = 0; ch < 8; ++ch) {
+    if (!(dma.channels[ch].control & DMA_CSR_EN))
       continue;
 
-    if ((channel.control & 0b110) != 0b110) // AHB1?
-      error("Not implemented");
-
-    if (channel.control & (1 << 15)) // Abort
-      error("Not implemented");
-
-    auto dstdir = DMAMemDir((channel.control >> 3) & 3),
-         srcdir = DMAMemDir((channel.control >> 5) & 3);
-
-    if (srcdir != DMAMemDir::INC || dstdir != DMAMemDir::INC)
-      error("Not implemented");
+    // CHPRI, higher wins, lower channel number on ties
+    if (dma.active < 0 || ((dma.channels[ch].control >> 22) & 3) > ((dma.channels[dma.active].control >> 22) & 3))
+      dma.active = ch;
+  }
 
-    auto dstwidth = (channel.control >> 8) & 7,
-         srcwidth = (channel.control >> 11) & 7;
+  if (dma.active < 0)
+    return;
 
-    if (dstwidth != srcwidth || dstwidth > 2)
-      error("Not implemented");
+  if (from_event)
+    event_repeat(SCHED_DMA, dma_cx2_block_cycles(dma.active));
+  else
+    event_set(SCHED_DMA, dma_cx2_block_cycles(dma.active));
+}
 
-    // Convert to bytes
-    srcwidth = 1 << srcwidth;
+static void dma_cx2_event(int index) {
+  (void)index;
 
-    size_t total_len = channel.len * srcwidth;
+  int ch = dma.active;
+  dma.active = -1;
+  if (ch < 0)
+    return;
 
-    void *srcp = phys_mem_ptr(channel.src, total_len),
-         *dstp = phys_mem_ptr(channel.dest, total_len);
+  auto &channel = dma.channels[ch];
+  if (!dma_cx2_transfer(ch)) {
+    warn("Unsupported DMA transfer on channel %d: %08x", ch, channel.control);
+    dma.err_abt |= 1 << ch;
+    channel.control &= ~DMA_CSR_EN;
+  } else {
+    if (!(channel.control & DMA_CSR_TC_MSK))
+      dma.tc |= 1 << ch;
+
+    if (channel.llp)
+      dma_cx2_load_llp(ch);
+    else
+      channel.control &= ~DMA_CSR_EN;
+  }
 
-    if (!srcp || !dstp)
-      error("Invalid DMA transfer?");
+  dma_cx2_start_next(true);
+}
 
-    /* Doesn't trigger any read or write actions, but on HW
-     * special care has to be taken anyway regarding caches
-     * and so on, so should be fine. */
-    memcpy(dstp, srcp, total_len);
+static void dma_cx2_stop(int ch) {
+  dma.channels[ch].control &= ~DMA_CSR_EN;
+  if (dma.active == ch) {
+    dma.active = -1;
+    event_clear(SCHED_DMA);
+    dma_cx2_start_next(false);
+  }
+}
 
-    channel.control &= ~1; // Clear start bit
+/* Status bits of channels which don't have them masked in their CFG */
+static uint32_t dma_cx2_masked(uint32_t status, uint32_t mask_bit) {
+  for (int ch = 0; ch < 8; ++ch) {
+    if (dma.channels[ch].config & mask_bit)
+      status &= ~(1 << ch);
   }
+  return status;
 }
 
 uint32_t dma_cx2_read_word(uint32_t addr) {
@@ -281,7 +470,7 @@ uint32_t dma_cx2_read_word(uint32_t addr) {
     case 0x00:
       return dma.channels[ch].control;
     case 0x04:
-      return dma.channels[ch].config;
+      return dma.channels[ch].config | ((dma.channels[ch].control & DMA_CSR_EN) ? uint32_t(DMA_CFG_BUSY) : 0);
     case 0x08:
       return dma.channels[ch].src;
     case 0x0C:
@@ -293,13 +482,32 @@ uint32_t dma_cx2_read_word(uint32_t addr) {
     }
   }
 
+  uint32_t tc = dma_cx2_masked(dma.tc, DMA_CFG_INT_TC_MSK),
+           err_abt = dma_cx2_masked(dma.err_abt & 0xFF, DMA_CFG_INT_ERR_MSK) |
+                     dma_cx2_masked(dma.err_abt >> 16, DMA_CFG_INT_ABT_MSK) << 16;
+
   switch (offset) {
+  case 0x000:
+    return tc | (err_abt & 0xFF) | (err_abt >> 16);
+  case 0x004:
+    return tc;
   case 0x00C:
-    return 0;
+    return err_abt;
+  case 0x014:
+    return dma.tc;
+  case 0x018:
+    return dma.err_abt;
   case 0x01C:
-    return 0;
+  case 0x020: {
+    uint32_t enabled = 0;
+    for (int ch = 0; ch < 8; ++ch)
+      enabled |= (dma.channels[ch].control & DMA_CSR_EN) ? 1 << ch : 0;
+    return enabled;
+  }
   case 0x024:
     return dma.csr;
+  case 0x028:
+    return dma.sync;
   }
   return usb_cx2_read_word(addr);
 }
@@ -311,11 +519,22 @@ void dma_cx2_write_word(uint32_t addr, uint32_t value) {
     int reg = (offset - 0x100) % 0x20;
     switch (reg) {
     case 0x00:
-      dma.channels[ch].control = value;
-      dma_cx2_update();
+      if (value & DMA_CSR_ABT) {
+        if (dma.channels[ch].control & DMA_CSR_EN)
+          dma.err_abt |= 1 << (ch + 16);
+        dma.channels[ch].control = value & ~(DMA_CSR_ABT | DMA_CSR_EN);
+        dma_cx2_stop(ch);
+      } else if (dma.active == ch) {
+        // Settings of a running block can't be changed
+        if (!(value & DMA_CSR_EN))
+          dma_cx2_stop(ch);
+      } else {
+        dma.channels[ch].control = value;
+        dma_cx2_start_next(false);
+      }
       break;
     case 0x04:
-      dma.channels[ch].config = value;
+      dma.channels[ch].config = value & ~DMA_CFG_BUSY;
       break;
     case 0x08:
       dma.channels[ch].src = value;
@@ -334,8 +553,18 @@ void dma_cx2_write_word(uint32_t addr, uint32_t value) {
   }
 
   switch (offset) {
+  case 0x008:
+    dma.tc &= ~value;
+    return;
+  case 0x010:
+    dma.err_abt &= ~value;
+    return;
   case 0x024:
     dma.csr = value;
+    dma_cx2_start_next(false);
+    return;
+  case 0x028:
+    dma.sync = value;
     return;
   }
   usb_cx2_write_word(addr, value);
@@ -41,7 +41,11 @@ uint32_t cx2_lcd_spi_read(uint32_t addr);
 void cx2_lcd_spi_write(uint32_t addr, uint32_t value);
 
 typedef struct dma_state {
-  uint32_t csr; // 0x24
+  uint32_t csr;     // 0x24
+  uint32_t sync;    // 0x28
+  uint32_t tc;      // 0x14: Raw terminal count status, one bit per channel
+  uint32_t err_abt; // 0x18: Raw error (bits 0-7) and abort (bits 16-23) status
+  int active;       // Channel whose current block ends with SCHED_DMA, -1 if none
   struct {
     uint32_t control;   // +0x00
     uint32_t config;    // +0x04
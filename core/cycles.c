@@ -0,0 +1,168 @@
+#include <string.h>
+
+#include "cycles.h"
+
+static const struct cycle_costs models[] = {
+    // Every instruction takes one cycle
+    { .name = "flat", .alu = 1, .mul = 1, .mul_s = 1, .mul_long = 1, .mul_long_s = 1,
+      .load = 1, .load_pc = 1, .store = 1, .swap = 1, .multi_min = 1, .branch = 1,
+      .psr_read = 1, .psr_write = 1, .coproc = 1, .swi = 1 },
+    /* ARM926EJ-S, from the instruction cycle timings of its TRM. Loads are
+     * assumed to hit the cache and to not interlock with the next instruction. */
+    { .name = "arm926", .alu = 1, .shift_reg = 1, .alu_pc = 2, .mul = 2, .mul_s = 4, .mul_long = 3, .mul_long_s = 5,
+      .load = 1, .load_pc = 5, .store = 1, .swap = 2, .multi_reg = 1, .multi_min = 2, .multi_pc = 4, .branch = 3,
+      .psr_read = 2, .psr_write = 3, .coproc = 2, .swi = 3 },
+};
+
+// Flat by default, the others change the timing software sees
+static const struct cycle_costs *costs = &models[0];
+static unsigned int miss;
+
+bool cycle_model_set(const char *name, unsigned int miss_penalty)
+{
+    for (unsigned int i = 0; i < sizeof(models) / sizeof(*models); i++) {
+        if (strcmp(models[i].name, name) == 0) {
+            costs = &models[i];
+            miss = miss_penalty;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *cycle_model_name(void)
+{
+    return costs->name;
+}
+
+unsigned int cycle_miss_penalty(void)
+{
+    return miss;
+}
+
+static uint32_t multi_cycles(unsigned int regs, bool load_pc)
+{
+    uint32_t cycles = regs * costs->multi_reg;
+    if (cycles < costs->multi_min)
+        cycles = costs->multi_min;
+    return cycles + (load_pc ? costs->multi_pc : 0) + miss;
+}
+
+static uint32_t load_cycles(bool to_pc)
+{
+    return (to_pc ? costs->load_pc : costs->load) + miss;
+}
+
+uint32_t arm_insn_cycles(uint32_t insn)
+{
+    bool rd_pc = (insn >> 12 & 15) == 15, load = insn >> 20 & 1;
+
+    if (insn >> 28 == 15) {
+        // BLX imm, PLD and other unconditional instructions
+        return (insn >> 25 & 7) == 5 ? costs->branch : costs->alu;
+    }
+
+    switch (insn >> 25 & 7) {
+    case 0:
+        if ((insn & 0x0FC000F0) == 0x00000090)
+            return load ? costs->mul_s : costs->mul;
+        if ((insn & 0x0F8000F0) == 0x00800090)
+            return load ? costs->mul_long_s : costs->mul_long;
+        if ((insn & 0x0FB00FF0) == 0x01000090)
+            return costs->swap + miss;
+        if ((insn & 0x0E000090) == 0x00000090) {
+            // LDRH/STRH/LDRSB/LDRSH, LDRD and STRD
+            if (load)
+                return load_cycles(rd_pc);
+            if ((insn & 0x60) >= 0x40)
+                return multi_cycles(2, false);
+            return costs->store + miss;
+        }
+        if ((insn & 0x0FFFFFD0) == 0x012FFF10)
+            return costs->branch; // BX/BLX
+        if ((insn & 0x0F900000) == 0x01000000) {
+            // Miscellaneous instructions in the space of TST/TEQ/CMP/CMN without S
+            if ((insn & 0x0FBF0FFF) == 0x010F0000)
+                return costs->psr_read;
+            if ((insn & 0x0FB0FFF0) == 0x0120F000)
+                return costs->psr_write;
+            if ((insn & 0x90) == 0x80)
+                return costs->mul; // SMLAxy and friends
+            return costs->alu;
+        }
+        return costs->alu + (insn & 0x10 ? costs->shift_reg : 0)
+               + (rd_pc && (insn >> 23 & 3) != 2 ? costs->alu_pc : 0);
+    case 1:
+        if ((insn & 0x0FB00000) == 0x03200000)
+            return costs->psr_write;
+        return costs->alu + (rd_pc && (insn >> 23 & 3) != 2 ? costs->alu_pc : 0);
+    case 2:
+    case 3:
+        if ((insn & 0x02000010) == 0x02000010)
+            return costs->alu; // Undefined
+        return load ? load_cycles(rd_pc) : costs->store + miss;
+    case 4:
+        return multi_cycles(__builtin_popcount(insn & 0xFFFF), load && (insn & 0x8000));
+    case 5:
+        return costs->branch;
+    case 6:
+        return costs->coproc;
+    default:
+        return insn & 0x01000000 ? costs->swi : costs->coproc;
+    }
+}
+
+uint32_t thumb_insn_cycles(uint16_t insn)
+{
+    switch (insn >> 12) {
+    case 0: case 1: case 2: case 3:
+        return costs->alu;
+    case 4:
+        if (insn < 0x4400) {
+            if ((insn & 0xFFC0) == 0x4340)
+                return costs->mul_s;
+            unsigned int op = insn >> 6 & 15;
+            if (op == 2 || op == 3 || op == 4 || op == 7)
+                return costs->alu + costs->shift_reg; // Shifts by register
+            return costs->alu;
+        }
+        if (insn < 0x4800) {
+            if ((insn & 0xFF00) == 0x4700)
+                return costs->branch; // BX/BLX
+            // ADD and MOV with high registers can write the PC
+            bool rd_pc = ((insn & 7) | (insn >> 4 & 8)) == 15;
+            return costs->alu + (rd_pc && (insn & 0x0300) != 0x0100 ? costs->alu_pc : 0);
+        }
+        return load_cycles(false); // LDR PC-relative
+    case 5:
+        return (insn >> 9 & 7) >= 3 ? load_cycles(false) : costs->store + miss;
+    case 6: case 7: case 8: case 9:
+        return insn & 0x0800 ? load_cycles(false) : costs->store + miss;
+    case 10:
+        return costs->alu;
+    case 11:
+        if ((insn & 0x0600) == 0x0400) // PUSH/POP
+            return multi_cycles(__builtin_popcount(insn & 0x1FF), (insn & 0x0900) == 0x0900);
+        return costs->alu;
+    case 12:
+        return multi_cycles(__builtin_popcount(insn & 0xFF), false);
+    case 13:
+        if ((insn & 0x0F00) == 0x0F00)
+            return costs->swi;
+        return (insn & 0x0F00) == 0x0E00 ? costs->alu : costs->branch;
+    case 14:
+        return costs->branch;
+    default:
+        // First half of BL is a plain register write
+        return insn & 0x0800 ? costs->branch : costs->alu;
+    }
+}
+
+void cycles_fill_block(uint32_t *cycles, const uint32_t *start, const uint32_t *end)
+{
+    uint32_t sum = 0;
+    for (size_t i = end - start; i-- > 0;) {
+        sum += arm_insn_cycles(start[i]);
+        cycles[i] = sum;
+    }
+}
@@ -0,0 +1,50 @@
+/* Declarations for cycles.c */
+
+#ifndef _H_CYCLES
+#define _H_CYCLES
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* How many cycles an instruction advances the emulated time. The interpreters
+ * add the cost of each instruction before executing it, translated blocks get
+ * the sums precomputed by cycles_fill_block. Costs are static: conditional
+ * instructions cost the same whether they pass or not, interlocks and waits
+ * for memory are only covered by the miss penalty. */
+struct cycle_costs {
+    const char *name;
+    uint8_t alu;        // Data processing
+    uint8_t shift_reg;  // Extra for shifts by a register
+    uint8_t alu_pc;     // Extra for writing the PC
+    uint8_t mul, mul_s, mul_long, mul_long_s;
+    uint8_t load, load_pc, store, swap;
+    uint8_t multi_reg;  // LDM/STM per register
+    uint8_t multi_min;
+    uint8_t multi_pc;   // Extra for loading the PC
+    uint8_t branch;     // B, BL, BX and BLX, including the refill
+    uint8_t psr_read, psr_write, coproc, swi;
+};
+
+/* Sets the cost table by name ("flat" or "arm926") and the number of cycles
+ * added to each instruction which accesses memory, as an estimate for cache
+ * misses. As translations contain precomputed costs, this has to happen
+ * before the emulation starts or be followed by flush_translations. */
+bool cycle_model_set(const char *name, unsigned int miss_penalty);
+const char *cycle_model_name(void);
+unsigned int cycle_miss_penalty(void);
+
+uint32_t arm_insn_cycles(uint32_t insn);
+uint32_t thumb_insn_cycles(uint16_t insn);
+
+/* For translations: cycles[i] is the cost of start[i] until end */
+void cycles_fill_block(uint32_t *cycles, const uint32_t *start, const uint32_t *end);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
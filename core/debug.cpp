@@ -16,6 +16,8 @@
 #include <netinet/tcp.h>
 #endif
 
+#include <algorithm>
+#include <chrono>
 #include <condition_variable>
 
 #include "armsnippets.h"
@@ -29,10 +31,16 @@
 #include "translate.h"
 #include "usblink_queue.h"
 #include "gdbstub.h"
+#include "iothread.h"
+#include "rewind.h"
 #include "os/os.h"
 
 std::string ln_target_folder;
 
+// For the rates shown by the "stats" command
+static struct mem_stats stats_prev;
+static auto stats_prev_time = std::chrono::steady_clock::now();
+
 // Used for debugger input
 static std::mutex debug_input_m;
 static std::condition_variable debug_input_cv;
@@ -176,6 +184,7 @@ static void set_debug_next(uint32_t *next) {
         if (RAM_FLAGS(next) & RF_CODE_TRANSLATED)
             flush_translations();
         RAM_FLAGS(next) |= RF_EXEC_DEBUG_NEXT;
+        RAM_PAGE_FLAGS(next) |= RPF_BREAKPOINT;
     }
     debug_next = next;
 }
@@ -204,9 +213,13 @@ int process_debug_cmd(char *cmdline) {
                     "pr <address> - port or memory read\n"
                     "pw <address> <value> - port or memory write\n"
                     "r - show registers\n"
+                    "rewind - list saved states\n"
+                    "rewind <seconds> - go back in time\n"
+                    "rewind on [seconds]|off - keep the last seconds (default 10)\n"
                     "rs <regnum> <value> - change register value\n"
                     "ss <address> <length> <string> - search a string\n"
                     "s - step instruction\n"
+                    "stats [reset] - memory access counters, rates since the last stats\n"
                     "t+ - enable instruction translation\n"
                     "t- - disable instruction translation\n"
                     "u[a|t] [address] - disassemble memory\n"
@@ -219,6 +232,16 @@ int process_debug_cmd(char *cmdline) {
         backtrace(fp ? parse_expr(fp) : arm.reg[11]);
     } else if (!strcasecmp(cmd, "mmu")) {
         mmu_dump_tables();
+    } else if (!strcasecmp(cmd, "stats")) {
+        auto now = std::chrono::steady_clock::now();
+        char *arg = strtok(NULL, " \n\r");
+        if (arg && !strcasecmp(arg, "reset"))
+            memset(&mem_stats, 0, sizeof(mem_stats));
+        else
+            mem_stats_print(&stats_prev, std::chrono::duration<double>(now - stats_prev_time).count());
+
+        stats_prev = mem_stats;
+        stats_prev_time = now;
     } else if (!strcasecmp(cmd, "r")) {
         int i, show_spsr;
         uint32_t cpsr = get_cpsr();
@@ -248,6 +271,18 @@ int process_debug_cmd(char *cmdline) {
         if (show_spsr)
             gui_debug_printf(" spsr=%08x", get_spsr());
         gui_debug_printf("\n");
+    } else if (!strcasecmp(cmd, "rewind")) {
+        char *arg = strtok(NULL, " \n\r");
+        if (!arg) {
+            rewind_list();
+        } else if (!strcasecmp(arg, "on")) {
+            char *seconds = strtok(NULL, " \n\r");
+            rewind_enable(seconds ? atoi(seconds) : 10);
+        } else if (!strcasecmp(arg, "off")) {
+            rewind_enable(0);
+        } else if (rewind_request(atof(arg))) {
+            return 1; // Continues at the restored state in the debugger
+        }
     } else if (!strcasecmp(cmd, "rs")) {
         char *reg = strtok(NULL, " \n\r");
         if (!reg) {
@@ -275,6 +310,7 @@ int process_debug_cmd(char *cmdline) {
             void *ptr = virt_mem_ptr(addr & ~3, 4);
             if (ptr) {
                 uint32_t *flags = &RAM_FLAGS(ptr);
+                RAM_PAGE_FLAGS(ptr) |= RPF_BREAKPOINT;
                 bool on = true;
                 for (; *flag_str; flag_str++) {
                     switch (tolower(*flag_str)) {
@@ -303,17 +339,20 @@ int process_debug_cmd(char *cmdline) {
         } else {
             unsigned int area;
             for (area = 0; area < sizeof(mem_areas)/sizeof(*mem_areas); area++) {
-                uint32_t *flags;
-                uint32_t *flags_start = &RAM_FLAGS(mem_areas[area].ptr);
-                uint32_t *flags_end = &RAM_FLAGS(mem_areas[area].ptr + mem_areas[area].size);
-                for (flags = flags_start; flags != flags_end; flags++) {
-                    uint32_t addr = mem_areas[area].base + ((uint8_t *)flags - (uint8_t *)flags_start);
-                    if (*flags & (RF_READ_BREAKPOINT | RF_WRITE_BREAKPOINT | RF_EXEC_BREAKPOINT)) {
+                for (uint32_t offset = 0; offset < mem_areas[area].size; offset += 4) {
+                    uint8_t *ptr = mem_areas[area].ptr + offset;
+                    // Skip pages which never had a breakpoint
+                    if (!(RAM_PAGE_FLAGS(ptr) & RPF_BREAKPOINT)) {
+                        offset += RAM_PAGE_SIZE - ((uintptr_t)ptr & (RAM_PAGE_SIZE - 1)) - 4;
+                        continue;
+                    }
+                    uint32_t flags = RAM_FLAGS(ptr);
+                    if (flags & (RF_READ_BREAKPOINT | RF_WRITE_BREAKPOINT | RF_EXEC_BREAKPOINT)) {
                         gui_debug_printf("%08x %c%c%c\n",
-                                         addr,
-                                         (*flags & RF_READ_BREAKPOINT)  ? 'r' : ' ',
-                                         (*flags & RF_WRITE_BREAKPOINT) ? 'w' : ' ',
-                                         (*flags & RF_EXEC_BREAKPOINT)  ? 'x' : ' ');
+                                         mem_areas[area].base + offset,
+                                         (flags & RF_READ_BREAKPOINT)  ? 'r' : ' ',
+                                         (flags & RF_WRITE_BREAKPOINT) ? 'w' : ' ',
+                                         (flags & RF_EXEC_BREAKPOINT)  ? 'x' : ' ');
                     }
                 }
             }
@@ -321,7 +360,7 @@ int process_debug_cmd(char *cmdline) {
     } else if (!strcasecmp(cmd, "c")) {
         return 1;
     } else if (!strcasecmp(cmd, "s")) {
-        cpu_events |= EVENT_DEBUG_STEP;
+        cpu_events_set(EVENT_DEBUG_STEP);
         return 1;
     } else if (!strcasecmp(cmd, "n")) {
         set_debug_next((uint32_t*) virt_mem_ptr(arm.reg[15] & ~3, 4) + 1);
@@ -580,7 +619,7 @@ static void native_debugger(void) {
     }
 
     if (cpu_events & EVENT_DEBUG_STEP) {
-        cpu_events &= ~EVENT_DEBUG_STEP;
+        cpu_events_clear(EVENT_DEBUG_STEP);
         disasm_insn(arm.reg[15]);
     }
 
@@ -624,6 +663,8 @@ static void native_debugger(void) {
 
 static int listen_socket_fd = -1;
 static int socket_fd = -1;
+// Whether the I/O thread reads socket_fd, see rdebug_split
+static bool socket_attached = false;
 
 static void log_socket_error(const char *msg) {
 #ifdef __MINGW32__
@@ -684,12 +725,55 @@ bool rdebug_bind(unsigned int port) {
         return false;
     }
 
+    io_watch(listen_socket_fd, IO_RDEBUG);
     return true;
 }
 
+static void rdebug_disconnect(void) {
+    if (socket_attached)
+        io_detach(IO_RDEBUG);
+    else
+        io_unwatch(socket_fd);
+    socket_attached = false;
+#ifdef __MINGW32__
+    closesocket(socket_fd);
+#else
+    close(socket_fd);
+#endif
+    socket_fd = -1;
+    io_watch(listen_socket_fd, IO_RDEBUG);
+}
+
 static char rdebug_inbuf[MAX_CMD_LEN];
 size_t rdebug_inbuf_used = 0;
 
+// Splits the data into lines for the I/O thread, see io_split_fn
+static size_t rdebug_split(const char *data, size_t size, char *req, size_t *req_len) {
+    const char *line_end = (const char*)memchr(data, '\n', std::min(size, size_t(MAX_CMD_LEN)));
+    if (!line_end) {
+        *req_len = 0;
+        // Drop commands which are too long
+        return size < MAX_CMD_LEN ? 0 : MAX_CMD_LEN;
+    }
+
+    *req_len = line_end - data;
+    memcpy(req, data, *req_len);
+    return *req_len + 1;
+}
+
+// Runs the commands the I/O thread got
+static void rdebug_take_requests(void) {
+    static char req[IO_REQUEST_MAX];
+    int len = 0;
+    while (socket_attached && (len = io_take_request(IO_RDEBUG, req, 0)) > 0)
+        process_debug_cmd(req);
+
+    if (socket_attached && len == -1) {
+        gui_debug_printf("Remote debug: connection closed.\n");
+        rdebug_disconnect();
+    }
+}
+
 void rdebug_recv(void) {
     if(listen_socket_fd == -1)
         return;
@@ -697,8 +781,10 @@ void rdebug_recv(void) {
     int ret, on;
     if (socket_fd == -1) {
         ret = accept(listen_socket_fd, NULL, NULL);
-        if (ret == -1)
+        if (ret == -1) {
+            io_watch(listen_socket_fd, IO_RDEBUG);
             return;
+        }
         socket_fd = ret;
         set_nonblocking(socket_fd, true);
         /* Disable Nagle for low latency */
@@ -711,6 +797,14 @@ void rdebug_recv(void) {
         if (ret == -1)
             log_socket_error("Remote debug: setsockopt(TCP_NODELAY) failed for socket");
         gui_debug_printf("Remote debug: connected.\n");
+        socket_attached = io_attach(socket_fd, IO_RDEBUG, rdebug_split);
+        if (!socket_attached)
+            io_watch(socket_fd, IO_RDEBUG);
+        return;
+    }
+
+    if (socket_attached) {
+        rdebug_take_requests();
         return;
     }
 
@@ -723,19 +817,14 @@ void rdebug_recv(void) {
         ret = select(socket_fd + 1, &rfds, NULL, NULL, &zero);
         if (ret == -1 && errno == EBADF) {
             gui_debug_printf("Remote debug: connection closed.\n");
-            #ifdef __MINGW32__
-                closesocket(socket_fd);
-            #else
-                close(socket_fd);
-            #endif
-            socket_fd = -1;
+            rdebug_disconnect();
+            return;
         }
         else if (!ret) // No data available
         {
             if(exiting)
             {
-                close(socket_fd);
-                socket_fd = -1;
+                rdebug_disconnect();
                 return;
             }
 
@@ -758,20 +847,17 @@ void rdebug_recv(void) {
 #endif
     if (!rv) {
         gui_debug_printf("Remote debug: connection closed.\n");
-#ifdef __MINGW32__
-        closesocket(socket_fd);
-#else
-        close(socket_fd);
-#endif
-        socket_fd = -1;
+        rdebug_disconnect();
         return;
     }
     if (rv < 0 && errno == EAGAIN) {
         /* no data for now, call back when the socket is readable */
+        io_watch(socket_fd, IO_RDEBUG);
         return;
     }
     if (rv < 0) {
         log_socket_error("Remote debug: connection error");
+        rdebug_disconnect();
         return;
     }
     rdebug_inbuf_used += rv;
@@ -786,6 +872,9 @@ void rdebug_recv(void) {
     /* Shift buffer down so the unprocessed data is at the start */
     rdebug_inbuf_used -= (line_start - rdebug_inbuf);
     memmove(rdebug_inbuf, line_start, rdebug_inbuf_used);
+
+    if (socket_fd != -1)
+        io_watch(socket_fd, IO_RDEBUG);
 }
 
 bool in_debugger = false;
@@ -795,6 +884,10 @@ void debugger(enum DBG_REASON reason, uint32_t addr) {
     if (in_debugger)
         return;
 
+    /* Single steps of a reverse execution. */
+    if (rewind_reverse_debugger(reason))
+        return;
+
     gui_debugger_entered_or_left(in_debugger = true);
     if (gdb_connected)
         gdbstub_debugger(reason, addr);
@@ -807,6 +900,11 @@ void rdebug_quit()
 {
     if(socket_fd != -1)
     {
+        if (socket_attached)
+            io_detach(IO_RDEBUG);
+        else
+            io_unwatch(socket_fd);
+        socket_attached = false;
         #ifdef __MINGW32__
             closesocket(socket_fd);
         #else
@@ -817,6 +915,7 @@ void rdebug_quit()
 
     if(listen_socket_fd != -1)
     {
+        io_unwatch(listen_socket_fd);
         #ifdef __MINGW32__
             closesocket(listen_socket_fd);
         #else
@@ -1,27 +1,40 @@
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
 #include <chrono>
+#include <condition_variable>
 #include <cstdint>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
 
-#include <fcntl.h>
-#include <unistd.h>
-
-#include <zlib.h>
-
+#include "cx2.h"
 #include "debug.h"
+#include "des.h"
 #include "emu.h"
 #include "gdbstub.h"
+#include "interrupt.h"
+#include "iothread.h"
+#include "keypad.h"
+#include "lcd.h"
 #include "mem.h"
 #include "misc.h"
 #include "mmu.h"
 #include "os/os.h"
+#include "replay.h"
+#include "rewind.h"
 #include "schedule.h"
+#include "sha256.h"
+#include "snapshot_file.h"
 #include "translate.h"
+#include "usb.h"
+#include "usb_cx2.h"
 #include "usblink_queue.h"
 
 /* cycle_count_delta is a (usually negative) number telling what the time is
- * relative to the next scheduled event. See sched.c */
+ * relative to the next scheduled event. See schedule.h */
 int cycle_count_delta = 0;
 
 uint32_t cpu_events;
@@ -29,10 +42,33 @@ uint32_t cpu_events;
 bool do_translate = true;
 uint32_t product = 0x0E0, features = 0, asic_user_flags = 0;
 bool turbo_mode = false;
-
-bool exiting, debug_on_start, debug_on_warn, print_on_warn;
+double speed_target = 1.0;
+unsigned int cpu_limit = 0;
+unsigned int emu_stop_after_ms = 0;
+FILE *mem_stats_sample_file = nullptr;
+unsigned int mem_stats_sample_ms = 1000;
+struct emu_start_times emu_start_times;
+bool print_start_times;
+// Set by emu_start until emu_loop measured emu_start_times.first_insn
+static std::chrono::steady_clock::time_point emu_start_time;
+static bool emu_start_pending;
+
+volatile sig_atomic_t exiting;
+bool debug_on_start, debug_on_warn, print_on_warn;
 BootOrder boot_order = ORDER_DEFAULT;
-std::string path_boot1, path_flash;
+std::string path_boot1, path_flash, path_flash_overlay;
+
+bool snapshot_deltas = false;
+/* The snapshot which matches the memory in all pages with RPF_CLEAN_SNAPSHOT,
+ * deltas refer to it, followed by the snapshots it is based on. Empty if there
+ * is none. */
+static std::vector<std::string> snapshot_chain;
+// Header id of snapshot_chain[0]
+static uint64_t snapshot_parent_id;
+// Set from the writer thread if writing snapshot_chain[0] failed
+static std::atomic<bool> snapshot_parent_failed;
+// Longest chain of deltas, so that a cycle can't recurse endlessly
+#define SNAPSHOT_CHAIN_MAX 256
 
 #if defined(IS_IOS_BUILD) || defined(__EMSCRIPTEN__)
 // on iOS, setjmp and longjmp are broken and builtins setfault clang
@@ -108,7 +144,7 @@ __attribute__((noreturn)) void error(const char *fmt, ...) {
   gui_debug_printf("\n");
   va_end(va);
   debugger(DBG_EXCEPTION, 0);
-  cpu_events |= EVENT_RESET;
+  cpu_events_set(EVENT_RESET);
   return_to_loop();
 }
 
@@ -116,12 +152,96 @@ void return_to_loop() { emu_longjmp(restart_after_exception); }
 
 extern "C" void usblink_timer();
 
-// Store the last time the throttle event happened
+// Store the last time the throttle event happened, in real and virtual time
 static auto last_throttle = std::chrono::steady_clock::now();
+static uint64_t last_throttle_cputick;
 // Calculate speed by summing up the elapsed virtual and real time and taking
 // the ratio
 static std::chrono::microseconds real_time_elapsed_sum, virt_time_elapsed_sum;
 
+static double current_speed_target() {
+  // Replays always run as fast as possible
+  return turbo_mode || replay_mode == REPLAY_PLAY ? 0 : speed_target;
+}
+
+/* Sleeps until the deadline. The OS wakes us up late by some amount, so the
+ * last part is spun. How much to spin is learned from how late it was. */
+static void throttle_sleep_until(std::chrono::steady_clock::time_point deadline) {
+  using namespace std::chrono;
+  static auto spin = microseconds(200);
+
+  auto sleep = duration_cast<microseconds>(deadline - steady_clock::now() - spin);
+  if (sleep.count() > 0) {
+    auto wake = steady_clock::now() + sleep;
+    throttle_timer_wait(sleep.count());
+    auto late = duration_cast<microseconds>(steady_clock::now() - wake);
+    spin = std::max(microseconds(50), std::min(microseconds(2000), (spin * 7 + late * 2) / 8));
+  }
+
+  while (steady_clock::now() < deadline)
+    std::this_thread::yield();
+}
+
+/* Waits until the virtual time is where it should be at the target speed.
+ * The deadlines are computed from a fixed reference point instead of the
+ * previous event, so sleep inaccuracies don't add up. */
+static void throttle_pace(std::chrono::milliseconds interval) {
+  using namespace std::chrono;
+  static steady_clock::time_point pace_start;
+  static double pace_speed = -1;
+  static uint64_t pace_intervals;
+  static steady_clock::time_point cpu_window_start;
+  static double cpu_window_start_time;
+
+  auto now = steady_clock::now();
+  auto deadline = now;
+  double speed = current_speed_target();
+  if (speed != pace_speed) {
+    pace_start = now;
+    pace_speed = speed;
+    pace_intervals = 0;
+  } else if (speed > 0) {
+    pace_intervals++;
+    deadline = pace_start + duration_cast<steady_clock::duration>(
+                                duration<double>(interval) * pace_intervals / speed);
+    // Don't try to catch up if it's too far behind, e.g. after a breakpoint
+    if (now - deadline > milliseconds(100)) {
+      pace_start = deadline = now;
+      pace_intervals = 0;
+    }
+  }
+
+  if (cpu_limit) {
+    // Enough real time has to pass for the CPU time to be below the limit
+    double cpu_time = os_cpu_time();
+    if (now - cpu_window_start > seconds(1)) {
+      cpu_window_start = now;
+      cpu_window_start_time = cpu_time;
+    } else {
+      auto cpu_deadline = cpu_window_start + duration_cast<steady_clock::duration>(duration<double>(
+                                                 (cpu_time - cpu_window_start_time) * 100 / cpu_limit));
+      deadline = std::max(deadline, cpu_deadline);
+    }
+  }
+
+  if (deadline > now)
+    throttle_sleep_until(deadline);
+}
+
+// Handles host input the I/O thread reported
+static void io_dispatch() {
+  uint32_t pending = io_take_pending();
+  if (pending & IO_USBLINK)
+    usblink_queue_do();
+  if (pending & IO_GDB)
+    gdbstub_recv();
+  if (pending & IO_RDEBUG)
+    rdebug_recv();
+  // While recording, only at throttle events
+  if ((pending & IO_INPUT) && replay_mode != REPLAY_RECORD)
+    keypad_process_input();
+}
+
 void throttle_interval_event(int index) {
   /* Throttle interval (defined arbitrarily as 100Hz) - used for
    * keeping the emulator speed down, and other miscellaneous stuff
@@ -134,23 +254,23 @@ void throttle_interval_event(int index) {
 
   usblink_queue_do();
 
-  int c = gui_getchar();
+  keypad_process_input();
+
+  replay_throttle_event();
+
+  rewind_throttle_event();
+
+  int c = replay_getchar();
   if (c != -1)
     serial_byte_in((char)c);
 
-  gdbstub_recv();
+  if (!io_thread_running()) {
+    gdbstub_recv();
 
-  rdebug_recv();
+    rdebug_recv();
+  }
 
-  // Compute how much time elapsed since last_throttle
-  auto real_interval = std::chrono::steady_clock::now() - last_throttle;
-  auto real_time_diff = virt_throttle_interval - real_interval;
-  auto real_time_left_us =
-      std::chrono::duration_cast<std::chrono::microseconds>(real_time_diff)
-          .count();
-  // If less than the virtual throttle interval elapsed, wait
-  if (real_time_left_us > 0 && !turbo_mode)
-    throttle_timer_wait(real_time_left_us);
+  throttle_pace(virt_throttle_interval);
 
   // Use this as the new value for last_throttle
   auto new_last_throttle = std::chrono::steady_clock::now();
@@ -169,125 +289,504 @@ void throttle_interval_event(int index) {
     virt_time_elapsed_sum = real_time_elapsed_sum = {};
   }
 
+  if (mem_stats_sample_file) {
+    static struct mem_stats sample_prev;
+    static auto sample_prev_time = new_last_throttle;
+    auto sample_elapsed = new_last_throttle - sample_prev_time;
+    if (sample_elapsed >= std::chrono::milliseconds(mem_stats_sample_ms)) {
+      mem_stats_write_json(mem_stats_sample_file, &sample_prev,
+                           std::chrono::duration<double>(sample_elapsed).count());
+      sample_prev = mem_stats;
+      sample_prev_time = new_last_throttle;
+    }
+  }
+
+  flash_writeback_poll();
+
+  if (emu_stop_after_ms) {
+    emu_stop_after_ms -= std::min<unsigned int>(emu_stop_after_ms, virt_throttle_interval.count());
+    if (!emu_stop_after_ms)
+      exiting = true;
+  }
+
   last_throttle = new_last_throttle;
+  last_throttle_cputick = sched_current_cputick();
 
   gui_do_stuff(true);
 }
 
+static std::mutex idle_mutex;
+static std::condition_variable idle_cond;
+static bool idle_wakeup;
+
+void emu_idle() {
+  double speed = current_speed_target();
+  if (speed <= 0 || exiting) {
+    cycle_count_delta = 0;
+    return;
+  }
+
+  // Map virtual to real time using the last throttle event as reference
+  using namespace std::chrono;
+  double cpu_rate = sched.clock_rates[CLOCK_CPU] * speed;
+  auto to_real = [&](uint64_t cputick) {
+    return last_throttle + microseconds((int64_t)((cputick - last_throttle_cputick) * 1e6 / cpu_rate));
+  };
+  // The next throttle event is at most 10ms away, don't trust the mapping beyond that
+  auto max_wait = duration_cast<steady_clock::duration>(duration<double>(0.01 / speed));
+  auto deadline = std::min(to_real(sched.next_cputick), steady_clock::now() + max_wait);
+
+  bool woken;
+  {
+    std::unique_lock<std::mutex> lock(idle_mutex);
+    // While recording, input only gets applied in the throttle event anyway
+    woken = idle_cond.wait_until(lock, deadline, [] { return idle_wakeup && replay_mode != REPLAY_RECORD; });
+    idle_wakeup = false;
+  }
+
+  if (!woken) {
+    cycle_count_delta = 0;
+    return;
+  }
+
+  // Only let as much virtual time pass as real time did
+  auto real_elapsed = duration_cast<microseconds>(steady_clock::now() - last_throttle).count();
+  uint64_t cputick = last_throttle_cputick + (uint64_t)(real_elapsed * cpu_rate / 1e6);
+  int delta = (int)(cputick - sched.next_cputick);
+  if (delta > 0)
+    delta = 0;
+  if (delta > cycle_count_delta)
+    cycle_count_delta = delta;
+}
+
+void emu_wakeup() {
+  {
+    std::lock_guard<std::mutex> lock(idle_mutex);
+    idle_wakeup = true;
+  }
+  idle_cond.notify_one();
+}
+
 struct gui_busy_raii {
   gui_busy_raii() { gui_set_busy(true); }
   ~gui_busy_raii() { gui_set_busy(false); }
 };
 
 static void emu_reset() {
-  memset(mem_areas[1].ptr, 0, mem_areas[1].size);
+  memory_clear_sdram();
 
   memset(&arm, 0, sizeof arm);
   arm.control = 0x00050078;
   arm.cpsr_low28 = MODE_SVC | 0xC0;
-  cpu_events &= EVENT_DEBUG_STEP;
+  cpu_events_clear(~(EVENT_DEBUG_STEP | EVENT_ASYNC));
 
   sched_reset();
-  sched.items[SCHED_THROTTLE].clock = CLOCK_27M;
-  sched.items[SCHED_THROTTLE].proc = throttle_interval_event;
+  sched_init_item(SCHED_THROTTLE, CLOCK_27M, throttle_interval_event, true);
 
   memory_reset();
 }
 
 bool snapshot_read(const emu_snapshot *snapshot, void *dest, int size) {
-  return gzread((gzFile)snapshot->stream_handle, dest, size) == size;
+  snapshot_buffer *buf = snapshot->buffer;
+  if (buf->size - buf->pos < size_t(size))
+    return false;
+  memcpy(dest, buf->data + buf->pos, size);
+  buf->pos += size;
+  return true;
 }
 
 bool snapshot_write(emu_snapshot *snapshot, const void *src, int size) {
-  return gzwrite((gzFile)snapshot->stream_handle, src, size) == size;
+  snapshot_buffer *buf = snapshot->buffer;
+  if (buf->capacity - buf->size < size_t(size)) {
+    size_t capacity = std::max(buf->capacity * 2, buf->size + size);
+    uint8_t *data = (uint8_t *)realloc(buf->data, capacity);
+    if (!data)
+      return false;
+    buf->data = data;
+    buf->capacity = capacity;
+  }
+  memcpy(buf->data + buf->size, src, size);
+  buf->size += size;
+  return true;
 }
 
-bool emu_start(unsigned int port_gdb, unsigned int port_rdbg,
-               const char *snapshot_file) {
-  gui_busy_raii gui_busy;
+bool snapshot_read_align(const emu_snapshot *snapshot) {
+  snapshot_buffer *buf = snapshot->buffer;
+  size_t pos = (buf->pos + SNAPSHOT_MAP_ALIGN - 1) & ~size_t(SNAPSHOT_MAP_ALIGN - 1);
+  if (pos > buf->size)
+    return false;
+  buf->pos = pos;
+  return true;
+}
 
-  if (snapshot_file) {
-    // Open snapshot
-    FILE *fp = fopen_utf8(snapshot_file, "rb");
-    if (!fp)
+bool snapshot_write_align(emu_snapshot *snapshot) {
+  static const uint8_t zero[256] = {};
+  snapshot_buffer *buf = snapshot->buffer;
+  while (buf->size % SNAPSHOT_MAP_ALIGN) {
+    size_t size = std::min(sizeof(zero), SNAPSHOT_MAP_ALIGN - buf->size % SNAPSHOT_MAP_ALIGN);
+    if (!snapshot_write(snapshot, zero, size))
       return false;
+  }
+  return true;
+}
+
+bool snapshot_read_map(const emu_snapshot *snapshot, void *dest, int size) {
+  snapshot_buffer *buf = snapshot->buffer;
+  size_t page_size = os_page_size(), mapped = size_t(size) & ~(page_size - 1);
+  if (buf->file && mapped && buf->size - buf->pos >= size_t(size) &&
+      (buf->file_offset + buf->pos) % page_size == 0 &&
+      uintptr_t(dest) % page_size == 0 &&
+      os_map_file(dest, buf->file, buf->file_offset + buf->pos, mapped)) {
+    buf->pos += mapped;
+    dest = static_cast<uint8_t *>(dest) + mapped;
+    size -= mapped;
+  }
 
-    int dupfd = dup(fileno(fp));
-    fclose(fp);
-    fp = nullptr;
+  return snapshot_read(snapshot, dest, size);
+}
+
+static bool flash_resume_settings(const emu_snapshot *snapshot) {
+  uint32_t sdram_size;
+  return flash_resume(snapshot) &&
+         flash_read_settings(&sdram_size, &product, &features,
+                             &asic_user_flags);
+}
 
-    // gzdopen takes ownership of the fd
-    gzFile gzf = gzdopen(dupfd, "r");
-    if (!gzf) {
-      close(dupfd);
+/* Sections in the order they get written and resumed. Bump version when
+ * the data of a component changes. If its resume function can still read the
+ * older data, by looking at snapshot->version, keep min_version. */
+static const struct snapshot_component {
+  uint32_t id;
+  uint32_t version, min_version;
+  bool (*suspend)(emu_snapshot *snapshot);
+  bool (*resume)(const emu_snapshot *snapshot);
+} snapshot_components[] = {
+    {SNAPSHOT_SECTION_ID('F', 'L', 'S', 'H'), 2, 1, flash_suspend, flash_resume_settings},
+    {SNAPSHOT_SECTION_ID('C', 'P', 'U', ' '), 1, 1, cpu_suspend, cpu_resume},
+    // Memory areas, also resets the peripherals below
+    {SNAPSHOT_SECTION_ID('M', 'E', 'M', ' '), 1, 1, memory_suspend, memory_resume},
+    {SNAPSHOT_SECTION_ID('M', 'I', 'S', 'C'), 1, 1, misc_suspend, misc_resume},
+    {SNAPSHOT_SECTION_ID('K', 'P', 'A', 'D'), 1, 1, keypad_suspend, keypad_resume},
+    {SNAPSHOT_SECTION_ID('U', 'S', 'B', ' '), 1, 1, usb_suspend, usb_resume},
+    {SNAPSHOT_SECTION_ID('L', 'C', 'D', ' '), 1, 1, lcd_suspend, lcd_resume},
+    {SNAPSHOT_SECTION_ID('D', 'E', 'S', ' '), 1, 1, des_suspend, des_resume},
+    {SNAPSHOT_SECTION_ID('S', 'H', 'A', '2'), 1, 1, sha256_suspend, sha256_resume},
+    {SNAPSHOT_SECTION_ID('S', 'E', 'R', ' '), 1, 1, serial_suspend, serial_resume},
+    {SNAPSHOT_SECTION_ID('I', 'N', 'T', ' '), 1, 1, interrupt_suspend, interrupt_resume},
+    {SNAPSHOT_SECTION_ID('S', 'E', 'R', 'X'), 1, 1, serial_cx_suspend, serial_cx_resume},
+    {SNAPSHOT_SECTION_ID('C', 'X', '2', ' '), 1, 1, cx2_suspend, cx2_resume},
+    {SNAPSHOT_SECTION_ID('U', 'S', 'B', '2'), 1, 1, usb_cx2_suspend, usb_cx2_resume},
+    // Last, as the items of all others have to be registered
+    {SNAPSHOT_SECTION_ID('S', 'C', 'H', 'D'), 1, 1, sched_suspend, sched_resume},
+};
+
+#define SNAPSHOT_COMPONENTS (sizeof(snapshot_components) / sizeof(*snapshot_components))
+
+bool snapshot_read_header(emu_snapshot *snapshot) {
+  snapshot_buffer *buf = snapshot->buffer;
+  return snapshot_read(snapshot, &snapshot->header, sizeof(snapshot->header)) &&
+         snapshot->header.sig == SNAPSHOT_SIG &&
+         snapshot->header.version == SNAPSHOT_VER &&
+         snapshot->header.sections <= (buf->size - buf->pos) / sizeof(snapshot_section);
+}
+
+bool snapshot_get_section(const emu_snapshot *snapshot, uint32_t index,
+                          snapshot_section *section) {
+  snapshot_buffer *buf = snapshot->buffer;
+  if (index >= snapshot->header.sections)
+    return false;
+  memcpy(section, buf->data + sizeof(snapshot->header) + index * sizeof(*section),
+         sizeof(*section));
+  return section->offset <= buf->size && section->size <= buf->size - section->offset;
+}
+
+bool snapshot_read_section(emu_snapshot *snapshot, uint32_t id,
+                           snapshot_section *section) {
+  const snapshot_component *component = std::find_if(
+      snapshot_components, snapshot_components + SNAPSHOT_COMPONENTS,
+      [id](const snapshot_component &c) { return c.id == id; });
+  if (component == snapshot_components + SNAPSHOT_COMPONENTS)
+    return false;
+
+  for (uint32_t i = 0; i < snapshot->header.sections; i++) {
+    if (!snapshot_get_section(snapshot, i, section))
+      return false;
+    if (section->id != id)
+      continue;
+    if (section->version < component->min_version ||
+        section->version > component->version)
+      return false;
+
+    snapshot->buffer->pos = section->offset;
+    snapshot->version = section->version;
+    return true;
+  }
+  return false;
+}
+
+// The header has to be written with the number of sections already
+static bool snapshot_write_sections(emu_snapshot *snapshot) {
+  snapshot_buffer *buf = snapshot->buffer;
+  snapshot_section sections[SNAPSHOT_COMPONENTS] = {};
+  size_t table = buf->size;
+  if (!snapshot_write(snapshot, sections, sizeof(sections)))
+    return false;
+
+  for (size_t i = 0; i < SNAPSHOT_COMPONENTS; i++) {
+    sections[i].id = snapshot_components[i].id;
+    sections[i].version = snapshot_components[i].version;
+    sections[i].offset = buf->size;
+    if (!snapshot_components[i].suspend(snapshot))
+      return false;
+    sections[i].size = buf->size - sections[i].offset;
+  }
+
+  memcpy(buf->data + table, sections, sizeof(sections));
+  return true;
+}
+
+static bool snapshot_resume_sections(emu_snapshot *snapshot) {
+  for (const snapshot_component &component : snapshot_components) {
+    snapshot_section section;
+    if (!snapshot_read_section(snapshot, component.id, &section)) {
+      char id[5] = {};
+      memcpy(id, &component.id, 4);
+      gui_debug_printf("Snapshot section '%s' is missing or has an unsupported version\n", id);
       return false;
     }
 
-    emu_snapshot snapshot = {};
-    snapshot.stream_handle = gzf;
-    // Read the header
-    if (!snapshot_read(&snapshot, &snapshot.header, sizeof(snapshot.header))) {
-      gzclose(gzf);
+    if (!component.resume(snapshot) ||
+        // Verify that the end is next
+        snapshot->buffer->pos != section.offset + section.size)
+      return false;
+  }
+  return true;
+}
+
+static bool path_is_separator(char c) {
+#ifdef _WIN32
+  return c == '/' || c == '\\';
+#else
+  return c == '/';
+#endif
+}
+
+static bool path_is_absolute(const std::string &path) {
+#ifdef _WIN32
+  if (path.size() >= 2 && isalpha((unsigned char)path[0]) && path[1] == ':')
+    return true;
+#endif
+  return !path.empty() && path_is_separator(path[0]);
+}
+
+// Components without empty ones and ".", "dir/.." is folded where possible
+static std::vector<std::string> path_split(const std::string &path) {
+  std::vector<std::string> parts;
+  size_t start = 0;
+  while (start <= path.size()) {
+    size_t end = start;
+    while (end < path.size() && !path_is_separator(path[end]))
+      end++;
+
+    std::string part = path.substr(start, end - start);
+    if (part == ".." && !parts.empty() && parts.back() != "..")
+      parts.pop_back();
+    else if (!part.empty() && part != ".")
+      parts.push_back(part);
+    start = end + 1;
+  }
+  return parts;
+}
+
+// For comparing paths, different links to the same file aren't detected
+static std::string path_normalize(const std::string &path) {
+  std::string normalized = path_is_absolute(path) ? "/" : "";
+  for (auto &part : path_split(path))
+    normalized += part + "/";
+  return normalized;
+}
+
+// Parents are stored relative to the snapshot's directory, if possible
+static std::string path_relative(const std::string &file, const std::string &parent) {
+  if (path_is_absolute(file) != path_is_absolute(parent))
+    return parent;
+
+  std::vector<std::string> dir = path_split(file), to = path_split(parent);
+  if (dir.empty() || to.empty())
+    return parent;
+  dir.pop_back();
+
+  size_t common = 0;
+  while (common < dir.size() && common + 1 < to.size() && dir[common] == to[common])
+    common++;
+
+  std::string relative;
+  for (size_t i = common; i < dir.size(); i++) {
+    // Can't go back up through that
+    if (dir[i] == "..")
+      return parent;
+    relative += "../";
+  }
+  for (size_t i = common; i < to.size(); i++)
+    relative += (i == common ? "" : "/") + to[i];
+  return relative;
+}
+
+static std::string path_resolve(const std::string &file, const std::string &parent) {
+  if (path_is_absolute(parent))
+    return parent;
+
+  size_t dir_end = file.size();
+  while (dir_end > 0 && !path_is_separator(file[dir_end - 1]))
+    dir_end--;
+  return file.substr(0, dir_end) + parent;
+}
+
+/* Not derived from the contents, so that a parent which got replaced by
+ * another snapshot is detected even if it's similar. Fork children each have
+ * to get their own ids, so there is no generator state to inherit. */
+static uint64_t snapshot_new_id() {
+  std::random_device random;
+  uint64_t id = uint64_t(random()) << 32 ^ random() ^
+                uint64_t(std::chrono::high_resolution_clock::now().time_since_epoch().count());
+  return id ? id : 1;
+}
+
+// Later writes make deltas relative to chain[0], which has the header id
+static void snapshot_set_chain(std::vector<std::string> chain, uint64_t id) {
+  snapshot_parent_failed = false;
+  snapshot_parent_id = id;
+  if (snapshot_deltas && memory_track_snapshot())
+    snapshot_chain = std::move(chain);
+  else
+    snapshot_chain.clear();
+}
+
+// After file got written from the buffer emu_capture filled
+static void snapshot_set_parent(const char *file, const snapshot_buffer &buffer, uint64_t id) {
+  std::vector<std::string> chain(1, file);
+  if (buffer.delta)
+    chain.insert(chain.end(), snapshot_chain.begin(), snapshot_chain.end());
+  snapshot_set_chain(std::move(chain), id);
+}
+
+/* Resumes file and, for deltas, the snapshots it's based on before it. chain
+ * gets the paths of all of them, starting with file, id the header id of file. */
+static bool emu_resume(const std::string &file, std::vector<std::string> &chain, uint64_t &id) {
+  chain.push_back(file);
+  snapshot_buffer buffer = {};
+  if (!snapshot_file_read(file.c_str(), &buffer))
+    return false;
+
+  emu_snapshot snapshot = {};
+  snapshot.buffer = &buffer;
+  if (!snapshot_read_header(&snapshot)) {
+    snapshot_file_close(&buffer);
+    return false;
+  }
+
+  if (snapshot.header.path_parent[0]) {
+    std::string parent = path_resolve(file, snapshot.header.path_parent);
+    uint64_t parent_id = 0;
+    if (chain.size() == SNAPSHOT_CHAIN_MAX || !emu_resume(parent, chain, parent_id)) {
+      gui_debug_printf("Could not resume %s, which %s is based on\n", parent.c_str(), file.c_str());
+      snapshot_file_close(&buffer);
       return false;
     }
 
-    sched.items[SCHED_THROTTLE].clock = CLOCK_27M;
-    sched.items[SCHED_THROTTLE].proc = throttle_interval_event;
-
-    // TODO: Max length
-    path_boot1 = std::string(snapshot.header.path_boot1);
-    path_flash = std::string(snapshot.header.path_flash);
-
-    // Resume components
-    uint32_t sdram_size, dummy;
-    if (snapshot.header.sig != SNAPSHOT_SIG ||
-        snapshot.header.version != SNAPSHOT_VER || !flash_resume(&snapshot) ||
-        !flash_read_settings(&sdram_size, &product, &features,
-                             &asic_user_flags) ||
-        !cpu_resume(&snapshot) || !memory_resume(&snapshot) ||
-        !sched_resume(&snapshot)
-        // Verify that EOF is next
-        || gzread(gzf, &dummy, sizeof(dummy)) != 0 || !gzeof(gzf)) {
-      gzclose(gzf);
-      emu_cleanup();
+    // The delta only contains what changed since that parent was written
+    if (parent_id != snapshot.header.parent_id) {
+      gui_debug_printf("%s was replaced after %s got written based on it\n", parent.c_str(), file.c_str());
+      snapshot_file_close(&buffer);
       return false;
     }
+  }
 
-    if (gzclose(gzf) != Z_OK) {
+  id = snapshot.header.id;
+
+  // Items have to be registered in the same order as before
+  sched_reset();
+  sched_init_item(SCHED_THROTTLE, CLOCK_27M, throttle_interval_event, true);
+
+  // TODO: Max length
+  path_boot1 = std::string(snapshot.header.path_boot1);
+  path_flash = std::string(snapshot.header.path_flash);
+
+  bool resumed = snapshot_resume_sections(&snapshot);
+  snapshot_file_close(&buffer);
+  return resumed;
+}
+
+bool emu_start(unsigned int port_gdb, unsigned int port_rdbg,
+               const char *snapshot_file) {
+  gui_busy_raii gui_busy;
+
+  emu_start_times = {};
+  emu_start_time = std::chrono::steady_clock::now();
+  auto phase_start = emu_start_time;
+  // Sets time to the duration since the previous phase ended
+  auto phase_end = [&phase_start](double &time) {
+    auto now = std::chrono::steady_clock::now();
+    time = std::chrono::duration<double>(now - phase_start).count();
+    phase_start = now;
+  };
+
+  if (snapshot_file) {
+    // It might still be written by emu_suspend_async
+    snapshot_file_wait();
+
+    std::vector<std::string> chain;
+    uint64_t id = 0;
+    if (!emu_resume(snapshot_file, chain, id)) {
       emu_cleanup();
       return false;
     }
+
+    snapshot_set_chain(std::move(chain), id);
+    phase_end(emu_start_times.resume);
   } else {
-    if (!flash_open(path_flash.c_str()))
+    if (!flash_open(path_flash.c_str(), path_flash_overlay.empty()
+                                            ? nullptr
+                                            : path_flash_overlay.c_str()))
       return false;
 
     uint32_t sdram_size;
     flash_read_settings(&sdram_size, &product, &features, &asic_user_flags);
 
     flash_set_bootorder(boot_order);
+    phase_end(emu_start_times.flash);
 
     if (!memory_initialize(sdram_size)) {
       emu_cleanup();
       return false;
     }
+
+    snapshot_chain.clear();
+    phase_end(emu_start_times.memory);
   }
 
   if (debug_on_start)
-    cpu_events |= EVENT_DEBUG_STEP;
+    cpu_events_set(EVENT_DEBUG_STEP);
 
   uint8_t *rom = mem_areas[0].ptr;
-  memset(rom, -1, 0x80000);
-  for (int i = 0x00000; i < 0x80000; i += 4)
-    RAM_FLAGS(&rom[i]) = RF_READ_ONLY;
+  memory_mark_pages(rom, rom + 0x80000, RPF_READ_ONLY);
 
-  /* Load the ROM */
+  /* Load the ROM. Whole pages of it get mapped if possible, so that only the
+   * parts which get used are read. */
   FILE *f = fopen_utf8(path_boot1.c_str(), "rb");
   if (!f) {
     gui_perror(path_boot1.c_str());
     emu_cleanup();
     return false;
   }
-  (void)fread(rom, 1, 0x80000, f);
+  fseek(f, 0, SEEK_END);
+  long rom_size = std::max(ftell(f), 0L);
+  size_t mapped = std::min<size_t>(rom_size, 0x80000) & ~(os_page_size() - 1);
+  if (mapped && !os_map_file(rom, path_boot1.c_str(), 0, mapped))
+    mapped = 0;
+  memset(rom + mapped, -1, 0x80000 - mapped);
+  fseek(f, mapped, SEEK_SET);
+  (void)fread(rom + mapped, 1, 0x80000 - mapped, f);
   fclose(f);
 
   // Warn if the CX II bootrom is missing the key area
@@ -296,6 +795,7 @@ bool emu_start(unsigned int port_gdb, unsigned int port_rdbg,
     gui_debug_printf(
         "Incomplete bootrom dump detected: Booting will fail.\nThere is "
         "currently no public way to perform a complete readout.\n");
+  phase_end(emu_start_times.boot1);
 
 #ifndef NO_TRANSLATION
   if (!translate_init()) {
@@ -303,11 +803,15 @@ bool emu_start(unsigned int port_gdb, unsigned int port_rdbg,
     do_translate = false;
   }
 #endif
+  phase_end(emu_start_times.translate);
 
   addr_cache_init();
+  phase_end(emu_start_times.addr_cache);
 
   throttle_timer_on();
 
+  io_thread_start();
+
   if (port_gdb)
     gdbstub_init(port_gdb);
 
@@ -315,10 +819,13 @@ bool emu_start(unsigned int port_gdb, unsigned int port_rdbg,
     rdebug_bind(port_rdbg);
 
   usblink_queue_reset();
+  phase_end(emu_start_times.threads);
 
   if (!snapshot_file)
     emu_reset();
+  phase_end(emu_start_times.reset);
 
+  emu_start_pending = true;
   return true;
 }
 
@@ -334,28 +841,67 @@ void emu_loop(bool reset) {
   }
 
   gdbstub_reset();
+  rewind_reset();
 
   addr_cache_flush();
   flush_translations();
 
-  sched_update_next_event(0);
+  sched_update_next_event(sched_current_cputick());
+  last_throttle = std::chrono::steady_clock::now();
+  last_throttle_cputick = sched_current_cputick();
 
   exiting = false;
 
+  if (emu_start_pending) {
+    emu_start_pending = false;
+    emu_start_times.first_insn = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - emu_start_time).count();
+    if (print_start_times)
+      gui_debug_printf(
+          "Startup in ms: resume %.2f, flash %.2f, memory %.2f, boot1 %.2f, "
+          "translate %.2f, addr_cache %.2f, threads %.2f, reset %.2f, "
+          "first instruction after %.2f\n",
+          emu_start_times.resume * 1e3, emu_start_times.flash * 1e3,
+          emu_start_times.memory * 1e3, emu_start_times.boot1 * 1e3,
+          emu_start_times.translate * 1e3, emu_start_times.addr_cache * 1e3,
+          emu_start_times.threads * 1e3, emu_start_times.reset * 1e3,
+          emu_start_times.first_insn * 1e3);
+  }
+
   emu_setjmp(restart_after_exception);
 
   while (!exiting) {
     sched_process_pending_events();
     while (!exiting && cycle_count_delta < 0) {
+      if (replay_mode == REPLAY_PLAY)
+        replay_poll();
+
       if (cpu_events & EVENT_RESET) {
         gui_status_printf("Reset");
         goto reset;
       }
 
+      if (cpu_events & EVENT_IO) {
+        cpu_events_clear(EVENT_IO);
+        io_dispatch();
+      }
+
+      if (cpu_events & EVENT_WRITE_FAULT)
+        memory_handle_writes();
+
+      if (cpu_events & EVENT_REWIND) {
+        cpu_events_clear(EVENT_REWIND);
+        if (rewind_handle_event()) {
+          last_throttle = std::chrono::steady_clock::now();
+          last_throttle_cputick = sched_current_cputick();
+          continue;
+        }
+      }
+
       if (cpu_events & EVENT_SLEEP) {
         assert(emulate_cx2);
-        cycle_count_delta = 0;
-        break;
+        emu_idle();
+        continue;
       }
 
       if (cpu_events & (EVENT_FIQ | EVENT_IRQ)) {
@@ -370,8 +916,11 @@ void emu_loop(bool reset) {
 
         arm.reg[15] += 4;
         cpu_exception((cpu_events & EVENT_FIQ) ? EX_FIQ : EX_IRQ);
+      } else if (cpu_events & EVENT_WAITING) {
+        emu_idle();
+        continue;
       }
-      cpu_events &= ~EVENT_WAITING;
+      cpu_events_clear(EVENT_WAITING);
 
       if (arm.cpsr_low28 & 0x20)
         cpu_thumb_loop();
@@ -385,26 +934,18 @@ void emu_loop(bool reset) {
 #endif
 }
 
-bool emu_suspend(const char *file) {
-  gui_busy_raii gui_busy;
-
-  FILE *fp = fopen_utf8(file, "wb");
-  if (!fp)
-    return false;
-
-  int dupfd = dup(fileno(fp));
-  fclose(fp);
-  fp = nullptr;
-
-  // gzdopen takes ownership of the fd
-  gzFile gzf = gzdopen(dupfd, "wb");
-  if (!gzf) {
-    close(dupfd);
-    return false;
-  }
-
+// Writes the state into buffer, as delta if possible. id is set to the new header id.
+static bool emu_capture(const char *file, snapshot_buffer *buffer, uint64_t *id) {
   emu_snapshot snapshot = {};
-  snapshot.stream_handle = gzf;
+  snapshot.buffer = buffer;
+  buffer->mappable = snapshot_codec_mappable();
+  /* Replacing any snapshot of the chain would make the delta refer to itself,
+   * a full one is written then. */
+  bool in_chain = false;
+  for (auto &path : snapshot_chain)
+    in_chain = in_chain || path_normalize(path) == path_normalize(file);
+  buffer->delta = snapshot_deltas && !snapshot_chain.empty() && !in_chain &&
+                  !snapshot_parent_failed && snapshot_chain.size() < SNAPSHOT_CHAIN_MAX;
 
   snapshot.header.sig = SNAPSHOT_SIG;
   snapshot.header.version = SNAPSHOT_VER;
@@ -413,20 +954,94 @@ bool emu_suspend(const char *file) {
           sizeof(snapshot.header.path_boot1) - 1);
   strncpy(snapshot.header.path_flash, path_flash.c_str(),
           sizeof(snapshot.header.path_flash) - 1);
+  if (buffer->delta) {
+    strncpy(snapshot.header.path_parent, path_relative(file, snapshot_chain[0]).c_str(),
+            sizeof(snapshot.header.path_parent) - 1);
+    snapshot.header.parent_id = snapshot_parent_id;
+  }
+
+  snapshot.header.sections = SNAPSHOT_COMPONENTS;
+  snapshot.header.id = *id = snapshot_new_id();
 
-  if (!snapshot_write(&snapshot, &snapshot.header, sizeof(snapshot.header)) ||
-      !flash_suspend(&snapshot) || !cpu_suspend(&snapshot) ||
-      !memory_suspend(&snapshot) || !sched_suspend(&snapshot)) {
-    gzclose(gzf);
+  return snapshot_write(&snapshot, &snapshot.header, sizeof(snapshot.header)) &&
+         snapshot_write_sections(&snapshot);
+}
+
+bool emu_suspend(const char *file) {
+  gui_busy_raii gui_busy;
+  snapshot_file_wait();
+
+  snapshot_buffer buffer = {};
+  uint64_t id;
+  bool suspended = emu_capture(file, &buffer, &id) && snapshot_file_write(file, &buffer);
+  if (suspended)
+    snapshot_set_parent(file, buffer, id);
+  free(buffer.data);
+  return suspended;
+}
+
+// Only one background write at a time, see snapshot_file_write_async
+static emu_suspend_cb suspend_async_done;
+
+static void suspend_async_written(bool success) {
+  if (!success)
+    snapshot_parent_failed = true;
+  suspend_async_done(success);
+}
+
+bool emu_suspend_async(const char *file, emu_suspend_cb done) {
+  // A delta can't refer to a parent which failed to be written
+  snapshot_file_wait();
+
+  snapshot_buffer buffer = {};
+  uint64_t id;
+  if (!emu_capture(file, &buffer, &id)) {
+    free(buffer.data);
     return false;
   }
 
-  return gzclose(gzf) == Z_OK;
+  suspend_async_done = done;
+  snapshot_set_parent(file, buffer, id);
+  snapshot_file_write_async(file, &buffer, suspend_async_written);
+  return true;
+}
+
+void emu_fork_prepare() {
+  snapshot_file_wait();
+  flash_fork_prepare();
+  io_thread_stop();
+
+  // Each child has to set up write protection for itself
+  flush_translations();
+  memory_unprotect_all();
+}
+
+void emu_fork_child(unsigned int port_gdb, unsigned int port_rdbg) {
+#ifndef NO_TRANSLATION
+  // The JIT buffer is shared with the parent and all other children
+  translate_deinit();
+  if (!translate_init()) {
+    gui_debug_printf("Could not init JIT, disabling translation.\n");
+    do_translate = false;
+  }
+#endif
+
+  io_thread_start();
+
+  if (port_gdb)
+    gdbstub_init(port_gdb);
+
+  if (port_rdbg)
+    rdebug_bind(port_rdbg);
+
+  usblink_queue_reset();
 }
 
 void emu_cleanup() {
   exiting = true;
 
+  snapshot_file_wait();
+
   // addr_cache_init is rather expensive and needs to be called once only
   // addr_cache_deinit();
 
@@ -434,10 +1049,17 @@ void emu_cleanup() {
   translate_deinit();
 #endif
 
+  rewind_reset();
   memory_reset();
+  // Items of this session must not fire in the next one
+  sched_reset();
   memory_deinitialize();
   flash_close();
 
+  replay_stop();
+
   gdbstub_quit();
   rdebug_quit();
+
+  io_thread_stop();
 }
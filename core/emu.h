@@ -1,15 +1,19 @@
 #ifndef _H_EMU
 #define _H_EMU
 
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #include "flash.h"
 
 #ifdef __cplusplus
 #include <string>
 extern std::string path_boot1, path_flash;
+// If set, path_flash is only read and changes go to this file, see flash_open
+extern std::string path_flash_overlay;
 
 extern "C" {
 #endif
@@ -34,9 +38,21 @@ extern uint32_t cpu_events __asm__("cpu_events");
 #define EVENT_DEBUG_STEP 8
 #define EVENT_WAITING 16
 #define EVENT_SLEEP 32
+#define EVENT_IO 64 // See iothread.h
+#define EVENT_REWIND 128 // See rewind.h
+#define EVENT_WRITE_FAULT 256 // See memory_handle_writes
+// Set by other threads, so they survive a reset
+#define EVENT_ASYNC (EVENT_IO | EVENT_WRITE_FAULT)
+
+/* Other threads set events at any time, so cpu_events must not be changed
+ * with plain read-modify-writes */
+#define cpu_events_set(events) __atomic_fetch_or(&cpu_events, (uint32_t)(events), __ATOMIC_RELAXED)
+#define cpu_events_clear(events) __atomic_fetch_and(&cpu_events, ~(uint32_t)(events), __ATOMIC_RELAXED)
 
 // Settings
-extern bool exiting, debug_on_start, debug_on_warn, print_on_warn;
+// Also set by signal handlers
+extern volatile sig_atomic_t exiting;
+extern bool debug_on_start, debug_on_warn, print_on_warn;
 extern BootOrder boot_order;
 extern bool do_translate;
 extern uint32_t product, features, asic_user_flags;
@@ -52,6 +68,25 @@ extern uint32_t product, features, asic_user_flags;
 #define emulate_cx (product >= 0x0F0)
 #define emulate_cx2 (product >= 0x1C0)
 extern bool turbo_mode;
+// Target speed as multiple of the real hardware, 0 for as fast as possible.
+// Ignored in turbo mode.
+extern double speed_target;
+// Host CPU time the process may use, in percent of a core. 0 for no limit.
+extern unsigned int cpu_limit;
+// If not 0, emu_loop returns after this much emulated time. Counts down to 0.
+extern unsigned int emu_stop_after_ms;
+// If set, mem_stats are written to it as one JSON line per interval
+extern FILE *mem_stats_sample_file;
+extern unsigned int mem_stats_sample_ms;
+/* Seconds emu_start spent on each step, for profiling the startup. resume
+ * replaces flash and memory when starting from a snapshot. first_insn is the
+ * time from calling emu_start until emu_loop executes the first instruction. */
+struct emu_start_times {
+    double resume, flash, memory, boot1, translate, addr_cache, threads, reset, first_insn;
+};
+extern struct emu_start_times emu_start_times;
+// If set, emu_loop prints emu_start_times before the first instruction
+extern bool print_start_times;
 
 enum { LOG_CPU, LOG_IO, LOG_FLASH, LOG_INTS, LOG_ICOUNT, LOG_USB, LOG_GDB, MAX_LOG };
 #define LOG_TYPE_TBL "CIFQ#UG"
@@ -88,26 +123,100 @@ typedef void (*debug_input_cb)(const char *input);
 void gui_debugger_request_input(debug_input_cb callback);
 
 #define SNAPSHOT_SIG 0xCAFEBEE0
-#define SNAPSHOT_VER 3
+#define SNAPSHOT_VER 11
+/* Alignment of data in the stream which snapshot_read_map can map. Larger
+ * than the page size of all hosts, so that files work everywhere. */
+#define SNAPSHOT_MAP_ALIGN 0x10000
+
+// Snapshot data in memory, grows as needed on writes. See snapshot_file.h
+typedef struct snapshot_buffer {
+    uint8_t *data;
+    size_t size, capacity, pos; // pos is the read position
+    bool mappable; // Writing: lay out memory for snapshot_read_map
+    bool delta; // Writing: only memory pages without RPF_CLEAN_SNAPSHOT
+    const char *file; // Reading: if set, data is mapped from this file
+    uint64_t file_offset; // of data
+} snapshot_buffer;
+
+/* The stream starts with the header, followed by a table of sections, one
+ * per component. Each section has its own version, so that a change to one
+ * component doesn't make the others unreadable. Resuming skips sections this
+ * build doesn't know, and tools can read single sections without resuming. */
+#define SNAPSHOT_SECTION_ID(a, b, c, d) \
+    ((uint32_t)(a) | (uint32_t)(b) << 8 | (uint32_t)(c) << 16 | (uint32_t)(d) << 24)
+
+typedef struct snapshot_section {
+    uint32_t id; // SNAPSHOT_SECTION_ID
+    uint32_t version;
+    uint64_t offset, size; // In the stream
+} snapshot_section;
 
 // Passed to resume/suspend functions.
 // Use snapshot_(read/write) to access stream contents.
 typedef struct emu_snapshot {
-    void *stream_handle;
+    snapshot_buffer *buffer;
     struct {
         uint32_t sig; // SNAPSHOT_SIG
         uint32_t version; // SNAPSHOT_VER
         char path_boot1[512];
         char path_flash[512];
+        char path_parent[512]; // Set for deltas, see snapshot_deltas
+        uint32_t sections; // Entries in the table after the header
+        uint32_t reserved;
+        uint64_t id; // Random, new for every snapshot written
+        uint64_t parent_id; // For deltas, id of the parent they were written for
     } header;
+    uint32_t version; // Of the section being resumed
 } emu_snapshot;
 
 bool snapshot_read(const emu_snapshot *snapshot, void *dest, int size);
 bool snapshot_write(emu_snapshot *snapshot, const void *src, int size);
+/* Padding to SNAPSHOT_MAP_ALIGN, has to be done at the same point on both sides */
+bool snapshot_read_align(const emu_snapshot *snapshot);
+bool snapshot_write_align(emu_snapshot *snapshot);
+/* Like snapshot_read, but maps the data copy-on-write instead of copying it
+ * if the buffer is mapped from a file and both sides are page aligned. dest
+ * has to be memory from os_reserve. */
+bool snapshot_read_map(const emu_snapshot *snapshot, void *dest, int size);
+
+/* Reads and checks the header at the start of snapshot->buffer */
+bool snapshot_read_header(emu_snapshot *snapshot);
+/* Entry index of the section table, fails if it's out of the stream */
+bool snapshot_get_section(const emu_snapshot *snapshot, uint32_t index, snapshot_section *section);
+/* Moves the read position to the start of the section with id. Fails if there
+ * is none or this build can't read its version. */
+bool snapshot_read_section(emu_snapshot *snapshot, uint32_t id, snapshot_section *section);
+
+/* If set, a snapshot only contains the memory pages written since the
+ * previous suspend or resume, and refers to that file for the others.
+ * Resuming goes through the whole chain, so older files in it have to stay,
+ * and refuses a delta if its parent got replaced (header.parent_id).
+ * The parent is stored relative to the directory of the delta, so a chain can
+ * be moved as a whole. Writing to a file of the current chain, or if writes
+ * can't be tracked, gives a complete snapshot. */
+extern bool snapshot_deltas;
 
 bool emu_start(unsigned int port_gdb, unsigned int port_rdbg, const char *snapshot);
 void emu_loop(bool reset);
+/* While the CPU waits for an interrupt: lets the virtual time pass until the
+ * next event. If not in turbo mode, the thread sleeps until it's time for
+ * that in real time, or until emu_wakeup is called. */
+void emu_idle();
+/* Can be called from any thread, after host input changed the emulated state */
+void emu_wakeup();
 bool emu_suspend(const char *file);
+/* Captures the state into memory, which only takes as long as copying it.
+ * Compressing and writing happen in the background, then done is called
+ * from a different thread. Returns false if the capture failed. */
+typedef void (*emu_suspend_cb)(bool success);
+bool emu_suspend_async(const char *file, emu_suspend_cb done);
+/* For fork servers, which start once and fork a child for each run. Before
+ * forking, emu_fork_prepare stops what fork doesn't duplicate (threads and
+ * write protection). The child then calls emu_fork_child to set it up again,
+ * with its own debugger ports, and runs emu_loop. The state is shared
+ * copy-on-write, so forking takes milliseconds. */
+void emu_fork_prepare();
+void emu_fork_child(unsigned int port_gdb, unsigned int port_rdbg);
 void emu_cleanup();
 
 #ifdef __cplusplus
@@ -5,6 +5,12 @@
 #include <string.h>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "emu.h"
 #include "fieldparser.h"
@@ -405,12 +411,485 @@ size_t flash_partition_offset(Partition p, struct nand_metrics *nand_metrics, ui
     return (*(uint32_t*)(nand_data + parttable_cx[p-1]))/0x800 * 0x840;
 }
 
-bool flash_open(const char *filename) {
+#define FNV1A_INIT 2166136261u
+
+static uint32_t fnv1a(uint32_t hash, const void *data, size_t size)
+{
+    const uint8_t *bytes = (const uint8_t *) data;
+    for(size_t i = 0; i < size; i++)
+        hash = (hash ^ bytes[i]) * 16777619u;
+
+    return hash;
+}
+
+static std::string flash_path; // Of flash_file
+
+/* Saving goes through a journal next to the file written to, so that a crash
+ * can't leave a torn image: the data gets written into the journal and synced
+ * first, only then into the file. Opening the file applies a complete journal
+ * again. An incomplete one is ignored, the file wasn't touched yet then.
+ * The journal starts with journal_header, followed by count journal_entry
+ * and their data. It's kept open and rewritten for each save. */
+#define JOURNAL_SIG 0x4A424246 // "FBBJ"
+#define JOURNAL_VER 1
+
+struct journal_header {
+    uint32_t sig, version;
+    uint32_t count;
+    uint32_t checksum; // FNV-1a of the entries and data
+    uint64_t size; // Of the data
+};
+
+struct journal_entry {
+    uint64_t offset, size; // In the file
+};
+
+// Only accessed by whoever saves, see flash_batch
+static FILE *journal_file = NULL;
+static std::string journal_path;
+static bool journal_pending; // Not completely applied to the file yet
+
+static std::string journal_path_for(const std::string &path)
+{
+    return path + ".journal";
+}
+
+static bool journal_write(const std::string &path, const std::vector<journal_entry> &entries,
+                          const std::vector<uint8_t> &data)
+{
+    if(journal_file && journal_path != journal_path_for(path))
+        return false;
+
+    if(!journal_file)
+    {
+        journal_path = journal_path_for(path);
+        if(!(journal_file = fopen_utf8(journal_path.c_str(), "w+b")) || !os_file_sync_dir(journal_path.c_str()))
+            return false;
+    }
+
+    journal_header header = { JOURNAL_SIG, JOURNAL_VER, uint32_t(entries.size()), FNV1A_INIT, data.size() };
+    header.checksum = fnv1a(fnv1a(header.checksum, entries.data(), entries.size() * sizeof(journal_entry)),
+                            data.data(), data.size());
+    return fseek(journal_file, 0, SEEK_SET) == 0
+           && fwrite(&header, sizeof(header), 1, journal_file) == 1
+           && fwrite(entries.data(), sizeof(journal_entry), entries.size(), journal_file) == entries.size()
+           && fwrite(data.data(), 1, data.size(), journal_file) == data.size()
+           && os_file_sync(journal_file);
+}
+
+// Removes the journal, unless it's still needed to repair the file
+static void journal_close()
+{
+    if(!journal_file)
+        return;
+
+    fclose(journal_file);
+    journal_file = NULL;
+    if(!journal_pending)
+        remove(journal_path.c_str());
+    journal_pending = false;
+}
+
+// Completes a save to the file at path which got interrupted by a crash
+static bool journal_replay(const char *path)
+{
+    std::string replay_path = journal_path_for(path);
+    FILE *f = fopen_utf8(replay_path.c_str(), "rb");
+    if(!f)
+        return true;
+
+    journal_header header;
+    std::vector<journal_entry> entries;
+    std::vector<uint8_t> data;
+    bool complete = fread(&header, sizeof(header), 1, f) == 1 && header.sig == JOURNAL_SIG
+                    && header.version == JOURNAL_VER && header.count <= 2 * sizeof(nand.nand_block_modified)
+                    && header.size <= 132*1024*1024 + 2048 * sizeof(uint32_t);
+    if(complete)
+    {
+        entries.resize(header.count);
+        data.resize(header.size);
+        complete = fread(entries.data(), sizeof(journal_entry), entries.size(), f) == entries.size()
+                   && fread(data.data(), 1, data.size(), f) == data.size()
+                   && fnv1a(fnv1a(FNV1A_INIT, entries.data(), entries.size() * sizeof(journal_entry)),
+                            data.data(), data.size()) == header.checksum;
+    }
+    fclose(f);
+
+    uint64_t pos = 0;
+    for(const journal_entry &entry : entries)
+        pos += entry.size;
+    complete = complete && pos == data.size();
+
+    if(complete)
+    {
+        f = fopen_utf8(path, "r+b");
+        bool ok = f != NULL;
+        pos = 0;
+        for(size_t i = 0; ok && i < entries.size(); pos += entries[i++].size)
+            ok = os_file_write_at(f, data.data() + pos, entries[i].size, entries[i].offset);
+
+        ok = ok && os_file_sync(f);
+        if(f)
+            fclose(f);
+        if(!ok)
+        {
+            gui_perror(path);
+            return false;
+        }
+
+        emuprintf("Completed an interrupted save to %s\n", path);
+    }
+
+    remove(replay_path.c_str());
+    return true;
+}
+
+/* Data to save into the image or overlay, captured from nand_data by the
+ * emulation thread. Written either by flash_save_changes or in the
+ * background by the writeback thread. */
+struct flash_batch {
+    FILE *file;
+    std::string path; // Of file
+    std::vector<journal_entry> entries; // Coalesced runs of blocks
+    std::vector<uint8_t> data;
+    std::vector<uint32_t> blocks; // To mark them modified again if saving fails
+    std::chrono::steady_clock::time_point captured;
+};
+
+static std::mutex save_stats_mutex;
+static flash_save_stats save_stats;
+
+static bool batch_save(const flash_batch &batch)
+{
+    bool ok = journal_write(batch.path, batch.entries, batch.data);
+    journal_pending = journal_pending || ok;
+
+    uint64_t pos = 0;
+    for(size_t i = 0; ok && i < batch.entries.size(); pos += batch.entries[i++].size)
+        ok = os_file_write_at(batch.file, batch.data.data() + pos, batch.entries[i].size, batch.entries[i].offset);
+
+    ok = ok && os_file_sync(batch.file);
+    if(ok)
+        journal_pending = false;
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - batch.captured).count();
+    std::lock_guard<std::mutex> lock(save_stats_mutex);
+    if(!ok)
+    {
+        save_stats.failures++;
+        return false;
+    }
+
+    save_stats.saves++;
+    save_stats.blocks += batch.blocks.size();
+    save_stats.bytes += batch.data.size();
+    save_stats.last_ms = ms;
+    save_stats.max_ms = std::max(save_stats.max_ms, ms);
+    save_stats.total_ms += ms;
+    return true;
+}
+
+// They'll be saved again next time
+static void batch_failed(const flash_batch &batch)
+{
+    for(uint32_t block : batch.blocks)
+        nand.nand_block_modified[block] = true;
+
+    gui_perror(batch.path.c_str());
+}
+
+unsigned int flash_writeback_ms = 0;
+static std::chrono::steady_clock::time_point writeback_last;
+
+#ifndef __EMSCRIPTEN__
+// Only accessed by the emulation thread, apart from the batch while busy
+static std::thread *writeback_thread;
+static std::atomic<bool> writeback_busy;
+static flash_batch writeback_batch;
+static bool writeback_ok;
+#endif
+
+void flash_writeback_wait()
+{
+#ifndef __EMSCRIPTEN__
+    if(!writeback_thread)
+        return;
+
+    writeback_thread->join();
+    delete writeback_thread;
+    writeback_thread = nullptr;
+
+    if(!writeback_ok)
+        batch_failed(writeback_batch);
+    writeback_batch = {};
+#endif
+}
+
+void flash_get_save_stats(flash_save_stats *stats)
+{
+    std::lock_guard<std::mutex> lock(save_stats_mutex);
+    *stats = save_stats;
+}
+
+/* Overlay files start with overlay_header, followed by the slot of each block:
+ * 0 if the block is taken from the base image, else its position in the
+ * block data after the table, starting at 1. Blocks are added at the end. */
+#define OVERLAY_SIG 0x564F4246 // "FBOV"
+#define OVERLAY_VER 3
+
+struct overlay_header {
+    uint32_t sig, version;
+    uint32_t block_size, num_blocks;
+    uint32_t base_size;
+    uint32_t base_id; // See base_header
+};
+
+// Set in overlay mode, flash_file is only read then
+static FILE *overlay_file = NULL;
+static std::string overlay_path;
+static overlay_header overlay_hdr;
+static std::vector<uint32_t> overlay_slots;
+static uint32_t overlay_used; // Blocks in the file
+// Header for flash_overlay_switch without an overlay, see flash_fork_prepare
+static overlay_header switch_hdr;
+static bool switch_hdr_valid = false;
+
+static long overlay_block_offset(const overlay_header &header, uint32_t slot)
+{
+    return sizeof(header) + header.num_blocks * sizeof(uint32_t) + long(slot - 1) * header.block_size;
+}
+
+static bool overlay_read(FILE *f, overlay_header &header, std::vector<uint32_t> &slots)
+{
+    if(fread(&header, sizeof(header), 1, f) != 1 || header.sig != OVERLAY_SIG
+       || header.version != OVERLAY_VER || header.num_blocks > sizeof(nand.nand_block_modified))
+        return false;
+
+    slots.resize(header.num_blocks);
+    return fread(slots.data(), sizeof(uint32_t), slots.size(), f) == slots.size();
+}
+
+// Writes an overlay without any blocks
+static bool overlay_create(const char *path, const overlay_header &header)
+{
+    // An interrupted save doesn't apply anymore
+    remove(journal_path_for(path).c_str());
+
+    FILE *f = fopen_utf8(path, "wb");
+    if(!f)
+        return false;
+
+    std::vector<uint32_t> slots(header.num_blocks);
+    bool written = fwrite(&header, sizeof(header), 1, f) == 1
+                   && fwrite(slots.data(), sizeof(uint32_t), slots.size(), f) == slots.size();
+    return fclose(f) == 0 && written;
+}
+
+// Header of an empty overlay for an image of size bytes, without base_id
+static bool base_header_init(overlay_header &header, long size, std::vector<uint64_t> *hashes = NULL)
+{
+    if(size != 33*1024*1024 && size != 132*1024*1024)
+        return false;
+
+    const nand_metrics &metrics = chips[size == 132*1024*1024];
+    header = {};
+    header.sig = OVERLAY_SIG;
+    header.version = OVERLAY_VER;
+    header.block_size = metrics.page_size << metrics.log2_pages_per_block;
+    header.num_blocks = metrics.num_pages >> metrics.log2_pages_per_block;
+    header.base_size = size;
+    if(hashes)
+        hashes->assign(header.num_blocks, 0);
+    return true;
+}
+
+/* FNV-1a over 64-bit words in four independent lanes, as the byte-wise one
+ * is too slow for whole images. Block sizes are multiples of 32 bytes. */
+static uint64_t block_hash(const uint8_t *data, uint32_t size)
+{
+    uint64_t lanes[4] = { 14695981039346656037ull, 1, 2, 3 };
+    for(uint32_t i = 0; i < size; i += sizeof(lanes))
+    {
+        for(int lane = 0; lane < 4; lane++)
+        {
+            uint64_t word;
+            memcpy(&word, data + i + lane * sizeof(word), sizeof(word));
+            lanes[lane] = (lanes[lane] ^ word) * 1099511628211ull;
+        }
+    }
+
+    return fnv1a(FNV1A_INIT, lanes, sizeof(lanes));
+}
+
+/* The id is a checksum of all blocks, so that an overlay is refused by any
+ * other image and after any change to this one, like an overlay_commit.
+ * It's built from the hash of each block, so changing some of them doesn't
+ * need the others again. */
+static void base_id_set(overlay_header &header, const std::vector<uint64_t> &hashes)
+{
+    header.base_id = fnv1a(FNV1A_INIT, hashes.data(), hashes.size() * sizeof(uint64_t));
+}
+
+// Header of an empty overlay for the image in base, optionally with the hash of each block
+static bool base_header(FILE *base, overlay_header &header, std::vector<uint64_t> *hashes = NULL)
+{
+    std::vector<uint64_t> own_hashes;
+    if(!hashes)
+        hashes = &own_hashes;
+
+    fseek(base, 0, SEEK_END);
+    if(!base_header_init(header, ftell(base), hashes))
+        return false;
+
+    std::vector<uint8_t> data(header.block_size);
+    if(fseek(base, 0, SEEK_SET) != 0)
+        return false;
+
+    for(uint32_t block = 0; block < header.num_blocks; block++)
+    {
+        if(fread(data.data(), data.size(), 1, base) != 1)
+            return false;
+
+        (*hashes)[block] = block_hash(data.data(), header.block_size);
+    }
+
+    base_id_set(header, *hashes);
+    return true;
+}
+
+static void overlay_close()
+{
+    if(overlay_file)
+        fclose(overlay_file);
+
+    overlay_file = NULL;
+    overlay_path.clear();
+    overlay_slots.clear();
+}
+
+static bool overlay_matches(const overlay_header &header, const overlay_header &base)
+{
+    return header.block_size == base.block_size && header.num_blocks == base.num_blocks
+           && header.base_size == base.base_size && header.base_id == base.base_id;
+}
+
+// Opens or creates the overlay for nand_data, as loaded from the image, and applies it
+static bool overlay_open(const char *path)
+{
+    overlay_header expected;
+    std::vector<uint64_t> hashes;
+    if(!base_header_init(expected, nand.metrics.page_size * nand.metrics.num_pages, &hashes))
+        return false;
+    for(uint32_t block = 0; block < expected.num_blocks; block++)
+        hashes[block] = block_hash(nand_data + block * expected.block_size, expected.block_size);
+    base_id_set(expected, hashes);
+
+    if(!journal_replay(path))
+        return false;
+
+    FILE *f = fopen_utf8(path, "r+b");
+    if(!f && (!overlay_create(path, expected) || !(f = fopen_utf8(path, "r+b"))))
+    {
+        gui_perror(path);
+        return false;
+    }
+
+    if(!overlay_read(f, overlay_hdr, overlay_slots) || !overlay_matches(overlay_hdr, expected))
+    {
+        emuprintf("%s is not an overlay for this flash image\n", path);
+        fclose(f);
+        return false;
+    }
+
+    overlay_used = 0;
+    for(uint32_t block = 0; block < overlay_hdr.num_blocks; block++)
+    {
+        uint32_t slot = overlay_slots[block];
+        if(!slot)
+            continue;
+
+        if(fseek(f, overlay_block_offset(overlay_hdr, slot), SEEK_SET) != 0
+           || fread(nand_data + block * overlay_hdr.block_size, overlay_hdr.block_size, 1, f) != 1)
+        {
+            emuprintf("Could not read block %u of overlay %s\n", block, path);
+            fclose(f);
+            return false;
+        }
+        overlay_used = std::max(overlay_used, slot);
+    }
+
+    overlay_file = f;
+    overlay_path = path;
+    return true;
+}
+
+// Moves the modified blocks into batch, for the overlay if there is one
+static void batch_capture(flash_batch &batch)
+{
+    struct block_write {
+        uint64_t offset;
+        const void *data;
+        uint32_t size;
+    };
+
+    uint32_t block_size = nand.metrics.page_size << nand.metrics.log2_pages_per_block;
+    std::vector<block_write> writes;
+    for(uint32_t block = 0; block < nand.metrics.num_pages >> nand.metrics.log2_pages_per_block; block++)
+    {
+        if(!nand.nand_block_modified[block])
+            continue;
+
+        nand.nand_block_modified[block] = false;
+        batch.blocks.push_back(block);
+        const uint8_t *data = nand_data + block * block_size;
+        if(!overlay_file)
+        {
+            writes.push_back({ uint64_t(block) * block_size, data, block_size });
+            continue;
+        }
+
+        uint32_t &slot = overlay_slots[block];
+        if(!slot)
+            slot = ++overlay_used;
+
+        // The table entry even if it's not new, saving it might have failed before
+        writes.push_back({ uint64_t(overlay_block_offset(overlay_hdr, slot)), data, block_size });
+        writes.push_back({ sizeof(overlay_hdr) + block * sizeof(uint32_t), &slot, sizeof(slot) });
+    }
+
+    std::sort(writes.begin(), writes.end(), [](const block_write &a, const block_write &b) {
+        return a.offset < b.offset;
+    });
+
+    batch.file = overlay_file ? overlay_file : flash_file;
+    batch.path = overlay_file ? overlay_path : flash_path;
+    batch.data.reserve(batch.blocks.size() * (block_size + sizeof(uint32_t)));
+    for(const block_write &write : writes)
+    {
+        if(batch.entries.empty() || batch.entries.back().offset + batch.entries.back().size != write.offset)
+            batch.entries.push_back({ write.offset, 0 });
+
+        batch.entries.back().size += write.size;
+        batch.data.insert(batch.data.end(), (const uint8_t *) write.data, (const uint8_t *) write.data + write.size);
+    }
+
+    batch.captured = std::chrono::steady_clock::now();
+}
+
+bool flash_open(const char *filename, const char *overlay) {
     bool large = false;
+    flash_writeback_wait();
+    journal_close();
     if(flash_file)
         fclose(flash_file);
+    overlay_close();
+    switch_hdr_valid = false;
+
+    if(!overlay && !journal_replay(filename))
+        return false;
 
-    flash_file = fopen_utf8(filename, "r+b");
+    // The image doesn't get written to in overlay mode, so it may be read-only
+    flash_file = fopen_utf8(filename, overlay ? "rb" : "r+b");
 
     if (!flash_file) {
         gui_perror(filename);
@@ -435,31 +914,253 @@ bool flash_open(const char *filename) {
         emuprintf("Could not read flash image from %s\n", filename);
         return false;
     }
+    flash_path = filename;
+
+    if(overlay && !overlay_open(overlay))
+    {
+        flash_close();
+        return false;
+    }
 
     return true;
 }
 
+bool flash_overlay_switch(const char *overlay)
+{
+    flash_writeback_wait();
+    journal_close();
+
+    // nand_data doesn't match the image anymore, but the current overlay does
+    overlay_header header = overlay_file ? overlay_hdr : switch_hdr;
+    if(!overlay_file && !switch_hdr_valid && (!flash_file || !base_header(flash_file, header)))
+        return false;
+
+    FILE *f = NULL;
+    if(!overlay_create(overlay, header) || !(f = fopen_utf8(overlay, "r+b")))
+    {
+        gui_perror(overlay);
+        return false;
+    }
+
+    // Blocks which differ from the image have to be saved into the new file
+    for(uint32_t block = 0; block < overlay_slots.size(); block++)
+    {
+        if(overlay_slots[block])
+            nand.nand_block_modified[block] = true;
+    }
+
+    overlay_close();
+    switch_hdr_valid = false;
+    overlay_file = f;
+    overlay_path = overlay;
+    overlay_hdr = header;
+    overlay_slots.assign(header.num_blocks, 0);
+    overlay_used = 0;
+    return true;
+}
+
+void flash_fork_prepare()
+{
+    flash_writeback_wait();
+
+    // Read the image once here instead of in every child
+    switch_hdr_valid = !overlay_file && flash_file && base_header(flash_file, switch_hdr);
+}
+
+const char *flash_overlay_path()
+{
+    return overlay_file ? overlay_path.c_str() : NULL;
+}
+
+bool flash_overlay_commit(const char *base, const char *overlay)
+{
+    if(!journal_replay(base) || !journal_replay(overlay))
+        return false;
+
+    FILE *fb = fopen_utf8(base, "r+b"), *fo = fopen_utf8(overlay, "rb");
+    overlay_header header, expected;
+    std::vector<uint32_t> slots;
+    std::vector<uint64_t> hashes;
+    bool ok = fb && fo && overlay_read(fo, header, slots) && base_header(fb, expected, &hashes)
+              && overlay_matches(header, expected);
+    if(!ok)
+        emuprintf("%s is not an overlay for %s\n", overlay, base);
+
+    // Through the journal, the overlay doesn't match anymore once the image changed
+    flash_batch batch = { fb, base };
+    for(uint32_t block = 0; ok && block < header.num_blocks; block++)
+    {
+        if(!slots[block])
+            continue;
+
+        batch.entries.push_back({ uint64_t(block) * header.block_size, header.block_size });
+        batch.data.resize(batch.data.size() + header.block_size);
+        uint8_t *data = batch.data.data() + batch.data.size() - header.block_size;
+        ok = fseek(fo, overlay_block_offset(header, slots[block]), SEEK_SET) == 0
+             && fread(data, header.block_size, 1, fo) == 1;
+        if(ok)
+            hashes[block] = block_hash(data, header.block_size);
+    }
+
+    batch.captured = std::chrono::steady_clock::now();
+    ok = ok && (batch.entries.empty() || batch_save(batch));
+    journal_close();
+
+    if(fo)
+        fclose(fo);
+    if(fb && fclose(fb) != 0)
+        ok = false;
+
+    // The image changed, so the empty overlay needs a new header
+    base_id_set(expected, hashes);
+    return ok && overlay_create(overlay, expected);
+}
+
+bool flash_overlay_discard(const char *overlay)
+{
+    FILE *f = fopen_utf8(overlay, "rb");
+    overlay_header header;
+    std::vector<uint32_t> slots;
+    bool ok = f && overlay_read(f, header, slots);
+    if(f)
+        fclose(f);
+
+    return ok && overlay_create(overlay, header);
+}
+
+bool flash_overlay_rebase(const char *base, const char *overlay, const char *new_base)
+{
+    if(!journal_replay(base) || !journal_replay(overlay) || !journal_replay(new_base))
+        return false;
+
+    FILE *fb = fopen_utf8(base, "rb"), *fo = fopen_utf8(overlay, "rb"), *fn = fopen_utf8(new_base, "rb");
+    overlay_header header, expected, rebased;
+    std::vector<uint32_t> slots;
+    // The id of new_base gets computed while comparing, it's read only once
+    std::vector<uint64_t> new_hashes;
+    bool ok = fb && fo && fn && overlay_read(fo, header, slots) && base_header(fb, expected)
+              && overlay_matches(header, expected) && fseek(fn, 0, SEEK_END) == 0
+              && base_header_init(rebased, ftell(fn), &new_hashes) && rebased.base_size == header.base_size;
+    if(!ok)
+        emuprintf("Can't rebase %s from %s to %s\n", overlay, base, new_base);
+
+    // Written under a temporary name and renamed, like snapshots
+    std::string tmp = std::string(overlay) + ".tmp";
+    FILE *ft = ok ? fopen_utf8(tmp.c_str(), "w+b") : NULL;
+    std::vector<uint32_t> new_slots(header.num_blocks);
+    ok = ok && ft && fwrite(&rebased, sizeof(rebased), 1, ft) == 1
+         && fwrite(new_slots.data(), sizeof(uint32_t), new_slots.size(), ft) == new_slots.size();
+
+    std::vector<uint8_t> data(ok ? header.block_size : 0), data_new(data.size());
+    uint32_t used = 0;
+    for(uint32_t block = 0; ok && block < header.num_blocks; block++)
+    {
+        // The block as the overlay sees it, compared to the new image
+        if(slots[block])
+            ok = fseek(fo, overlay_block_offset(header, slots[block]), SEEK_SET) == 0
+                 && fread(data.data(), data.size(), 1, fo) == 1;
+        else
+            ok = fseek(fb, long(block) * header.block_size, SEEK_SET) == 0
+                 && fread(data.data(), data.size(), 1, fb) == 1;
+
+        ok = ok && fseek(fn, long(block) * header.block_size, SEEK_SET) == 0
+             && fread(data_new.data(), data_new.size(), 1, fn) == 1;
+        if(ok)
+            new_hashes[block] = block_hash(data_new.data(), header.block_size);
+        if(!ok || memcmp(data.data(), data_new.data(), data.size()) == 0)
+            continue;
+
+        new_slots[block] = ++used;
+        ok = fseek(ft, overlay_block_offset(rebased, used), SEEK_SET) == 0
+             && fwrite(data.data(), data.size(), 1, ft) == 1;
+    }
+
+    base_id_set(rebased, new_hashes);
+    ok = ok && fseek(ft, 0, SEEK_SET) == 0 && fwrite(&rebased, sizeof(rebased), 1, ft) == 1
+         && fwrite(new_slots.data(), sizeof(uint32_t), new_slots.size(), ft) == new_slots.size();
+
+    for(FILE *f : {fb, fo, fn})
+    {
+        if(f)
+            fclose(f);
+    }
+    if(ft && fclose(ft) != 0)
+        ok = false;
+
+#ifdef _WIN32
+    if(ok)
+        remove(overlay);
+#endif
+    if(ok && rename(tmp.c_str(), overlay) == 0)
+        return true;
+
+    if(ft)
+        remove(tmp.c_str());
+    return false;
+}
+
 bool flash_save_changes() {
     if (flash_file == NULL) {
         gui_status_printf("No flash loaded!");
         return false;
     }
-    uint32_t block, count = 0;
-    uint32_t block_size = nand.metrics.page_size << nand.metrics.log2_pages_per_block;
-    for (block = 0; block < nand.metrics.num_pages; block += 1 << nand.metrics.log2_pages_per_block) {
-        if (nand.nand_block_modified[block >> nand.metrics.log2_pages_per_block]) {
-            fseek(flash_file, block * nand.metrics.page_size, SEEK_SET);
-            fwrite(&nand_data[block * nand.metrics.page_size], block_size, 1, flash_file);
-            nand.nand_block_modified[block >> nand.metrics.log2_pages_per_block] = false;
-            count++;
-        }
+
+    flash_writeback_wait();
+    flash_batch batch;
+    batch_capture(batch);
+    if (!batch.entries.empty() && !batch_save(batch)) {
+        batch_failed(batch);
+        return false;
     }
-    fflush(flash_file);
-    gui_status_printf("Flash: Saved %d modified blocks", count);
+    // Everything is in the file now
+    journal_close();
+
+    flash_save_stats stats;
+    flash_get_save_stats(&stats);
+    gui_status_printf("Flash: Saved %d modified blocks (%u KiB in %.1f ms)", int(batch.blocks.size()),
+                      unsigned(batch.data.size() / 1024), batch.entries.empty() ? 0.0 : stats.last_ms);
     return true;
 }
 
+void flash_writeback_poll() {
+    if (!flash_writeback_ms || !flash_file)
+        return;
+
+    auto now = std::chrono::steady_clock::now();
+    if (now - writeback_last < std::chrono::milliseconds(flash_writeback_ms))
+        return;
+
+#ifndef __EMSCRIPTEN__
+    // Try again next time instead of waiting
+    if (writeback_busy)
+        return;
+
+    flash_writeback_wait();
+#endif
+    writeback_last = now;
+
+    flash_batch batch;
+    batch_capture(batch);
+    if (batch.entries.empty())
+        return;
+
+#ifdef __EMSCRIPTEN__
+    if (!batch_save(batch))
+        batch_failed(batch);
+#else
+    writeback_batch = std::move(batch);
+    writeback_busy = true;
+    writeback_thread = new std::thread([] {
+        writeback_ok = batch_save(writeback_batch);
+        writeback_busy = false;
+    });
+#endif
+}
+
 int flash_save_as(const char *filename) {
+    flash_writeback_wait();
+    journal_close();
+
     FILE *f = fopen_utf8(filename, "wb");
     if (!f) {
         emuprintf("NAND flash: could not open ");
@@ -467,7 +1168,7 @@ int flash_save_as(const char *filename) {
         return 1;
     }
     emuprintf("Saving flash image %s...", filename);
-    if (!fwrite(nand_data, nand.metrics.page_size * nand.metrics.num_pages, 1, f) || fflush(f)) {
+    if (!fwrite(nand_data, nand.metrics.page_size * nand.metrics.num_pages, 1, f) || !os_file_sync(f)) {
         int saved_errno = errno;
         fclose(f);
         f = NULL;
@@ -478,8 +1179,11 @@ int flash_save_as(const char *filename) {
     memset(nand.nand_block_modified, 0, nand.metrics.num_pages >> nand.metrics.log2_pages_per_block);
     if (flash_file)
         fclose(flash_file);
+    // The new file has all blocks
+    overlay_close();
 
     flash_file = f;
+    flash_path = filename;
     emuprintf("done\n");
     return 0;
 }
@@ -1056,7 +1760,11 @@ bool flash_os_info(FILE *file, std::string &version)
 
 bool flash_suspend(emu_snapshot *snapshot)
 {
-    if(!snapshot_write(snapshot, &nand, sizeof(nand)))
+    // Since version 2, the path of the overlay comes first
+    uint32_t overlay_len = overlay_file ? overlay_path.size() : 0;
+    if(!snapshot_write(snapshot, &overlay_len, sizeof(overlay_len))
+       || !snapshot_write(snapshot, overlay_path.data(), overlay_len)
+       || !snapshot_write(snapshot, &nand, sizeof(nand)))
         return false;
 
     const size_t num_blocks = nand.metrics.num_pages >> nand.metrics.log2_pages_per_block,
@@ -1078,7 +1786,16 @@ bool flash_resume(const emu_snapshot *snapshot)
 {
     flash_close();
 
-    if(!flash_open(snapshot->header.path_flash))
+    std::string overlay;
+    uint32_t overlay_len = 0;
+    if(snapshot->version >= 2
+       && (!snapshot_read(snapshot, &overlay_len, sizeof(overlay_len)) || overlay_len > 4096))
+        return false;
+    overlay.resize(overlay_len);
+    if(overlay_len && !snapshot_read(snapshot, &overlay[0], overlay_len))
+        return false;
+
+    if(!flash_open(snapshot->header.path_flash, overlay_len ? overlay.c_str() : NULL))
         return false;
 
     if(!snapshot_read(snapshot, &nand, sizeof(nand)))
@@ -1101,11 +1818,16 @@ bool flash_resume(const emu_snapshot *snapshot)
 
 void flash_close()
 {
+    flash_writeback_wait();
+    journal_close();
+
     if(flash_file)
     {
         fclose(flash_file);
         flash_file = NULL;
     }
+    overlay_close();
+    switch_hdr_valid = false;
 
     nand_deinitialize();
 }
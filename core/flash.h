@@ -103,14 +103,56 @@ typedef struct nand_state {
 
 extern nand_state nand;
 
-bool flash_open(const char *filename);
+/* If overlay is set, filename is only read and flash_save_changes writes the
+ * modified blocks into the overlay file instead, which gets created if it
+ * doesn't exist. So many instances can share one image, each with its own
+ * small overlay. */
+bool flash_open(const char *filename, const char *overlay);
 void flash_close();
+/* Path of the overlay in use, NULL if none */
+const char *flash_overlay_path();
+/* Continues with a new overlay at path, replacing any file there. All blocks
+ * which differ from the image get saved into it by flash_save_changes. */
+bool flash_overlay_switch(const char *overlay);
+/* Prepares flash_overlay_switch in forked children, so that they don't have
+ * to read the whole image each. */
+void flash_fork_prepare();
+/* Operations on overlay files, not on the running emulation. commit writes
+ * the blocks into the image and empties the overlay. Other overlays of the
+ * image are refused by it afterwards, as they were made for the old contents:
+ * rebase them from a copy of the old image to the committed one first.
+ * discard empties the overlay. rebase changes the overlay to contain
+ * everything which differs from new_base, so that new_base with it has the
+ * same contents as base with it. */
+bool flash_overlay_commit(const char *base, const char *overlay);
+bool flash_overlay_discard(const char *overlay);
+bool flash_overlay_rebase(const char *base, const char *overlay, const char *new_base);
 
 struct emu_snapshot;
 bool flash_suspend(struct emu_snapshot *snapshot);
 bool flash_resume(const struct emu_snapshot *snapshot);
+/* Saves the modified blocks. Like the writeback, this goes through a journal
+ * next to the file, so that a crash while saving doesn't corrupt it. */
 bool flash_save_changes();
 int flash_save_as(const char *filename);
+
+/* If not 0, the modified blocks get saved every flash_writeback_ms in the
+ * background. The emulation thread only copies them, which doesn't stall
+ * it while the data is written and synced. */
+extern unsigned int flash_writeback_ms;
+// Called by the emulation thread periodically
+void flash_writeback_poll();
+// Waits until the background save, if any, is done
+void flash_writeback_wait();
+
+/* Totals of the saves by flash_save_changes and the writeback. bytes are
+ * written to the image or overlay, the journal gets the same amount. The
+ * latency is from copying the blocks until they are on the disk. */
+struct flash_save_stats {
+    uint64_t saves, blocks, bytes, failures;
+    double last_ms, max_ms, total_ms;
+};
+void flash_get_save_stats(struct flash_save_stats *stats);
 bool flash_create_new(bool flag_large_nand, const char **preload_file, unsigned int product, unsigned int features, bool large_sdram, uint8_t **nand_data_ptr, size_t *size);
 bool flash_read_settings(uint32_t *sdram_size, uint32_t *product, uint32_t *features, uint32_t *asic_user_flags);
 void flash_set_bootorder(BootOrder order);
@@ -34,6 +34,9 @@
 #include "cpu.h"
 #include "armsnippets.h"
 #include "gdbstub.h"
+#include "iothread.h"
+#include "replay.h"
+#include "rewind.h"
 #include "translate.h"
 
 static void gdbstub_disconnect(void);
@@ -51,6 +54,8 @@ bool ndls_is_installed(void) {
 static int listen_socket_fd = -1;
 static int socket_fd = -1;
 static bool gdb_handshake_complete = false;
+// Whether the I/O thread reads socket_fd, see gdb_split
+static bool socket_attached = false;
 
 static void log_socket_error(const char *msg) {
 #ifdef __MINGW32__
@@ -113,15 +118,11 @@ static bool put_debug_char(char c) {
 }
 
 // returns 1 if at least one instruction translated in the range
-static int range_translated(uint32_t range_start, uint32_t range_end) {
-    uint32_t pc;
+static int range_translated(const uint8_t *range_start, const uint8_t *range_end) {
+    const uint8_t *ptr;
     int translated = 0;
-    for (pc = range_start; pc < range_end;  pc += 4) {
-        void *pc_ram_ptr = virt_mem_ptr(pc, 4);
-        if (!pc_ram_ptr)
-            break;
-        translated |= RAM_FLAGS(pc_ram_ptr) & RF_CODE_TRANSLATED;
-    }
+    for (ptr = (const uint8_t *)((uintptr_t)range_start & ~3); ptr < range_end; ptr += 4)
+        translated |= RAM_FLAGS(ptr) & RF_CODE_TRANSLATED;
     return translated;
 }
 
@@ -189,6 +190,42 @@ static char get_debug_char(void) {
     return c;
 }
 
+static char gdb_request[IO_REQUEST_MAX];
+
+/* Returns the next request the I/O thread got from GDB, see gdb_split.
+ * Returns NULL on disconnection. */
+static char *get_request(void) {
+    while(true)
+    {
+        int len = io_take_request(IO_GDB, gdb_request, 100);
+        if(len > 0) {
+            if (log_enabled[LOG_GDB]) {
+                logprintf(LOG_GDB, "%s\n", gdb_request);
+                fflush(stdout);
+            }
+            return gdb_request;
+        }
+
+        if(len == -1 || exiting)
+            return NULL;
+
+        gui_do_stuff(false);
+    }
+}
+
+/* Waits for GDB to acknowledge a packet. Returns '+', '-' or -1 on disconnection */
+static char get_ack(void) {
+    if(!socket_attached)
+        return get_debug_char();
+
+    char *req;
+    while ((req = get_request())) {
+        if (req[0] == '+' || req[0] == '-')
+            return req[0];
+    }
+    return -1;
+}
+
 static void set_nonblocking(int socket, bool nonblocking) {
 #ifdef __MINGW32__
     u_long mode = nonblocking;
@@ -235,6 +272,7 @@ bool gdbstub_init(unsigned int port) {
         log_socket_error("Failed to listen on GDB stub socket");
     }
 
+    io_watch(listen_socket_fd, IO_GDB);
     return true;
 }
 
@@ -245,6 +283,10 @@ static bool ndls_debug_received = false;
 static void gdb_connect_ndls_cb(struct arm_state *state) {
     ndls_debug_alloc_block = state->reg[0]; // can be 0
     ndls_debug_received = true;
+    if (socket_attached)
+        io_notify(IO_GDB); // Requests might have arrived already
+    else
+        io_watch(socket_fd, IO_GDB);
     if (!ndls_debug_alloc_block)
         gui_debug_printf("Ndless failed to allocate the memory block for application debugging.\n");
 }
@@ -285,6 +327,69 @@ static int hex(char ch) {
 static char remcomInBuffer[BUFMAX];
 static char remcomOutBuffer[BUFMAX];
 
+/* Acknowledges the packet in buffer and returns its contents.
+ * Returns NULL on disconnection. */
+static char *ack_packet(char *buffer) {
+    put_debug_char('+');	/* successful transfer */
+
+    /* if a sequence char is present, reply the sequence ID */
+    if(buffer[2] == ':') {
+        if(!put_debug_char(buffer[0])
+           || !put_debug_char(buffer[1])
+           || !flush_out_buffer())
+            return NULL;
+
+        return &buffer[3];
+    }
+    if(!flush_out_buffer())
+        return NULL;
+
+    return &buffer[0];
+}
+
+/* Splits data from GDB into requests, see io_split_fn. This checks packets
+ * already: '$' followed by the contents means that the checksum matched,
+ * '#' that it didn't. Acks and interrupts are passed as they are. */
+static size_t gdb_split(const char *data, size_t size, char *req, size_t *req_len) {
+    size_t i;
+    *req_len = 0;
+    if (data[0] != '$') {
+        /* ignore all other characters */
+        if (data[0] == '+' || data[0] == '-' || data[0] == 0x03) {
+            req[0] = data[0];
+            *req_len = 1;
+        }
+        return 1;
+    }
+
+    for (i = 1; i < size; ++i) {
+        /* drop the packet if it's too long or a new one starts */
+        if (data[i] == '$' || i >= BUFMAX)
+            return i;
+
+        if (data[i] == '#') {
+            unsigned char checksum = 0;
+            size_t j;
+            if (size < i + 3)
+                return 0;
+
+            for (j = 1; j < i; ++j)
+                checksum += data[j];
+
+            if (hex(data[i + 1]) == checksum >> 4 && hex(data[i + 2]) == (checksum & 0xf)) {
+                req[0] = '$';
+                memcpy(req + 1, data + 1, i - 1);
+                *req_len = i;
+            } else {
+                req[0] = '#';
+                *req_len = 1;
+            }
+            return i + 3;
+        }
+    }
+    return 0;
+}
+
 /* scan for the sequence $<data>#<checksum>. # will be replaced with \0.
  * Returns NULL on disconnection. */
 char *getpacket(void) {
@@ -294,6 +399,21 @@ char *getpacket(void) {
     int count;
     char ch;
 
+    while (socket_attached) {
+        char *req = get_request();
+        if (!req)
+            return NULL;
+
+        if (req[0] == '#') {
+            if(!put_debug_char('-')	/* failed checksum */
+               || !flush_out_buffer())
+                return NULL;
+        } else if (req[0] == '$') {
+            strcpy(buffer, req + 1);
+            return ack_packet(buffer);
+        }
+    }
+
     while (1) {
         /* wait around for the start character, ignore all other characters */
         do {
@@ -329,23 +449,8 @@ retry:
                 if(!put_debug_char('-')	/* failed checksum */
                    || !flush_out_buffer())
                     return NULL;
-            } else {
-                put_debug_char('+');	/* successful transfer */
-
-                /* if a sequence char is present, reply the sequence ID */
-                if(buffer[2] == ':') {
-                    if(!put_debug_char(buffer[0])
-                       || !put_debug_char(buffer[1])
-                       || !flush_out_buffer())
-                        return NULL;
-
-                    return &buffer[3];
-                }
-                if(!flush_out_buffer())
-                    return NULL;
-
-                return &buffer[0];
-            }
+            } else
+                return ack_packet(buffer);
         }
     }
 }
@@ -376,7 +481,7 @@ static bool putpacket(char *buffer) {
            || !flush_out_buffer())
             return false;
 
-        ch = get_debug_char();
+        ch = get_ack();
     } while (ch != '+' && ch != (char) -1);
 
     return true;
@@ -608,11 +713,12 @@ void gdbstub_loop(void) {
                         strcpy(remcomOutBuffer, "E03");
                         break;
                     }
-                    if (range_translated((uintptr_t)ramaddr, (uintptr_t)((char *)ramaddr + length)))
+                    if (range_translated(ramaddr, (uint8_t *)ramaddr + length))
                         flush_translations();
-                    if (hex2mem(ptr, ramaddr, length))
+                    if (hex2mem(ptr, ramaddr, length)) {
+                        replay_debugger_write(phys_mem_addr(ramaddr), ramaddr, length);
                         strcpy(remcomOutBuffer, "OK");
-                    else
+                    } else
                         strcpy(remcomOutBuffer, "E03");
                 } else
                     strcpy(remcomOutBuffer, "E02");
@@ -624,7 +730,7 @@ void gdbstub_loop(void) {
                     ptr++;
                 // fallthrough
             case 's': /* s[AA..AA]  Step at address AA..AA(optional) */
-                cpu_events |= EVENT_DEBUG_STEP;
+                cpu_events_set(EVENT_DEBUG_STEP);
                 goto parse_new_pc;
             case 'C': /* Csig[;AA..AA] Continue with signal at address AA..AA(optional). Same as 'c' for us. */
                 ptr = strchr(ptr, ';'); /* skip the signal */
@@ -637,6 +743,24 @@ parse_new_pc:
                     arm.reg[15] = addr;
                 }
 
+                gui_debugger_entered_or_left(in_debugger = false);
+                return;
+            case 'b': /* bs or bc: Backward single step or continue, using rewind states */
+                if ((*ptr != 's' && *ptr != 'c') || ptr[1]) {
+                    gui_debug_printf("Unsupported GDB cmd '%s'\n", ptr - 1);
+                    break;
+                }
+                if (!rewind_reverse_request(*ptr == 'c')) {
+                    strcpy(remcomOutBuffer, "E01");
+                    break;
+                }
+                if (rewind_reverse_at_begin()) {
+                    if (!send_stop_reply(SIGNAL_TRAP, "replaylog", "begin"))
+                        goto disconnect;
+                    reply = false;
+                    break;
+                }
+
                 gui_debugger_entered_or_left(in_debugger = false);
                 return;
             case 'q': /* qString Get value of String */
@@ -666,10 +790,11 @@ parse_new_pc:
                     /* Host information */
                     strcpy(remcomOutBuffer, "cputype:12;cpusubtype:7;endian:little;ptrsize:4;");
                 }
-                else if(!strcmp("Supported", ptr))
+                else if(!strncmp("Supported", ptr, 9) && (ptr[9] == '\0' || ptr[9] == ':'))
                 {
-                    /* Feature query */
-                    strcpy(remcomOutBuffer, "vContSupported");
+                    /* Feature query, GDB lists its own features after ':'.
+                     * Packets are limited to BUFMAX including "$#xx". */
+                    sprintf(remcomOutBuffer, "PacketSize=%x;vContSupported+;ReverseStep+;ReverseContinue+", BUFMAX - 4);
                 }
                 else if(!strcmp("Symbol::", ptr))
                 {
@@ -695,6 +820,7 @@ parse_new_pc:
                 ptr = strtok(ptr, ",");
                 if (ptr && hexToInt(&ptr, &addr) && (ramaddr = virt_mem_ptr(addr & ~3, 4))) {
                     uint32_t *flags = &RAM_FLAGS(ramaddr);
+                    RAM_PAGE_FLAGS(ramaddr) |= RPF_BREAKPOINT;
                     switch (*ptr1) {
                         case '0': // mem breakpoint
                         case '1': // hw breakpoint
@@ -741,12 +867,18 @@ void gdbstub_reset(void) {
 
 static void gdbstub_disconnect(void) {
     gui_status_printf("GDB disconnected.");
+    if (socket_attached)
+        io_detach(IO_GDB);
+    else
+        io_unwatch(socket_fd);
+    socket_attached = false;
 #ifdef __MINGW32__
     closesocket(socket_fd);
 #else
     close(socket_fd);
 #endif
     socket_fd = -1;
+    io_watch(listen_socket_fd, IO_GDB);
     gdb_connected = false;
     if (ndls_is_installed())
         armloader_load_snippet(SNIPPET_ndls_debug_free, NULL, 0, NULL);
@@ -760,8 +892,10 @@ void gdbstub_recv(void) {
     int ret, on;
     if (socket_fd == -1) {
         socket_fd = accept(listen_socket_fd, NULL, NULL);
-        if (socket_fd == -1)
+        if (socket_fd == -1) {
+            io_watch(listen_socket_fd, IO_GDB);
             return;
+        }
         set_nonblocking(socket_fd, true);
         /* Disable Nagle for low latency */
         on = 1;
@@ -773,6 +907,8 @@ void gdbstub_recv(void) {
         if (ret == -1)
             log_socket_error("setsockopt(TCP_NODELAY) failed for GDB stub socket");
 
+        socket_attached = io_attach(socket_fd, IO_GDB, gdb_split);
+
         /* Interface with Ndless */
         if (ndls_is_installed())
         {
@@ -790,10 +926,29 @@ void gdbstub_recv(void) {
         gui_status_printf("GDB connected.");
     }
 
-    // Wait until we know the program location
+    // Wait until we know the program location, gdb_connect_ndls_cb watches the socket then
     if(!ndls_debug_received)
         return;
 
+    if (socket_attached) {
+        ret = io_queued_requests(IO_GDB);
+        if (ret == -1) {
+            gdbstub_disconnect();
+            return;
+        }
+        if (!ret)
+            return;
+
+        if(!gdb_handshake_complete)
+        {
+            gdb_handshake_complete = true;
+            gdbstub_loop();
+        }
+        else
+            gdbstub_debugger(DBG_USER, 0);
+        return;
+    }
+
     fd_set rfds;
     FD_ZERO(&rfds);
     FD_SET((unsigned)socket_fd, &rfds);
@@ -811,13 +966,21 @@ void gdbstub_recv(void) {
         else
             gdbstub_debugger(DBG_USER, 0);
     }
+
+    io_watch(socket_fd, IO_GDB);
 }
 
 /* addr is only required for read/write breakpoints */
 void gdbstub_debugger(enum DBG_REASON reason, uint32_t addr) {
-    cpu_events &= ~EVENT_DEBUG_STEP;
+    cpu_events_clear(EVENT_DEBUG_STEP);
+    rewind_reverse_cancel(); // Interrupted by the user
     char addrstr[9]; // 8 digits
     snprintf(addrstr, sizeof(addrstr), "%x", addr);
+    if (rewind_reverse_at_begin()) {
+        send_stop_reply(SIGNAL_TRAP, "replaylog", "begin");
+        gdbstub_loop();
+        return;
+    }
     switch (reason) {
         case DBG_WRITE_BREAKPOINT:
             send_stop_reply(SIGNAL_TRAP, "watch", addrstr);
@@ -835,6 +998,7 @@ void gdbstub_quit()
 {
     if(listen_socket_fd != -1)
     {
+        io_unwatch(listen_socket_fd);
         #ifdef __MINGW32__
             closesocket(listen_socket_fd);
         #else
@@ -845,6 +1009,11 @@ void gdbstub_quit()
 
     if(socket_fd != -1)
     {
+        if (socket_attached)
+            io_detach(IO_GDB);
+        else
+            io_unwatch(socket_fd);
+        socket_attached = false;
         #ifdef __MINGW32__
             closesocket(socket_fd);
         #else
@@ -7,14 +7,36 @@
 /* DC000000: Interrupt controller */
 interrupt_state intr;
 
+/* Derived from intr.priority and intr.irq_ctrl_vect, not part of snapshots.
+ * Rebuilt by int_rebuild_masks. */
+static uint32_t priority_mask[8]; // Sources with that priority
+static uint16_t source_vectors[32]; // CX: enabled vectors using that source
+
+static void int_rebuild_masks() {
+    memset(priority_mask, 0, sizeof(priority_mask));
+    for (int i = 0; i < 32; i++)
+        priority_mask[intr.priority[i] & 7] |= 1u << i;
+
+    memset(source_vectors, 0, sizeof(source_vectors));
+    for (int i = 0; i < 16; i++) {
+        uint8_t ctrl = intr.irq_ctrl_vect[i];
+        if (ctrl & 0x20)
+            source_vectors[ctrl & 0x1F] |= 1 << i;
+    }
+}
+
+// Highest priority (lowest value) first, then the lowest number
 static void get_current_int(int is_fiq, int *current) {
     uint32_t masked_status = intr.status & intr.mask[is_fiq];
     int pri_limit = intr.priority_limit[is_fiq];
-    int i;
-    for (i = 0; i < 32; i++) {
-        if (masked_status & (1u << i) && intr.priority[i] < pri_limit) {
-            *current = i;
-            pri_limit = intr.priority[i];
+    if (pri_limit > 8)
+        pri_limit = 8;
+
+    for (int pri = 0; masked_status && pri < pri_limit; pri++) {
+        uint32_t pending = masked_status & priority_mask[pri];
+        if (pending) {
+            *current = __builtin_ctz(pending);
+            return;
         }
     }
 }
@@ -100,7 +122,10 @@ void int_write_word(uint32_t addr, uint32_t value) {
         }
     } else {
         if (!(addr & 0x80)) {
-            intr.priority[addr >> 2 & 0x1F] = value & 7;
+            int num = addr >> 2 & 0x1F;
+            priority_mask[intr.priority[num]] &= ~(1u << num);
+            intr.priority[num] = value & 7;
+            priority_mask[intr.priority[num]] |= 1u << num;
             return;
         }
     }
@@ -111,23 +136,15 @@ static void update_cx() {
     uint32_t active_irqs = intr.active & intr.mask[0] & ~intr.mask[1];
     if (active_irqs != 0)
     {
-        // Fallback first
-        intr.irq_handler_cur = intr.irq_handler_def;
+        // Enabled vectors with an active source, the lowest one wins
+        uint32_t vectors = 0;
+        for (uint32_t irqs = active_irqs; irqs; irqs &= irqs - 1)
+            vectors |= source_vectors[__builtin_ctz(irqs)];
 
-        // Vectored handling enabled?
-        for(unsigned int i = 0; i < sizeof(intr.irq_ctrl_vect)/sizeof(intr.irq_ctrl_vect[0]); ++i)
-        {
-            uint8_t ctrl = intr.irq_ctrl_vect[i];
-            if((ctrl & 0x20) == 0)
-                continue; // Disabled
-
-            if(active_irqs & (1 << (ctrl & 0x1F)))
-            {
-                // Vector enabled and active
-                intr.irq_handler_cur = intr.irq_addr_vect[i];
-                break;
-            }
-        }
+        if (vectors)
+            intr.irq_handler_cur = intr.irq_addr_vect[__builtin_ctz(vectors)];
+        else
+            intr.irq_handler_cur = intr.irq_handler_def;
 
         arm.interrupts |= 0x80;
     }
@@ -195,7 +212,10 @@ void int_cx_write_word(uint32_t addr, uint32_t value) {
             if(offset < 0x200)
                 intr.irq_addr_vect[entry] = value;
             else
+            {
                 intr.irq_ctrl_vect[entry] = value;
+                int_rebuild_masks();
+            }
 
             return;
         }
@@ -221,6 +241,7 @@ void int_reset() {
     intr.noninverted = -1;
     intr.priority_limit[0] = 8;
     intr.priority_limit[1] = 8;
+    int_rebuild_masks();
 }
 
 bool interrupt_suspend(emu_snapshot *snapshot)
@@ -230,5 +251,9 @@ bool interrupt_suspend(emu_snapshot *snapshot)
 
 bool interrupt_resume(const emu_snapshot *snapshot)
 {
-    return snapshot_read(snapshot, &intr, sizeof(intr));
+    if (!snapshot_read(snapshot, &intr, sizeof(intr)))
+        return false;
+
+    int_rebuild_masks();
+    return true;
 }
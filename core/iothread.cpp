@@ -0,0 +1,438 @@
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "emu.h"
+#include "iothread.h"
+
+#if defined(__linux__) && !defined(__EMSCRIPTEN__)
+#include <cerrno>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+static std::atomic<uint32_t> io_pending;
+
+void io_notify(uint32_t source)
+{
+    io_pending.fetch_or(source);
+    cpu_events_set(EVENT_IO);
+    emu_wakeup();
+}
+
+uint32_t io_take_pending()
+{
+    return io_pending.exchange(0);
+}
+
+#if defined(__linux__) && !defined(__EMSCRIPTEN__)
+
+// data.u64 of the eventfd used to stop the thread, sources only use 32 bits
+#define IO_STOP (1ull << 32)
+// Set in data.u64 for attached connections
+#define IO_READ (1ull << 33)
+
+static int epoll_fd = -1, stop_fd = -1;
+// Not a plain object, the destructor would terminate on exit() without io_thread_stop
+static std::thread *io_thread;
+static std::atomic<bool> io_stopping;
+
+struct io_request {
+    size_t len;
+    char data[IO_REQUEST_MAX];
+};
+
+/* Ring buffer with a single producer (the I/O thread) and a single consumer
+ * (the emulation thread). Slots are owned by one side at a time. */
+template <size_t N> class io_queue {
+public:
+    // Returns the slot to fill next, nullptr if full
+    io_request *back()
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        return t - head.load() == N ? nullptr : &slots[t % N];
+    }
+    void push() { tail.store(tail.load(std::memory_order_relaxed) + 1); }
+
+    // Returns the oldest request, nullptr if empty
+    io_request *front()
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        return h == tail.load() ? nullptr : &slots[h % N];
+    }
+    void pop() { head.store(head.load(std::memory_order_relaxed) + 1); }
+
+    size_t size() { return tail.load() - head.load(); }
+    // Only if neither side uses it
+    void clear() { head.store(tail.load()); }
+
+private:
+    io_request slots[N];
+    std::atomic<size_t> head{0}, tail{0};
+};
+
+struct io_connection {
+    // Changed with mutex held, so the I/O thread doesn't read a closed fd
+    int fd = -1;
+    io_split_fn split;
+    // Received, but not split yet. Only used by the I/O thread.
+    std::string data;
+    io_queue<16> queue;
+    std::atomic<bool> closed{false};
+
+    /* The queue itself doesn't need it. The I/O thread holds it while
+     * reading, and both sides wait on cond with it when they have to. */
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::atomic<bool> producer_waiting{false}, consumer_waiting{false};
+};
+
+static io_connection connections[2];
+
+static io_connection &connection(uint32_t source)
+{
+    assert(source == IO_GDB || source == IO_RDEBUG);
+    return connections[source == IO_GDB ? 0 : 1];
+}
+
+// Wakes up the other side if it waits, see io_connection::mutex. Not for the I/O thread.
+static void io_wake(io_connection &conn, std::atomic<bool> &waiting)
+{
+    if(!waiting.load())
+        return;
+
+    { std::lock_guard<std::mutex> lock(conn.mutex); }
+    conn.cond.notify_all();
+}
+
+// Splits conn.data into requests. Returns false if the connection got detached.
+static bool io_split(io_connection &conn, uint32_t source, std::unique_lock<std::mutex> &lock)
+{
+    size_t pos = 0;
+    bool queued = false;
+    while(pos < conn.data.size())
+    {
+        io_request *req = conn.queue.back();
+        if(!req)
+        {
+            // Full, wait for the emulation thread to take some
+            if(queued)
+                io_notify(source);
+
+            conn.producer_waiting.store(true);
+            conn.cond.wait(lock, [&] { return (req = conn.queue.back()) || conn.fd == -1 || io_stopping; });
+            conn.producer_waiting.store(false);
+            if(!req)
+                return false;
+        }
+
+        size_t len = 0;
+        size_t used = conn.split(conn.data.data() + pos, conn.data.size() - pos, req->data, &len);
+        if(!used)
+            break;
+
+        pos += used;
+        if(len)
+        {
+            req->data[len] = 0;
+            req->len = len;
+            conn.queue.push();
+            queued = true;
+        }
+    }
+
+    conn.data.erase(0, pos);
+    if(queued)
+    {
+        if(conn.consumer_waiting)
+            conn.cond.notify_all();
+        io_notify(source);
+    }
+
+    return true;
+}
+
+static void io_read(uint32_t source)
+{
+    io_connection &conn = connection(source);
+    std::unique_lock<std::mutex> lock(conn.mutex);
+    while(conn.fd != -1 && !conn.closed)
+    {
+        char buf[4096];
+        ssize_t count = recv(conn.fd, buf, sizeof(buf), 0);
+        if(count == -1 && errno == EINTR)
+            continue;
+        if(count == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+
+        if(count <= 0)
+        {
+            // Closed or failed, the emulation thread notices once it took everything
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn.fd, nullptr);
+            conn.closed = true;
+            if(conn.consumer_waiting)
+                conn.cond.notify_all();
+            io_notify(source);
+            return;
+        }
+
+        conn.data.append(buf, count);
+        if(!io_split(conn, source, lock))
+            return;
+    }
+}
+
+static void io_thread_loop()
+{
+    struct epoll_event events[8];
+    while(true)
+    {
+        int count = epoll_wait(epoll_fd, events, 8, -1);
+        if(count == -1)
+        {
+            if(errno == EINTR)
+                continue;
+
+            gui_perror("I/O thread: epoll_wait failed");
+            return;
+        }
+
+        uint32_t ready = 0;
+        for(int i = 0; i < count; ++i)
+        {
+            if(events[i].data.u64 == IO_STOP)
+                return;
+
+            if(events[i].data.u64 & IO_READ)
+                io_read(uint32_t(events[i].data.u64));
+            else
+                ready |= uint32_t(events[i].data.u64);
+        }
+
+        if(ready)
+            io_notify(ready);
+    }
+}
+
+bool io_thread_start()
+{
+    if(epoll_fd != -1)
+        return true;
+
+    io_stopping = false;
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(epoll_fd == -1)
+        return false;
+
+    stop_fd = eventfd(0, EFD_CLOEXEC);
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.u64 = IO_STOP;
+    if(stop_fd == -1 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_fd, &ev) == -1)
+    {
+        gui_perror("I/O thread: Failed to set up stop event");
+        if(stop_fd != -1)
+            close(stop_fd);
+        close(epoll_fd);
+        epoll_fd = stop_fd = -1;
+        return false;
+    }
+
+    io_thread = new std::thread(io_thread_loop);
+    return true;
+}
+
+void io_thread_stop()
+{
+    if(epoll_fd == -1)
+        return;
+
+    io_stopping = true;
+    for(auto &conn : connections)
+        io_wake(conn, conn.producer_waiting);
+
+    uint64_t one = 1;
+    if(write(stop_fd, &one, sizeof(one)) != sizeof(one))
+        gui_perror("I/O thread: Failed to signal stop event");
+
+    io_thread->join();
+    delete io_thread;
+    io_thread = nullptr;
+
+    close(stop_fd);
+    close(epoll_fd);
+    epoll_fd = stop_fd = -1;
+}
+
+bool io_thread_running()
+{
+    return epoll_fd != -1;
+}
+
+void io_watch(int fd, uint32_t source)
+{
+    if(epoll_fd == -1 || fd == -1)
+        return;
+
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.u64 = source;
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1
+       && (errno != ENOENT || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1))
+        gui_perror("I/O thread: Failed to watch socket");
+}
+
+void io_unwatch(int fd)
+{
+    if(epoll_fd == -1 || fd == -1)
+        return;
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+bool io_attach(int fd, uint32_t source, io_split_fn split)
+{
+    if(epoll_fd == -1 || fd == -1)
+        return false;
+
+    io_connection &conn = connection(source);
+    {
+        std::lock_guard<std::mutex> lock(conn.mutex);
+        conn.fd = fd;
+        conn.split = split;
+        conn.data.clear();
+        conn.queue.clear();
+        conn.closed = false;
+    }
+
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.u64 = IO_READ | source;
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1
+       && (errno != ENOENT || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1))
+    {
+        gui_perror("I/O thread: Failed to watch socket");
+        std::lock_guard<std::mutex> lock(conn.mutex);
+        conn.fd = -1;
+        return false;
+    }
+
+    return true;
+}
+
+void io_detach(uint32_t source)
+{
+    if(epoll_fd == -1)
+        return;
+
+    io_connection &conn = connection(source);
+    std::lock_guard<std::mutex> lock(conn.mutex);
+    if(conn.fd == -1)
+        return;
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn.fd, nullptr);
+    conn.fd = -1;
+    conn.queue.clear();
+    conn.cond.notify_all();
+}
+
+int io_take_request(uint32_t source, char *req, int timeout_ms)
+{
+    io_connection &conn = connection(source);
+    io_request *front = conn.queue.front();
+    if(!front && timeout_ms > 0 && !conn.closed)
+    {
+        std::unique_lock<std::mutex> lock(conn.mutex);
+        conn.consumer_waiting.store(true);
+        conn.cond.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+                           [&] { return (front = conn.queue.front()) || conn.closed || conn.fd == -1; });
+        conn.consumer_waiting.store(false);
+    }
+
+    if(!front)
+    {
+        // The I/O thread sets closed after queueing the last requests
+        bool closed = conn.closed || conn.fd == -1;
+        front = conn.queue.front();
+        if(!front)
+            return closed ? -1 : 0;
+    }
+
+    size_t len = front->len;
+    memcpy(req, front->data, len + 1);
+    conn.queue.pop();
+    io_wake(conn, conn.producer_waiting);
+    return int(len);
+}
+
+int io_queued_requests(uint32_t source)
+{
+    io_connection &conn = connection(source);
+    bool closed = conn.closed || conn.fd == -1;
+    size_t count = conn.queue.size();
+    if(!count && closed)
+        return -1;
+
+    return int(count);
+}
+
+#else
+
+bool io_thread_start()
+{
+    return false;
+}
+
+void io_thread_stop() {}
+
+bool io_thread_running()
+{
+    return false;
+}
+
+void io_watch(int fd, uint32_t source)
+{
+    (void) fd;
+    (void) source;
+}
+
+void io_unwatch(int fd)
+{
+    (void) fd;
+}
+
+bool io_attach(int fd, uint32_t source, io_split_fn split)
+{
+    (void) fd;
+    (void) source;
+    (void) split;
+    return false;
+}
+
+void io_detach(uint32_t source)
+{
+    (void) source;
+}
+
+int io_take_request(uint32_t source, char *req, int timeout_ms)
+{
+    (void) source;
+    (void) req;
+    (void) timeout_ms;
+    return -1;
+}
+
+int io_queued_requests(uint32_t source)
+{
+    (void) source;
+    return -1;
+}
+
+#endif
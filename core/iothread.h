@@ -0,0 +1,67 @@
+/* Declarations for iothread.cpp */
+
+#ifndef _H_IOTHREAD
+#define _H_IOTHREAD
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Sources of host input the emulation thread has to look at */
+#define IO_GDB     1
+#define IO_RDEBUG  2
+#define IO_USBLINK 4
+#define IO_INPUT   8 // Keypad and touchpad, see keypad_process_input
+
+/* Where available (epoll), a thread waits on the sockets of the debugger
+ * interfaces. Once one of them is readable, its source is marked as pending
+ * and EVENT_IO makes the emulation thread handle it at the next instruction
+ * boundary. Returns false if there is no such thread, then the sockets have
+ * to be polled periodically. */
+bool io_thread_start(void);
+void io_thread_stop(void);
+bool io_thread_running(void);
+
+/* Marks source as pending once fd is readable. This is one-shot, so call it
+ * again after reading from fd to get notified about more data. */
+void io_watch(int fd, uint32_t source);
+/* Must be called before closing fd */
+void io_unwatch(int fd);
+/* Marks source as pending. Can be called from any thread. */
+void io_notify(uint32_t source);
+/* Returns and clears the set of pending sources */
+uint32_t io_take_pending(void);
+
+/* Connections of the debugger interfaces (IO_GDB and IO_RDEBUG) can also be
+ * read by the I/O thread itself. It splits what it receives into requests and
+ * passes them to the emulation thread through a lock-free queue, marking the
+ * source as pending whenever there are new ones. */
+#define IO_REQUEST_MAX 4096
+
+/* Finds the first request in data. Returns the number of bytes consumed, or 0
+ * if more data is needed. If the consumed bytes form a request, it's written
+ * to req (at most IO_REQUEST_MAX - 1 bytes) and its length to *req_len,
+ * otherwise *req_len is set to 0 and they're dropped. Runs on the I/O thread. */
+typedef size_t (*io_split_fn)(const char *data, size_t size, char *req, size_t *req_len);
+
+/* Starts reading fd on the I/O thread. Returns false if there is no I/O
+ * thread, then fd has to be read by the caller. */
+bool io_attach(int fd, uint32_t source, io_split_fn split);
+/* Must be called before closing the fd. Drops requests not taken yet. */
+void io_detach(uint32_t source);
+/* Copies the next request of source to req (IO_REQUEST_MAX bytes, NUL
+ * terminated) and returns its length. Waits up to timeout_ms for one, returns
+ * 0 if there is none and -1 once the connection is closed. */
+int io_take_request(uint32_t source, char *req, int timeout_ms);
+/* Returns the number of queued requests, or -1 if the connection is closed */
+int io_queued_requests(uint32_t source);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
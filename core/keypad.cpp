@@ -1,22 +1,21 @@
 #include <assert.h>
 #include <string.h>
 
-#include <mutex>
+#include <atomic>
 
 #include "emu.h"
 #include "misc.h"
 #include "keypad.h"
 #include "schedule.h"
 #include "interrupt.h"
+#include "iothread.h"
 #include "mem.h"
+#include "replay.h"
 
 /* 900E0000: Keypad controller */
 keypad_state keypad;
 
-static std::recursive_mutex keypad_mut;
-
 void keypad_int_check() {
-    std::lock_guard<std::recursive_mutex> lg(keypad_mut);
     if(keypad.touchpad_contact != keypad.touchpad_last_contact)
         keypad.touchpad_irq_state |= 0x4;
     if(keypad.touchpad_down != keypad.touchpad_last_down)
@@ -41,7 +40,6 @@ void keypad_on_pressed() {
 }
 
 uint32_t keypad_read(uint32_t addr) {
-    std::lock_guard<std::recursive_mutex> lg(keypad_mut);
     cycle_count_delta += 1000; // avoid slowdown with polling loops
     switch (addr & 0x7F) {
         case 0x00: return keypad.kpc.control;
@@ -62,7 +60,6 @@ uint32_t keypad_read(uint32_t addr) {
     return bad_read_word(addr);
 }
 void keypad_write(uint32_t addr, uint32_t value) {
-    std::lock_guard<std::recursive_mutex> lg(keypad_mut);
     switch (addr & 0x7F) {
         case 0x00:
             keypad.kpc.control = value;
@@ -89,7 +86,6 @@ void keypad_write(uint32_t addr, uint32_t value) {
 }
 // Scan next row of keypad, if scanning is enabled
 static void keypad_scan_event(int index) {
-    std::lock_guard<std::recursive_mutex> lg(keypad_mut);
     if (keypad.kpc.current_row >= 16)
         error("too many keypad rows");
 
@@ -127,12 +123,9 @@ static void keypad_scan_event(int index) {
     keypad_int_check();
 }
 void keypad_reset() {
-    std::lock_guard<std::recursive_mutex> lg(keypad_mut);
     memset(&keypad.kpc, 0, sizeof keypad.kpc);
     keypad.touchpad_page = 0x04;
-    sched.items[SCHED_KEYPAD].clock = CLOCK_APB;
-    sched.items[SCHED_KEYPAD].second = -1;
-    sched.items[SCHED_KEYPAD].proc = keypad_scan_event;
+    sched_init_item(SCHED_KEYPAD, CLOCK_APB, keypad_scan_event, false);
 }
 
 static void touchpad_captivate_write(uint8_t value) {
@@ -352,11 +345,9 @@ read_again:
 
 /* 90050000 */
 void touchpad_cx_reset(void) {
-    std::lock_guard<std::recursive_mutex> lg(keypad_mut);
     keypad.touchpad_cx = {};
 }
 uint32_t touchpad_cx_read(uint32_t addr) {
-    std::lock_guard<std::recursive_mutex> lg(keypad_mut);
     switch (addr & 0xFFFF) {
         case 0x0010:
             if (!keypad.touchpad_cx.reading)
@@ -376,7 +367,6 @@ uint32_t touchpad_cx_read(uint32_t addr) {
     return bad_read_word(addr);
 }
 void touchpad_cx_write(uint32_t addr, uint32_t value) {
-    std::lock_guard<std::recursive_mutex> lg(keypad_mut);
     switch (addr & 0xFFFF) {
         case 0x0010:
             if(emulate_cx2 && (features & 1)) {
@@ -417,10 +407,68 @@ bool keypad_resume(const emu_snapshot *snapshot)
     return snapshot_read(snapshot, &keypad, sizeof(keypad));
 }
 
+/* Input from the GUI thread, applied by the emulation thread. Single producer,
+ * single consumer, so the indices are all the synchronization needed. */
+struct input_event {
+    enum { KEY, TOUCHPAD } type;
+    int row, col;
+    float x, y;
+    bool state, contact, down;
+};
+
+#define INPUT_QUEUE_SIZE 256
+static input_event input_queue[INPUT_QUEUE_SIZE];
+static std::atomic<unsigned int> input_head, input_tail; // Consumer and producer
+static input_event touchpad_last; // Only used by the GUI thread
+
+static void input_push(const input_event &event)
+{
+    unsigned int tail = input_tail.load(std::memory_order_relaxed);
+    if(tail - input_head.load(std::memory_order_acquire) == INPUT_QUEUE_SIZE)
+    {
+        gui_debug_printf("Input queue full, dropping input\n");
+        return;
+    }
+
+    input_queue[tail % INPUT_QUEUE_SIZE] = event;
+    input_tail.store(tail + 1, std::memory_order_release);
+    io_notify(IO_INPUT);
+}
+
+void keypad_process_input()
+{
+    unsigned int head = input_head.load(std::memory_order_relaxed),
+                 tail = input_tail.load(std::memory_order_acquire);
+    for(; head != tail; ++head)
+    {
+        const input_event &event = input_queue[head % INPUT_QUEUE_SIZE];
+        if(event.type == input_event::KEY)
+        {
+            if(!replay_key(event.row, event.col, event.state))
+                keypad_apply_key(event.row, event.col, event.state);
+        }
+        else if(!replay_touchpad(event.x, event.y, event.contact, event.down))
+            touchpad_apply_state(event.x, event.y, event.contact, event.down);
+    }
+
+    input_head.store(head, std::memory_order_release);
+}
+
 void keypad_set_key(int row, int col, bool state)
 {
-    std::lock_guard<std::recursive_mutex> lg(keypad_mut);
+    assert(row < KEYPAD_ROWS);
+    assert(col < KEYPAD_COLS);
 
+    input_event event = {};
+    event.type = input_event::KEY;
+    event.row = row;
+    event.col = col;
+    event.state = state;
+    input_push(event);
+}
+
+void keypad_apply_key(int row, int col, bool state)
+{
     assert(row < KEYPAD_ROWS);
     assert(col < KEYPAD_COLS);
 
@@ -435,7 +483,27 @@ void keypad_set_key(int row, int col, bool state)
 
 void touchpad_set_state(float x, float y, bool contact, bool down)
 {
-    std::lock_guard<std::recursive_mutex> lg(keypad_mut);
+    input_event event = {};
+    event.type = input_event::TOUCHPAD;
+    // Without contact, the position doesn't change
+    event.x = (contact || down) ? x : touchpad_last.x;
+    event.y = (contact || down) ? y : touchpad_last.y;
+    event.contact = contact;
+    event.down = down;
+    touchpad_last = event;
+    input_push(event);
+}
+
+void touchpad_get_state(float *x, float *y, bool *contact, bool *down)
+{
+    *x = touchpad_last.x;
+    *y = touchpad_last.y;
+    *contact = touchpad_last.contact;
+    *down = touchpad_last.down;
+}
+
+void touchpad_apply_state(float x, float y, bool contact, bool down)
+{
     if(contact || down)
     {
         int new_x = x * TOUCHPAD_X_MAX,
@@ -71,6 +71,15 @@ void touchpad_cx_reset(void);
 uint32_t touchpad_cx_read(uint32_t addr);
 void touchpad_cx_write(uint32_t addr, uint32_t value);
 void touchpad_set_state(float x, float y, bool contact, bool down);
+/* The state last passed to touchpad_set_state */
+void touchpad_get_state(float *x, float *y, bool *contact, bool *down);
+/* keypad_set_key and touchpad_set_state only queue the change and must only
+ * be called from one thread, usually the GUI. The emulation thread applies
+ * queued changes with keypad_process_input. */
+void keypad_process_input(void);
+/* Apply changes directly, bypassing record/replay */
+void keypad_apply_key(int row, int col, bool state);
+void touchpad_apply_state(float x, float y, bool contact, bool down);
 
 #define TOUCHPAD_X_MAX 0x0918
 #define TOUCHPAD_Y_MAX 0x069B
@@ -327,9 +327,7 @@ static void lcd_event(int index) {
 void lcd_reset() {
     // Palette is unchanged on a reset
     memset(&lcd, 0, (char *)&lcd.palette - (char *)&lcd);
-    sched.items[SCHED_LCD].clock = emulate_cx ? CLOCK_12M : CLOCK_27M;
-    sched.items[SCHED_LCD].second = -1;
-    sched.items[SCHED_LCD].proc = lcd_event;
+    sched_init_item(SCHED_LCD, emulate_cx ? CLOCK_12M : CLOCK_27M, lcd_event, false);
 }
 
 uint32_t lcd_read_word(uint32_t addr) {
@@ -19,6 +19,7 @@
 #include "mem.h"
 #include "debug.h"
 #include "translate.h"
+#include "cpu.h"
 #include "usb_cx2.h"
 #include "cx2.h"
 
@@ -29,16 +30,21 @@ void (*write_byte_map[64])(uint32_t addr, uint8_t value);
 void (*write_half_map[64])(uint32_t addr, uint16_t value);
 void (*write_word_map[64])(uint32_t addr, uint32_t value);
 
+struct mem_stats mem_stats;
+
 /* For invalid/unknown physical addresses */
-uint8_t bad_read_byte(uint32_t addr)               { warn("Bad read_byte: %08x", addr); return 0; }
-uint16_t bad_read_half(uint32_t addr)              { warn("Bad read_half: %08x", addr); return 0; }
-uint32_t bad_read_word(uint32_t addr)              { warn("Bad read_word: %08x", addr); return 0; }
-void bad_write_byte(uint32_t addr, uint8_t value)  { warn("Bad write_byte: %08x %02x", addr, value); }
-void bad_write_half(uint32_t addr, uint16_t value) { warn("Bad write_half: %08x %04x", addr, value); }
-void bad_write_word(uint32_t addr, uint32_t value) { warn("Bad write_word: %08x %08x", addr, value); }
+uint8_t bad_read_byte(uint32_t addr)               { mem_stats.bad_reads++; warn("Bad read_byte: %08x", addr); return 0; }
+uint16_t bad_read_half(uint32_t addr)              { mem_stats.bad_reads++; warn("Bad read_half: %08x", addr); return 0; }
+uint32_t bad_read_word(uint32_t addr)              { mem_stats.bad_reads++; warn("Bad read_word: %08x", addr); return 0; }
+void bad_write_byte(uint32_t addr, uint8_t value)  { mem_stats.bad_writes++; warn("Bad write_byte: %08x %02x", addr, value); }
+void bad_write_half(uint32_t addr, uint16_t value) { mem_stats.bad_writes++; warn("Bad write_half: %08x %04x", addr, value); }
+void bad_write_word(uint32_t addr, uint32_t value) { mem_stats.bad_writes++; warn("Bad write_word: %08x %08x", addr, value); }
 
 uint8_t *mem_and_flags = NULL;
+// Set while the SDRAM is still untouched from os_reserve, see memory_clear_sdram
+static bool sdram_untouched;
 struct mem_area_desc mem_areas[5];
+uint8_t ram_page_flags[MEM_MAXSIZE / RAM_PAGE_SIZE];
 
 void *phys_mem_ptr(uint32_t addr, uint32_t size) {
     unsigned int i;
@@ -61,6 +67,7 @@ uint32_t phys_mem_addr(void *ptr) {
 }
 
 SYSVABI void read_action(void *ptr) {
+    mem_stats.read_actions++;
     uint32_t addr = phys_mem_addr(ptr);
     if (!gdb_connected)
         emuprintf("Hit read breakpoint at %08x. Entering debugger.\n", addr);
@@ -68,6 +75,7 @@ SYSVABI void read_action(void *ptr) {
 }
 
 SYSVABI void write_action(void *ptr) {
+    mem_stats.write_actions++;
     uint32_t addr = phys_mem_addr(ptr);
     uint32_t *flags = &RAM_FLAGS((size_t)ptr & ~3);
     if (*flags & RF_WRITE_BREAKPOINT) {
@@ -86,6 +94,221 @@ SYSVABI void write_action(void *ptr) {
 #endif
 }
 
+void memory_mark_pages(const void *start, const void *end, uint8_t page_flags) {
+    if (start >= end)
+        return;
+
+    size_t first = ((const uint8_t *)start - mem_and_flags) / RAM_PAGE_SIZE,
+           last = ((const uint8_t *)end - 1 - mem_and_flags) / RAM_PAGE_SIZE;
+    for (size_t i = first; i <= last; i++)
+        ram_page_flags[i] |= page_flags;
+}
+
+static enum { WP_OFF, WP_ACTIVE, WP_UNAVAILABLE } wp_state = WP_OFF;
+
+#define RPF_PROTECTED (RPF_WRITE_PROTECTED | RPF_WRITE_TRACKED)
+
+/* Pages written to since memory_handle_writes, one byte per RAM page. Only
+ * accessed atomically, as write_fault may run on another thread. */
+static uint8_t written_pages[MEM_MAXSIZE / RAM_PAGE_SIZE];
+static bool writes_pending;
+
+#ifndef NO_TRANSLATION
+/* The first write to translated code done by translated code since then,
+ * as translation index << 32 | arm.reg[15], for the check in
+ * memory_handle_writes */
+#define NO_CODE_WRITE UINT64_MAX
+static uint64_t code_write = NO_CODE_WRITE;
+#endif
+
+/* Called by the OS layer on a write to a protected page, possibly from a
+ * different thread or a signal handler. The page gets unprotected afterwards.
+ * So that this is async-signal-safe, it only notes the write. */
+static void write_fault(void *addr) {
+    size_t page_size = os_page_size();
+    size_t offset = ((uint8_t *)addr - mem_and_flags) & ~(page_size - 1);
+    size_t first = offset / RAM_PAGE_SIZE, last = (offset + page_size) / RAM_PAGE_SIZE;
+    for (size_t i = first; i < last; i++)
+        __atomic_store_n(&written_pages[i], 1, __ATOMIC_RELAXED);
+
+#ifndef NO_TRANSLATION
+    /* If the emulation thread did the write, it's stopped while this runs.
+     * In translated code, arm.reg[15] is where it entered the translation. */
+    uint32_t flags = RAM_FLAGS((uintptr_t)addr & ~3);
+    if ((flags & RF_CODE_TRANSLATED) && translation_active()) {
+        uint64_t expected = NO_CODE_WRITE;
+        uint64_t write = (uint64_t)(flags >> RFS_TRANSLATION_INDEX) << 32 | arm.reg[15];
+        __atomic_compare_exchange_n(&code_write, &expected, write, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+#endif
+
+    __atomic_store_n(&writes_pending, true, __ATOMIC_RELEASE);
+    cpu_events_set(EVENT_WRITE_FAULT);
+}
+
+// Does the part of memory_handle_writes which can't fail
+static void apply_writes() {
+    if (!__atomic_load_n(&writes_pending, __ATOMIC_ACQUIRE))
+        return;
+
+    // In this order, so that a write in between sets both again
+    cpu_events_clear(EVENT_WRITE_FAULT);
+    __atomic_store_n(&writes_pending, false, __ATOMIC_SEQ_CST);
+
+    for (size_t i = 0; i < sizeof(written_pages); i++) {
+        if (!__atomic_load_n(&written_pages[i], __ATOMIC_RELAXED)
+            || !__atomic_exchange_n(&written_pages[i], 0, __ATOMIC_RELAXED))
+            continue;
+
+#ifndef NO_TRANSLATION
+        if (ram_page_flags[i] & RPF_WRITE_PROTECTED)
+            invalidate_page_translations(i);
+#endif
+        ram_page_flags[i] &= ~(RPF_PROTECTED | RPF_CLEAN);
+    }
+}
+
+void memory_handle_writes() {
+#ifndef NO_TRANSLATION
+    // Which translation the emulation thread executed when it modified that one
+    int executing = -1;
+    uint64_t write = __atomic_exchange_n(&code_write, NO_CODE_WRITE, __ATOMIC_RELAXED);
+    if (write != NO_CODE_WRITE) {
+        void *ptr = try_ptr((uint32_t)write);
+        if (ptr && (RAM_FLAGS(ptr) & RF_CODE_TRANSLATED))
+            executing = RAM_FLAGS(ptr) >> RFS_TRANSLATION_INDEX;
+    }
+#endif
+
+    apply_writes();
+
+#ifndef NO_TRANSLATION
+    /* Like write_action would have done. It's only noticed after the fact,
+     * the rest of the translation ran with the old code. */
+    if (executing != -1 && executing == (int)(write >> 32))
+        error("Cannot modify currently executing code block.");
+#endif
+}
+
+// Unprotects pages which have no reason to be protected without page_flags
+static bool should_unprotect(size_t i, uint8_t page_flags) {
+    return (ram_page_flags[i] & page_flags & RPF_PROTECTED)
+            && !(ram_page_flags[i] & ~page_flags & RPF_PROTECTED);
+}
+
+static void unprotect_pages(uint8_t page_flags) {
+    size_t count = sizeof(ram_page_flags);
+    for (size_t i = 0; i < count; i++) {
+        if (!should_unprotect(i, page_flags))
+            continue;
+
+        size_t end = i;
+        while (end < count && should_unprotect(end, page_flags))
+            end++;
+
+        os_write_protect(mem_and_flags + i * RAM_PAGE_SIZE, (end - i) * RAM_PAGE_SIZE, false);
+        // Writes aren't noticed anymore
+        for (size_t j = i; j < end; j++)
+            ram_page_flags[j] &= ~RPF_CLEAN;
+        i = end;
+    }
+}
+
+void memory_clear_page_flags(uint8_t page_flags) {
+    apply_writes();
+
+    if ((page_flags & RPF_PROTECTED) && wp_state == WP_ACTIVE)
+        unprotect_pages(page_flags);
+
+    for (size_t i = 0; i < sizeof(ram_page_flags); i++)
+        ram_page_flags[i] &= ~page_flags;
+}
+
+/* Sets all word flags to zero and gives their backing memory back to the OS */
+void memory_discard_flags() {
+    os_discard(mem_and_flags + MEM_MAXSIZE, MEM_MAXSIZE);
+    memory_clear_page_flags(0xFF);
+}
+
+void memory_unprotect_all() {
+    memory_clear_page_flags(RPF_PROTECTED | RPF_CLEAN);
+    if (wp_state == WP_ACTIVE)
+        os_write_protect_deinit();
+    wp_state = WP_OFF;
+}
+
+static bool wp_init(const char *what) {
+    if (wp_state == WP_OFF) {
+        wp_state = os_write_protect_init(mem_and_flags, MEM_MAXSIZE, write_fault) ? WP_ACTIVE : WP_UNAVAILABLE;
+        if (wp_state == WP_UNAVAILABLE)
+            emuprintf("Can't write protect memory, %s.\n", what);
+    }
+
+    return wp_state == WP_ACTIVE;
+}
+
+void memory_protect_code(const void *start, const void *end) {
+    if (start >= end)
+        return;
+
+    if (!wp_init("writes to translated code are not detected"))
+        return;
+
+    apply_writes();
+
+    size_t page_size = os_page_size();
+    size_t first = ((const uint8_t *)start - mem_and_flags) & ~(page_size - 1),
+           last = ((const uint8_t *)end - mem_and_flags + page_size - 1) & ~(page_size - 1);
+
+    // Most translations are in already protected pages
+    size_t i;
+    for (i = first / RAM_PAGE_SIZE; i < last / RAM_PAGE_SIZE; i++) {
+        if (!(ram_page_flags[i] & RPF_WRITE_PROTECTED))
+            break;
+    }
+    if (i == last / RAM_PAGE_SIZE)
+        return;
+
+    if (os_write_protect(mem_and_flags + first, last - first, true))
+        memory_mark_pages(mem_and_flags + first, mem_and_flags + last, RPF_WRITE_PROTECTED);
+}
+
+bool memory_track_writes(const void *start, const void *end, uint8_t clean_flag) {
+    if (start >= end || !wp_init("all pages count as written"))
+        return false;
+
+    apply_writes();
+
+    size_t page_size = os_page_size();
+    size_t first = ((const uint8_t *)start - mem_and_flags) & ~(page_size - 1),
+           last = ((const uint8_t *)end - mem_and_flags + page_size - 1) & ~(page_size - 1);
+
+    for (size_t i = first; i < last; i += page_size) {
+        if (ram_page_flags[i / RAM_PAGE_SIZE] & RPF_WRITE_TRACKED)
+            continue;
+
+        size_t run = i;
+        while (run < last && !(ram_page_flags[run / RAM_PAGE_SIZE] & RPF_WRITE_TRACKED)) {
+            /* Write protection of pages which were never written to doesn't
+             * necessarily catch the first write, so populate them first. */
+            volatile uint8_t *p = mem_and_flags + run;
+            if (!(ram_page_flags[run / RAM_PAGE_SIZE] & RPF_WRITE_PROTECTED))
+                *p = *p;
+            run += page_size;
+        }
+
+        if (!os_write_protect(mem_and_flags + i, run - i, true))
+            return false;
+
+        memory_mark_pages(mem_and_flags + i, mem_and_flags + run, RPF_WRITE_TRACKED);
+        i = run;
+    }
+
+    // All pages in the range are protected now
+    memory_mark_pages(mem_and_flags + first, mem_and_flags + last, clean_flag);
+    return true;
+}
+
 /* 00000000, 10000000, A4000000: ROM and RAM */
 uint8_t memory_read_byte(uint32_t addr) {
     uint8_t *ptr = phys_mem_ptr(addr, 1);
@@ -105,28 +328,28 @@ uint32_t memory_read_word(uint32_t addr) {
     if (RAM_FLAGS(ptr) & DO_READ_ACTION) read_action(ptr);
     return *ptr;
 }
+// For pages with RPF_WRITE_SLOW. Returns false if the write goes to bad_write_*
+static bool write_slow(void *ptr) {
+    if (RAM_PAGE_FLAGS(ptr) & RPF_READ_ONLY) return false;
+    if (RAM_FLAGS((size_t)ptr & ~3) & DO_WRITE_ACTION) write_action(ptr);
+    return true;
+}
 void memory_write_byte(uint32_t addr, uint8_t value) {
     uint8_t *ptr = phys_mem_ptr(addr, 1);
     if (!ptr) { bad_write_byte(addr, value); return; }
-    uint32_t flags = RAM_FLAGS((size_t)ptr & ~3);
-    if (flags & RF_READ_ONLY) { bad_write_byte(addr, value); return; }
-    if (flags & DO_WRITE_ACTION) write_action(ptr);
+    if ((RAM_PAGE_FLAGS(ptr) & RPF_WRITE_SLOW) && !write_slow(ptr)) { bad_write_byte(addr, value); return; }
     *ptr = value;
 }
 void memory_write_half(uint32_t addr, uint16_t value) {
     uint16_t *ptr = phys_mem_ptr(addr, 2);
     if (!ptr) { bad_write_half(addr, value); return; }
-    uint32_t flags = RAM_FLAGS((size_t)ptr & ~3);
-    if (flags & RF_READ_ONLY) { bad_write_half(addr, value); return; }
-    if (flags & DO_WRITE_ACTION) write_action(ptr);
+    if ((RAM_PAGE_FLAGS(ptr) & RPF_WRITE_SLOW) && !write_slow(ptr)) { bad_write_half(addr, value); return; }
     *ptr = value;
 }
 void memory_write_word(uint32_t addr, uint32_t value) {
     uint32_t *ptr = phys_mem_ptr(addr, 4);
     if (!ptr) { bad_write_word(addr, value); return; }
-    uint32_t flags = RAM_FLAGS(ptr);
-    if (flags & RF_READ_ONLY) { bad_write_word(addr, value); return; }
-    if (flags & DO_WRITE_ACTION) write_action(ptr);
+    if ((RAM_PAGE_FLAGS(ptr) & RPF_WRITE_SLOW) && !write_slow(ptr)) { bad_write_word(addr, value); return; }
     *ptr = value;
 }
 
@@ -168,24 +391,92 @@ void apb_write_word(uint32_t addr, uint32_t value) {
 }
 
 uint32_t FASTCALL mmio_read_byte(uint32_t addr) {
+    mem_stats.mmio_reads[addr >> 26]++;
     return read_byte_map[addr >> 26](addr);
 }
 uint32_t FASTCALL mmio_read_half(uint32_t addr) {
+    mem_stats.mmio_reads[addr >> 26]++;
     return read_half_map[addr >> 26](addr);
 }
 uint32_t FASTCALL mmio_read_word(uint32_t addr) {
+    mem_stats.mmio_reads[addr >> 26]++;
     return read_word_map[addr >> 26](addr);
 }
 void FASTCALL mmio_write_byte(uint32_t addr, uint32_t value) {
+    mem_stats.mmio_writes[addr >> 26]++;
     write_byte_map[addr >> 26](addr, value);
 }
 void FASTCALL mmio_write_half(uint32_t addr, uint32_t value) {
+    mem_stats.mmio_writes[addr >> 26]++;
     write_half_map[addr >> 26](addr, value);
 }
 void FASTCALL mmio_write_word(uint32_t addr, uint32_t value) {
+    mem_stats.mmio_writes[addr >> 26]++;
     write_word_map[addr >> 26](addr, value);
 }
 
+#define MEM_STATS_SCALARS(X) \
+    X(ac_hits_read, ac_hits[0]) X(ac_hits_write, ac_hits[1]) \
+    X(ac_misses_read, ac_misses[0]) X(ac_misses_write, ac_misses[1]) \
+    X(mmu_walks, mmu_walks) X(read_actions, read_actions) X(write_actions, write_actions) \
+    X(bad_reads, bad_reads) X(bad_writes, bad_writes)
+
+static void mem_stats_json_object(FILE *f, const struct mem_stats *prev, double div, int precision) {
+    static const struct mem_stats zero;
+    if (!prev)
+        prev = &zero;
+
+    #define X(name, field) fprintf(f, "\"" #name "\":%.*f,", precision, (mem_stats.field - prev->field) / div);
+    fputc('{', f);
+    MEM_STATS_SCALARS(X)
+    #undef X
+
+    for (int write = 0; write < 2; write++) {
+        const uint64_t *cur = write ? mem_stats.mmio_writes : mem_stats.mmio_reads,
+                       *old = write ? prev->mmio_writes : prev->mmio_reads;
+        const char *sep = "";
+        fprintf(f, write ? ",\"mmio_writes\":{" : "\"mmio_reads\":{");
+        for (int slot = 0; slot < 64; slot++) {
+            if (cur[slot] == old[slot])
+                continue;
+            fprintf(f, "%s\"%08x\":%.*f", sep, slot << 26, precision, (cur[slot] - old[slot]) / div);
+            sep = ",";
+        }
+        fputc('}', f);
+    }
+    fputc('}', f);
+}
+
+void mem_stats_write_json(FILE *f, const struct mem_stats *prev, double seconds) {
+    fprintf(f, "{\"seconds\":%.3f,\"total\":", seconds);
+    mem_stats_json_object(f, NULL, 1, 0);
+    if (seconds > 0) {
+        fprintf(f, ",\"per_second\":");
+        mem_stats_json_object(f, prev, seconds, 1);
+    }
+    fprintf(f, "}\n");
+    fflush(f);
+}
+
+void mem_stats_print(const struct mem_stats *prev, double seconds) {
+    static const struct mem_stats zero;
+    if (!prev)
+        prev = &zero;
+    if (seconds <= 0)
+        seconds = 1;
+
+    gui_debug_printf("%-16s %14s %12s\n", "counter", "total", "per second");
+    #define X(name, field) gui_debug_printf("%-16s %14llu %12.1f\n", #name, (unsigned long long) mem_stats.field, (mem_stats.field - prev->field) / seconds);
+    MEM_STATS_SCALARS(X)
+    #undef X
+    for (int slot = 0; slot < 64; slot++) {
+        if (mem_stats.mmio_reads[slot])
+            gui_debug_printf("mmio rd %08x %14llu %12.1f\n", slot << 26, (unsigned long long) mem_stats.mmio_reads[slot], (mem_stats.mmio_reads[slot] - prev->mmio_reads[slot]) / seconds);
+        if (mem_stats.mmio_writes[slot])
+            gui_debug_printf("mmio wr %08x %14llu %12.1f\n", slot << 26, (unsigned long long) mem_stats.mmio_writes[slot], (mem_stats.mmio_writes[slot] - prev->mmio_writes[slot]) / seconds);
+    }
+}
+
 uint8_t null_read_byte(uint32_t addr) {
     (void) addr;
     return 0;
@@ -278,6 +569,7 @@ bool memory_initialize(uint32_t sdram_size)
     }
 
     assert (total_mem <= MEM_MAXSIZE);
+    sdram_untouched = true;
 
     current_product = product;
 
@@ -491,6 +783,14 @@ bool memory_initialize(uint32_t sdram_size)
     return true;
 }
 
+void memory_clear_sdram()
+{
+    // Zero already, and touching all pages takes a while
+    if (!sdram_untouched)
+        memset(mem_areas[1].ptr, 0, mem_areas[1].size);
+    sdram_untouched = false;
+}
+
 void memory_reset()
 {
     for(unsigned int i = 0; i < reset_proc_count; i++)
@@ -503,6 +803,10 @@ void memory_deinitialize()
     {
         // translation_table uses absolute addresses
         flush_translations();
+        memory_clear_page_flags(0xFF);
+        if (wp_state == WP_ACTIVE)
+            os_write_protect_deinit();
+        wp_state = WP_OFF;
         memset(mem_areas, 0, sizeof(mem_areas));
         os_free(mem_and_flags, MEM_MAXSIZE * 2);
         mem_and_flags = NULL;
@@ -511,17 +815,180 @@ void memory_deinitialize()
     reset_proc_count = 0;
 }
 
+/* Memory areas are saved at their real size, in chunks of RAM_PAGE_SIZE.
+ * A bitmap in front tells which chunks follow, the others are all zero.
+ * In deltas, the others are unchanged since the parent snapshot instead.
+ * For mappable snapshots, areas are saved completely and aligned, so that
+ * resuming can map them. The boot ROM and its mirrors aren't saved,
+ * emu_start loads it again. */
+enum snapshot_area_mode { AREA_SPARSE, AREA_MAPPED, AREA_DELTA };
+
+struct snapshot_area {
+    uint32_t base, size;
+    uint32_t mode;
+};
+
+#define SNAPSHOT_CHUNKS_MAX (MEM_MAXSIZE / RAM_PAGE_SIZE)
+
+static bool memory_area_saved(unsigned int i)
+{
+    if (i == 0 || !mem_areas[i].size)
+        return false;
+
+    for (unsigned int j = 0; j < i; j++) {
+        if (mem_areas[j].size && mem_areas[j].ptr == mem_areas[i].ptr)
+            return false; // Mirror
+    }
+
+    return true;
+}
+
+static bool chunk_is_zero(const uint8_t *data, size_t size)
+{
+    return data[0] == 0 && memcmp(data, data + 1, size - 1) == 0;
+}
+
+static bool chunk_saved(const uint8_t *bitmap, uint32_t chunk)
+{
+    return bitmap[chunk / 8] & (1 << (chunk % 8));
+}
+
+// Size of the run of chunks starting at chunk which are all saved or all not
+static uint32_t chunk_run(const struct mem_area_desc *area, const uint8_t *bitmap, uint32_t chunk, uint32_t *end)
+{
+    uint32_t chunks = (area->size + RAM_PAGE_SIZE - 1) / RAM_PAGE_SIZE;
+    bool saved = chunk_saved(bitmap, chunk);
+    *end = chunk + 1;
+    while (*end < chunks && chunk_saved(bitmap, *end) == saved)
+        ++*end;
+
+    uint32_t last = *end * RAM_PAGE_SIZE;
+    return (last < area->size ? last : area->size) - chunk * RAM_PAGE_SIZE;
+}
+
+static bool memory_suspend_area(emu_snapshot *snapshot, const struct mem_area_desc *area)
+{
+    struct snapshot_area header = { area->base, area->size, AREA_SPARSE };
+    uint32_t chunks = (area->size + RAM_PAGE_SIZE - 1) / RAM_PAGE_SIZE;
+    uint8_t bitmap[SNAPSHOT_CHUNKS_MAX / 8] = {0};
+
+    if (snapshot->buffer->delta)
+        header.mode = AREA_DELTA;
+    else if (snapshot->buffer->mappable)
+        header.mode = AREA_MAPPED;
+
+    if (header.mode == AREA_MAPPED)
+        return snapshot_write(snapshot, &header, sizeof(header))
+               && snapshot_write_align(snapshot)
+               && snapshot_write(snapshot, area->ptr, area->size);
+
+    for (uint32_t chunk = 0; chunk < chunks; chunk++) {
+        uint32_t offset = chunk * RAM_PAGE_SIZE;
+        uint32_t size = area->size - offset < RAM_PAGE_SIZE ? area->size - offset : RAM_PAGE_SIZE;
+        bool saved = header.mode == AREA_DELTA ? !(RAM_PAGE_FLAGS(area->ptr + offset) & RPF_CLEAN_SNAPSHOT)
+                                               : !chunk_is_zero(area->ptr + offset, size);
+        if (saved)
+            bitmap[chunk / 8] |= 1 << (chunk % 8);
+    }
+
+    if (!snapshot_write(snapshot, &header, sizeof(header))
+        || !snapshot_write(snapshot, bitmap, (chunks + 7) / 8))
+        return false;
+
+    for (uint32_t chunk = 0, end; chunk < chunks; chunk = end) {
+        uint32_t size = chunk_run(area, bitmap, chunk, &end);
+        if (chunk_saved(bitmap, chunk) && !snapshot_write(snapshot, area->ptr + chunk * RAM_PAGE_SIZE, size))
+            return false;
+    }
+
+    return true;
+}
+
+/* Zeroes memory of an area. memset would commit every page of it, so whole
+ * pages are given back to the OS instead and only the edges get cleared. */
+static void memory_zero(uint8_t *data, size_t size)
+{
+    uintptr_t page_mask = os_page_size() - 1;
+    uint8_t *first = (uint8_t *)(((uintptr_t)data + page_mask) & ~page_mask),
+            *last = (uint8_t *)(((uintptr_t)data + size) & ~page_mask);
+    if (last <= first) {
+        memset(data, 0, size);
+        return;
+    }
+
+    memset(data, 0, first - data);
+    os_discard(first, last - first);
+    memset(last, 0, data + size - last);
+}
+
+static bool memory_resume_area(const emu_snapshot *snapshot, const struct mem_area_desc *area)
+{
+    struct snapshot_area header;
+    uint32_t chunks = (area->size + RAM_PAGE_SIZE - 1) / RAM_PAGE_SIZE;
+    uint8_t bitmap[SNAPSHOT_CHUNKS_MAX / 8];
+
+    if (!snapshot_read(snapshot, &header, sizeof(header))
+        || header.base != area->base || header.size != area->size)
+        return false;
+
+    if (header.mode == AREA_MAPPED)
+        return snapshot_read_align(snapshot) && snapshot_read_map(snapshot, area->ptr, area->size);
+    if (header.mode != AREA_SPARSE && header.mode != AREA_DELTA)
+        return false;
+
+    if (!snapshot_read(snapshot, bitmap, (chunks + 7) / 8))
+        return false;
+
+    for (uint32_t chunk = 0, end; chunk < chunks; chunk = end) {
+        uint8_t *data = area->ptr + chunk * RAM_PAGE_SIZE;
+        uint32_t size = chunk_run(area, bitmap, chunk, &end);
+        if (!chunk_saved(bitmap, chunk)) {
+            // Deltas keep what the parent snapshot left there
+            if (header.mode == AREA_SPARSE)
+                memory_zero(data, size);
+        } else if (!snapshot_read(snapshot, data, size))
+            return false;
+    }
+
+    return true;
+}
+
+bool memory_track_snapshot()
+{
+    for (unsigned int i = 0; i < sizeof(mem_areas) / sizeof(*mem_areas); i++) {
+        const struct mem_area_desc *area = &mem_areas[i];
+        if (memory_area_saved(i) && !memory_track_writes(area->ptr, area->ptr + area->size, RPF_CLEAN_SNAPSHOT))
+            return false;
+    }
+
+    return true;
+}
+
 bool memory_suspend(emu_snapshot *snapshot)
 {
     assert(mem_and_flags);
 
     uint32_t sdram_size = mem_areas[1].size;
 
+    // TODO: No flags saved. Only RF_EXEC_BREAKPOINT and maybe RPF_READ_ONLY are interesting.
+    if (!snapshot_write(snapshot, &sdram_size, sizeof(sdram_size)))
+        return false;
+
+    // Delta snapshots look at RPF_CLEAN_SNAPSHOT
+    apply_writes();
+
+    for (unsigned int i = 0; i < sizeof(mem_areas) / sizeof(*mem_areas); i++) {
+        if (memory_area_saved(i) && !memory_suspend_area(snapshot, &mem_areas[i]))
+            return false;
+    }
+
+    return true;
+}
+
+bool memory_suspend_peripherals(emu_snapshot *snapshot)
+{
     // TODO: CAS+ and ti84_io?
-    return snapshot_write(snapshot, &sdram_size, sizeof(sdram_size))
-            // TODO: No flags saved. Only RF_EXEC_BREAKPOINT and maybe RF_READ_ONLY are interesting.
-            && snapshot_write(snapshot, mem_and_flags, MEM_MAXSIZE)
-            && misc_suspend(snapshot)
+    return misc_suspend(snapshot)
             && keypad_suspend(snapshot)
             && usb_suspend(snapshot)
             && lcd_suspend(snapshot)
@@ -538,12 +1005,28 @@ bool memory_resume(const emu_snapshot *snapshot)
 {
     uint32_t sdram_size = mem_areas[1].size;
 
-    return snapshot_read(snapshot, &sdram_size, sizeof(sdram_size))
-            && memory_initialize(sdram_size)
-            && (memory_reset(), true) // To have peripherals register with sched
-            && snapshot_read(snapshot, mem_and_flags, MEM_MAXSIZE)
-            && memset(mem_and_flags + MEM_MAXSIZE, 0, MEM_MAXSIZE) // Set all flags to 0
-            && misc_resume(snapshot)
+    if (!snapshot_read(snapshot, &sdram_size, sizeof(sdram_size))
+        || !memory_initialize(sdram_size))
+        return false;
+
+    memory_reset(); // To have peripherals register with sched
+    sdram_untouched = false;
+
+    // Mapped pages aren't covered by the write protection set up before
+    memory_unprotect_all();
+
+    for (unsigned int i = 0; i < sizeof(mem_areas) / sizeof(*mem_areas); i++) {
+        if (memory_area_saved(i) && !memory_resume_area(snapshot, &mem_areas[i]))
+            return false;
+    }
+
+    memory_discard_flags();
+    return true;
+}
+
+bool memory_resume_peripherals(const emu_snapshot *snapshot)
+{
+    return misc_resume(snapshot)
             && keypad_resume(snapshot)
             && usb_resume(snapshot)
             && lcd_resume(snapshot)
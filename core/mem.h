@@ -4,6 +4,7 @@
 #define _H_MEM
 
 #include <stdint.h>
+#include <stdio.h>
 
 #include "cpu.h"
 
@@ -38,7 +39,6 @@ uint32_t phys_mem_addr(void *ptr);
 #define RF_CODE_EXECUTED     16
 #define RF_CODE_TRANSLATED   32
 #define RF_CODE_NO_TRANSLATE 64
-#define RF_READ_ONLY         128
 #define RF_ARMLOADER_CB      256
 #define RFS_TRANSLATION_INDEX 9
 
@@ -46,6 +46,62 @@ uint32_t phys_mem_addr(void *ptr);
 #define DO_WRITE_ACTION (RF_WRITE_BREAKPOINT | RF_CODE_TRANSLATED | RF_CODE_NO_TRANSLATE | RF_CODE_EXECUTED)
 #define DONT_TRANSLATE (RF_EXEC_BREAKPOINT | RF_EXEC_DEBUG_NEXT | RF_CODE_TRANSLATED | RF_CODE_NO_TRANSLATE)
 
+/* Most of the flag words are zero. The flags half of mem_and_flags is only
+ * backed by host memory where flags were actually written (the OS maps
+ * untouched pages to the zero page), so the fast paths above can still test
+ * RAM_FLAGS directly. Code which has to look at flags of whole regions uses
+ * the per-page summary instead, which is one byte per 4KiB of memory.
+ * RPF_BREAKPOINT, RPF_TRANSLATED and RPF_CODE mean "may have", they are only cleared
+ * when the corresponding word flags are cleared in bulk. */
+#define RAM_PAGE_SIZE 0x1000
+extern uint8_t ram_page_flags[MEM_MAXSIZE / RAM_PAGE_SIZE];
+#define RAM_PAGE_FLAGS(memptr) (ram_page_flags[((uint8_t *)(memptr) - mem_and_flags) / RAM_PAGE_SIZE])
+
+#define RPF_BREAKPOINT 1 // RF_*_BREAKPOINT, RF_EXEC_DEBUG_NEXT or RF_ARMLOADER_CB
+#define RPF_TRANSLATED 2 // RF_CODE_TRANSLATED
+#define RPF_READ_ONLY  4 // Writes go to bad_write_*
+#define RPF_WRITE_PROTECTED 8 // Host page write protected by memory_protect_code
+#define RPF_WRITE_TRACKED 16 // Host page write protected by memory_track_writes
+// Not written since the last memory_track_writes with that flag
+#define RPF_CLEAN_REWIND   32
+#define RPF_CLEAN_SNAPSHOT 64
+#define RPF_CLEAN (RPF_CLEAN_REWIND | RPF_CLEAN_SNAPSHOT)
+#define RPF_CODE 128 // RF_CODE_EXECUTED or RF_CODE_NO_TRANSLATE
+
+/* Writes through memory_write_* only test this mask in the page flags and
+ * look at the word flags only if any is set. Tracked pages are slow until
+ * their first write, which clears RPF_WRITE_TRACKED and RPF_CLEAN. */
+#define RPF_WRITE_SLOW (RPF_BREAKPOINT | RPF_TRANSLATED | RPF_READ_ONLY | RPF_CODE | RPF_WRITE_TRACKED | RPF_CLEAN)
+
+void memory_mark_pages(const void *start, const void *end, uint8_t page_flags);
+/* Clearing RPF_WRITE_PROTECTED or RPF_WRITE_TRACKED also removes the
+ * protection, pages which aren't protected anymore lose RPF_CLEAN */
+void memory_clear_page_flags(uint8_t page_flags);
+void memory_discard_flags();
+/* For JITs which don't call write_action in their store path: write protects
+ * the host pages containing [start, end), so that writes to them invalidate
+ * the translations inside, like write_action would, but only once
+ * memory_handle_writes runs. The JIT leaves translated code at the next jump
+ * for that. Stores to other pages don't need any checks then. Does nothing
+ * if the host can't do that. */
+void memory_protect_code(const void *start, const void *end);
+/* Write protects the host pages containing [start, end) and sets
+ * RPF_WRITE_TRACKED and clean_flag (one of RPF_CLEAN) on them. The first
+ * write to such a page clears all RPF_CLEAN flags again, so pages without
+ * clean_flag were (possibly) written to since. Each user of this has its own
+ * flag, so that starting over doesn't hide writes from the others. Returns
+ * false if the host can't do that. */
+bool memory_track_writes(const void *start, const void *end, uint8_t clean_flag);
+/* Writes to protected pages only get noted when they happen, which sets
+ * EVENT_WRITE_FAULT. This does the rest on the emulation thread: it clears
+ * RPF_WRITE_TRACKED and RPF_CLEAN on the written pages and invalidates the
+ * translations inside. Check RPF_CLEAN only after calling this. */
+void memory_handle_writes();
+/* Removes all write protection and stops handling faults, for instance
+ * before memory gets replaced. Translations have to be flushed as well.
+ * The next user of write protection starts it again. */
+void memory_unprotect_all();
+
 uint8_t bad_read_byte(uint32_t addr);
 uint16_t bad_read_half(uint32_t addr);
 uint32_t bad_read_word(uint32_t addr);
@@ -63,11 +119,37 @@ void FASTCALL mmio_write_byte(uint32_t addr, uint32_t value) __asm__("mmio_write
 void FASTCALL mmio_write_half(uint32_t addr, uint32_t value) __asm__("mmio_write_half");
 void FASTCALL mmio_write_word(uint32_t addr, uint32_t value) __asm__("mmio_write_word");
 
+/* Access counters, always on. The JIT and the assembly fast paths aren't
+ * instrumented, so ac_hits only counts accesses done through asmcode.c. */
+struct mem_stats {
+    uint64_t ac_hits[2], ac_misses[2]; // Indexed by writing
+    uint64_t mmu_walks;
+    uint64_t mmio_reads[64], mmio_writes[64]; // Indexed by device slot (addr >> 26)
+    uint64_t read_actions, write_actions;
+    uint64_t bad_reads, bad_writes;
+};
+extern struct mem_stats mem_stats;
+/* Writes mem_stats as single line JSON object with the totals and, if
+ * seconds > 0, the rates per second since prev (or since the start if NULL). */
+void mem_stats_write_json(FILE *f, const struct mem_stats *prev, double seconds);
+/* Same for the debugger */
+void mem_stats_print(const struct mem_stats *prev, double seconds);
+
 bool memory_initialize(uint32_t sdram_size);
+// Zeroes the SDRAM, for a reset
+void memory_clear_sdram();
 void memory_reset();
 typedef struct emu_snapshot emu_snapshot;
+/* Tracks writes to the memory saved by memory_suspend with
+ * RPF_CLEAN_SNAPSHOT, for delta snapshots */
+bool memory_track_snapshot();
+/* The memory areas. memory_resume resets the peripherals, which have their
+ * own sections in snapshot files, see emu.cpp. */
 bool memory_suspend(emu_snapshot *snapshot);
 bool memory_resume(const emu_snapshot *snapshot);
+/* The state of all peripherals at once, for rewind */
+bool memory_suspend_peripherals(emu_snapshot *snapshot);
+bool memory_resume_peripherals(const emu_snapshot *snapshot);
 void memory_deinitialize();
 
 #ifdef __cplusplus
@@ -8,6 +8,7 @@
 #include "keypad.h"
 #include "flash.h"
 #include "mem.h"
+#include "replay.h"
 
 // Miscellaneous hardware modules deemed too trivial to get their own files
 
@@ -159,10 +160,15 @@ void gpio_write(uint32_t addr, uint32_t value) {
 /* 90010000, 900C0000, 900D0000 */
 static timer_state timer;
 #define ADDR_TO_TP(addr) (&timer.pairs[((addr) >> 16) % 5])
+#define TIMER_MAX_TICKS 32768 // Sync at least once per second
+
+static void timer_sync();
+static void timer_schedule();
 
 uint32_t timer_read(uint32_t addr) {
     struct timerpair *tp = ADDR_TO_TP(addr);
-    cycle_count_delta = 0; // Avoid slowdown by fast-forwarding through polling loops
+    timer_sync();
+    sched_skip_to_next_tick(CLOCK_32K); // Avoid slowdown by fast-forwarding through polling loops
     switch (addr & 0x003F) {
         case 0x00: return tp->timers[0].value;
         case 0x04: return tp->timers[0].divider;
@@ -177,58 +183,152 @@ uint32_t timer_read(uint32_t addr) {
 }
 void timer_write(uint32_t addr, uint32_t value) {
     struct timerpair *tp = ADDR_TO_TP(addr);
+    timer_sync();
     switch (addr & 0x003F) {
-        case 0x00: tp->timers[0].start_value = tp->timers[0].value = value; return;
-        case 0x04: tp->timers[0].divider = value; return;
-        case 0x08: tp->timers[0].control = value & 0x1F; return;
-        case 0x0C: tp->timers[1].start_value = tp->timers[1].value = value; return;
-        case 0x10: tp->timers[1].divider = value; return;
-        case 0x14: tp->timers[1].control = value & 0x1F; return;
+        case 0x00: tp->timers[0].start_value = tp->timers[0].value = value; break;
+        case 0x04: tp->timers[0].divider = value; break;
+        case 0x08: tp->timers[0].control = value & 0x1F; break;
+        case 0x0C: tp->timers[1].start_value = tp->timers[1].value = value; break;
+        case 0x10: tp->timers[1].divider = value; break;
+        case 0x14: tp->timers[1].control = value & 0x1F; break;
         case 0x18: case 0x1C: case 0x20: case 0x24: case 0x28: case 0x2C:
-            tp->completion_value[((addr & 0x3F) - 0x18) >> 2] = value; return;
+            tp->completion_value[((addr & 0x3F) - 0x18) >> 2] = value; break;
         case 0x30: return;
+        default:
+            bad_write_word(addr, value);
+            return;
     }
-    bad_write_word(addr, value);
+    timer_schedule();
 }
 static void timer_int_check(struct timerpair *tp) {
     int_set(INT_TIMER0 + (tp - timer.pairs), tp->int_status & tp->int_mask);
 }
-void timer_advance(struct timerpair *tp, int ticks) {
+
+/* Each step, a running timer counts up or down by one. With a completion
+ * value selected (control 1-6), it goes back to start_value after reaching it,
+ * with control 0 it stops at 0 and with 7 it wraps around freely.
+ * This makes the sequence of values periodic, so it can be skipped through. */
+static uint16_t timer_dist(const struct timer *t, uint16_t from, uint16_t to) {
+    return (t->control & 8) ? to - from : from - to;
+}
+static uint16_t timer_add(const struct timer *t, uint16_t value, uint32_t steps) {
+    return (t->control & 8) ? value + steps : value - steps;
+}
+// Number of steps until the value is x for the first time, 0 if never
+static uint32_t timer_steps_to(const struct timerpair *tp, const struct timer *t, uint16_t x) {
+    int compl = t->control & 7;
+    uint32_t dx = timer_dist(t, t->value, x);
+    if (compl == 0) {
+        if (t->value == 0)
+            return x == 0 ? 1 : 0;
+        return dx != 0 && dx <= timer_dist(t, t->value, 0) ? dx : 0;
+    } else if (compl == 7) {
+        return dx ? dx : 0x10000;
+    }
+
+    uint16_t end = tp->completion_value[compl - 1];
+    uint32_t to_end = timer_dist(t, t->value, end);
+    if (dx != 0 && dx <= to_end)
+        return dx;
+    // Step to_end + 1 goes to start_value, then it cycles
+    uint32_t ds = timer_dist(t, t->start_value, x);
+    return ds <= timer_dist(t, t->start_value, end) ? to_end + 1 + ds : 0;
+}
+static uint16_t timer_value_after(const struct timerpair *tp, const struct timer *t, uint32_t steps) {
+    int compl = t->control & 7;
+    if (compl == 0) {
+        if (t->value == 0 || steps >= timer_dist(t, t->value, 0))
+            return 0;
+        return timer_add(t, t->value, steps);
+    } else if (compl == 7) {
+        return timer_add(t, t->value, steps);
+    }
+
+    uint16_t end = tp->completion_value[compl - 1];
+    uint32_t to_end = timer_dist(t, t->value, end);
+    if (steps <= to_end)
+        return timer_add(t, t->value, steps);
+    steps = (steps - to_end - 1) % (timer_dist(t, t->start_value, end) + 1u);
+    return timer_add(t, t->start_value, steps);
+}
+void timer_advance(struct timerpair *tp, uint32_t ticks) {
     struct timer *t;
     for (t = &tp->timers[0]; t != &tp->timers[2]; t++) {
-        int newticks;
         if (t->control & 0x10)
             continue;
-        for (newticks = t->ticks + ticks; newticks > t->divider; newticks -= (t->divider + 1)) {
-            int compl = t->control & 7;
-            t->ticks = 0;
-
-            if (compl == 0 && t->value == 0)
-                /* nothing */;
-            else if (compl != 0 && compl != 7 && t->value == tp->completion_value[compl - 1])
-                t->value = t->start_value;
-            else
-                t->value += (t->control & 8) ? +1 : -1;
-
-            if (t == &tp->timers[0]) {
-                for (compl = 0; compl < 6; compl++) {
-                    if (t->value == tp->completion_value[compl]) {
-                        tp->int_status |= 1 << compl;
-                        timer_int_check(tp);
-                    }
-                }
+        uint32_t newticks = t->ticks + ticks;
+        uint32_t steps = newticks / (t->divider + 1u);
+        t->ticks = newticks % (t->divider + 1u);
+        if (steps == 0)
+            continue;
+
+        if (t == &tp->timers[0]) {
+            uint8_t old_status = tp->int_status;
+            int compl;
+            for (compl = 0; compl < 6; compl++) {
+                uint32_t hit = timer_steps_to(tp, t, tp->completion_value[compl]);
+                if (hit && hit <= steps)
+                    tp->int_status |= 1 << compl;
             }
+            if (tp->int_status != old_status)
+                timer_int_check(tp);
         }
-        t->ticks = newticks;
+        t->value = timer_value_after(tp, t, steps);
     }
 }
+// Input ticks until tp raises an interrupt which isn't pending already, 0 if never
+static uint64_t timer_next_interrupt(const struct timerpair *tp) {
+    const struct timer *t = &tp->timers[0];
+    if (t->control & 0x10)
+        return 0;
+    uint32_t steps = 0;
+    int compl;
+    for (compl = 0; compl < 6; compl++) {
+        if (!(tp->int_mask & ~tp->int_status & 1 << compl))
+            continue;
+        uint32_t hit = timer_steps_to(tp, t, tp->completion_value[compl]);
+        if (hit && (!steps || hit < steps))
+            steps = hit;
+    }
+    return steps ? (uint64_t)steps * (t->divider + 1u) - t->ticks : 0;
+}
+// The first pair runs at 703 times the rate of the others
+static void timer_advance_all(uint32_t ticks) {
+    timer_advance(&timer.pairs[0], ticks * 703);
+    timer_advance(&timer.pairs[1], ticks);
+    timer_advance(&timer.pairs[2], ticks);
+}
+static uint32_t timer_next_event() {
+    uint64_t ticks = TIMER_MAX_TICKS, pair_ticks;
+    int i;
+    for (i = 0; i < 3; i++) {
+        pair_ticks = timer_next_interrupt(&timer.pairs[i]);
+        if (i == 0)
+            pair_ticks = (pair_ticks + 702) / 703;
+        if (pair_ticks && pair_ticks < ticks)
+            ticks = pair_ticks;
+    }
+    return ticks;
+}
+static void timer_sync() {
+    uint32_t remaining = event_ticks_remaining(SCHED_TIMERS);
+    uint32_t elapsed = remaining < timer.armed_ticks ? timer.armed_ticks - remaining : 0;
+    if (elapsed > timer.synced_ticks) {
+        timer_advance_all(elapsed - timer.synced_ticks);
+        timer.synced_ticks = elapsed;
+    }
+}
+// Needs timer_sync first
+static void timer_schedule() {
+    timer.armed_ticks = timer_next_event();
+    timer.synced_ticks = 0;
+    event_set(SCHED_TIMERS, timer.armed_ticks);
+}
 static void timer_event(int index) {
-    // TODO: should use seperate schedule item for each timer,
-    //       only fired on significant events
-    event_repeat(index, 1);
-    timer_advance(&timer.pairs[0], 703);
-    timer_advance(&timer.pairs[1], 1);
-    timer_advance(&timer.pairs[2], 1);
+    timer_advance_all(timer.armed_ticks - timer.synced_ticks);
+    timer.armed_ticks = timer_next_event();
+    timer.synced_ticks = 0;
+    event_repeat(index, timer.armed_ticks);
 }
 void timer_reset() {
     memset(timer.pairs, 0, sizeof timer.pairs);
@@ -237,8 +337,10 @@ void timer_reset() {
         timer.pairs[i].timers[0].control = 0x10;
         timer.pairs[i].timers[1].control = 0x10;
     }
-    sched.items[SCHED_TIMERS].clock = CLOCK_32K;
-    sched.items[SCHED_TIMERS].proc = timer_event;
+    // The event fires right after reset
+    timer.armed_ticks = 1;
+    timer.synced_ticks = 0;
+    sched_init_item(SCHED_TIMERS, CLOCK_32K, timer_event, true);
 }
 
 /* 90030000: 4KiB of some kind of memory */
@@ -288,7 +390,7 @@ static void watchdog_event(int index) {
 
     if (watchdog.control >> 1 & watchdog.interrupt) {
         warn("Resetting due to watchdog timeout");
-        cpu_events |= EVENT_RESET;
+        cpu_events_set(EVENT_RESET);
     } else {
         watchdog.interrupt = 1;
         int_set(INT_WATCHDOG, 1);
@@ -299,9 +401,7 @@ void watchdog_reset() {
     memset(&watchdog, 0, sizeof watchdog);
     watchdog.load = 0xFFFFFFFF;
     watchdog.value = 0xFFFFFFFF;
-    sched.items[SCHED_WATCHDOG].clock = CLOCK_APB;
-    sched.items[SCHED_WATCHDOG].second = -1;
-    sched.items[SCHED_WATCHDOG].proc = watchdog_event;
+    sched_init_item(SCHED_WATCHDOG, CLOCK_APB, watchdog_event, false);
 }
 uint32_t watchdog_read(uint32_t addr) {
     switch (addr & 0xFFF) {
@@ -388,7 +488,7 @@ void rtc_reset() {
 
 uint32_t rtc_read(uint32_t addr) {
     switch (addr & 0xFFFF) {
-        case 0x00: return time(NULL) - rtc.offset;
+        case 0x00: return replay_time() - rtc.offset;
         case 0x14: return 0;
         case 0xFE0: return 0x31;
         case 0xFE4: return 0x10;
@@ -400,7 +500,7 @@ uint32_t rtc_read(uint32_t addr) {
 void rtc_write(uint32_t addr, uint32_t value) {
     switch (addr & 0xFFFF) {
         case 0x04: return;
-        case 0x08: rtc.offset = time(NULL) - value; return;
+        case 0x08: rtc.offset = replay_time() - value; return;
         case 0x0C: return;
         case 0x10: return;
         case 0x1C: return;
@@ -430,6 +530,7 @@ uint32_t misc_read(uint32_t addr) {
         case 0x0C: return 0;
         case 0x10: case 0x18: case 0x20:
             if (emulate_cx) break;
+            timer_sync();
             return tp->int_status;
         case 0x14: case 0x1C: case 0x24:
             if (emulate_cx) break;
@@ -454,16 +555,20 @@ void misc_write(uint32_t addr, uint32_t value) {
     struct timerpair *tp = &timer.pairs[(addr - 0x10) >> 3 & 3];
     switch (addr & 0x0FFF) {
         case 0x04: return;
-        case 0x08: cpu_events |= EVENT_RESET; return;
+        case 0x08: cpu_events_set(EVENT_RESET); return;
         case 0x10: case 0x18: case 0x20:
             if (emulate_cx) break;
+            timer_sync();
             tp->int_status &= ~value;
             timer_int_check(tp);
+            timer_schedule();
             return;
         case 0x14: case 0x1C: case 0x24:
             if (emulate_cx) break;
+            timer_sync();
             tp->int_mask = value & 0x3F;
             timer_int_check(tp);
+            timer_schedule();
             return;
         case 0xF04: return;
     }
@@ -543,7 +648,8 @@ void pmu_write(uint32_t addr, uint32_t value) {
 
 /* 90010000, 900C0000(?), 900D0000 */
 static timer_cx_state timer_cx;
-static void timer_cx_event(int index);
+static void timer_cx_sync();
+static void timer_cx_schedule();
 
 void timer_cx_int_check(int which) {
     int_set(INT_TIMER0+which, (timer_cx.timer[which][0].interrupt & timer_cx.timer[which][0].control >> 5)
@@ -553,6 +659,7 @@ uint32_t timer_cx_read(uint32_t addr) {
     cycle_count_delta += 1000; // avoid slowdown with polling loops
     int which = (addr >> 16) % 5;
     struct cx_timer *t = &timer_cx.timer[which][addr >> 5 & 1];
+    timer_cx_sync();
     switch (addr & 0xFFFF) {
         case 0x0000: case 0x0020: return t->load;
         case 0x0004: case 0x0024: return t->value;
@@ -577,59 +684,144 @@ uint32_t timer_cx_read(uint32_t addr) {
 void timer_cx_write(uint32_t addr, uint32_t value) {
     int which = (addr >> 16) % 5;
     struct cx_timer *t = &timer_cx.timer[which][addr >> 5 & 1];
+    timer_cx_sync();
     switch (addr & 0xFFFF) {
         case 0x0000: case 0x0020: t->reload = 1; /* fallthrough */
-        case 0x0018: case 0x0038: t->load = value; return;
+        case 0x0018: case 0x0038: t->load = value; break;
         case 0x0004: case 0x0024: return;
         case 0x0008: case 0x0028:
             t->control = value;
             if(which == 0 && (value & 0x80))
                 error("Fast timer not implemented");
             timer_cx_int_check(which);
-        return;
-        case 0x000C: case 0x002C: t->interrupt = 0; timer_cx_int_check(which); return;
+            break;
+        case 0x000C: case 0x002C: t->interrupt = 0; timer_cx_int_check(which); break;
 
         case 0x0080: return; // ???
+        default:
+            bad_write_word(addr, value);
+            return;
     }
-    bad_write_word(addr, value);
+    timer_cx_schedule();
+}
+
+/* A running timer reloads on the first tick after load was written and
+ * decrements on every tick where the prescaler (1, 16 or 256) wraps. At 0,
+ * it stays there in one-shot mode, goes to load in periodic mode or wraps
+ * around otherwise. It raises the interrupt when it gets to 0. */
+static uint32_t timer_cx_mask(const struct cx_timer *t) {
+    return (t->control & 2) ? 0xFFFFFFFF : 0xFFFF;
+}
+static uint32_t timer_cx_prescale(const struct cx_timer *t) {
+    return ((1 << (t->control & 0xC)) - 1) % 256 + 1;
+}
+// Number of decrements from value until the timer gets to 0, 0 if never
+static uint64_t timer_cx_steps_to_zero(const struct cx_timer *t, uint32_t value) {
+    if (value)
+        return value;
+    if (t->control & 1)
+        return 0;
+    if (t->control & 0x40)
+        return (t->load & timer_cx_mask(t)) ? (t->load & timer_cx_mask(t)) + 1ull : 0;
+    return timer_cx_mask(t) + 1ull;
+}
+static uint32_t timer_cx_value_after(const struct cx_timer *t, uint32_t value, uint64_t steps) {
+    if (steps <= value)
+        return value - steps;
+    steps -= value;
+    if (t->control & 1)
+        return 0;
+    if (t->control & 0x40) {
+        uint32_t load = t->load & timer_cx_mask(t);
+        steps = load ? steps % (load + 1ull) : 0;
+        return steps ? load - (steps - 1) : 0;
+    }
+    return (uint32_t)(0 - steps) & timer_cx_mask(t);
 }
-void timer_cx_advance(int which) {
+// Ticks from a prescaler value until the nth decrement
+static uint64_t timer_cx_ticks_for(const struct cx_timer *t, uint8_t prescale, uint64_t steps) {
+    uint32_t period = timer_cx_prescale(t);
+    return steps * period - prescale % period;
+}
+void timer_cx_advance(int which, uint32_t ticks) {
     int i;
     for (i = 0; i < 2; i++) {
         struct cx_timer *t = &timer_cx.timer[which][i];
-        t->prescale++;
-        if (!(t->control & 0x80))
+        uint8_t prescale = t->prescale;
+        t->prescale += ticks;
+        if (!(t->control & 0x80) || ticks == 0)
             continue;
-        uint32_t oldvalue = (t->control & 2) ? t->value : t->value & 0xFFFF;
-        uint32_t value = oldvalue;
+        uint32_t mask = timer_cx_mask(t);
+        uint32_t value = t->value & mask;
+        bool interrupt = false;
         if (t->reload) {
             t->reload = 0;
-            value = t->load;
-        } else if (!(t->prescale & ((1 << (t->control & 0xC)) - 1))) {
-            if (value == 0) {
-                if (!(t->control & 1)) {
-                    value--;
-                    if (t->control & 0x40)
-                        value = t->load;
-                }
-            } else {
-                value--;
-            }
+            interrupt = value != 0 && t->load == 0;
+            value = t->load & mask;
+            prescale++;
+            ticks--;
         }
-        t->value = (t->control & 2) ? value : (t->value & 0xFFFF0000) | (value & 0xFFFF);
-        if (oldvalue != 0 && value == 0) {
+        uint32_t period = timer_cx_prescale(t);
+        uint32_t steps = (prescale % period + ticks) / period;
+        uint64_t to_zero = timer_cx_steps_to_zero(t, value);
+        if (to_zero && to_zero <= steps)
+            interrupt = true;
+        value = timer_cx_value_after(t, value, steps);
+        t->value = (t->control & 2) ? value : (t->value & 0xFFFF0000) | value;
+        if (interrupt) {
             t->interrupt = 1;
             timer_cx_int_check(which);
         }
     }
 }
-static void timer_cx_event(int index) {
-    // TODO: should use seperate schedule item for each timer,
-    //       only fired on significant events
-    event_repeat(index, 1);
+// Ticks until t raises its interrupt line, 0 if it doesn't
+static uint64_t timer_cx_next_interrupt(const struct cx_timer *t) {
+    if (!(t->control & 0x80) || !(t->control & 0x20) || t->interrupt)
+        return 0;
+    uint32_t value = t->value & timer_cx_mask(t);
+    if (t->reload) {
+        if (value != 0 && t->load == 0)
+            return 1;
+        uint64_t to_zero = timer_cx_steps_to_zero(t, t->load & timer_cx_mask(t));
+        return to_zero ? 1 + timer_cx_ticks_for(t, t->prescale + 1, to_zero) : 0;
+    }
+    uint64_t to_zero = timer_cx_steps_to_zero(t, value);
+    return to_zero ? timer_cx_ticks_for(t, t->prescale, to_zero) : 0;
+}
+static uint32_t timer_cx_next_event() {
+    uint64_t ticks = TIMER_MAX_TICKS, timer_ticks;
+    int which, i;
     // fast timer not implemented here...
-    timer_cx_advance(1);
-    timer_cx_advance(2);
+    for (which = 1; which < 3; which++) {
+        for (i = 0; i < 2; i++) {
+            timer_ticks = timer_cx_next_interrupt(&timer_cx.timer[which][i]);
+            if (timer_ticks && timer_ticks < ticks)
+                ticks = timer_ticks;
+        }
+    }
+    return ticks;
+}
+static void timer_cx_sync() {
+    uint32_t remaining = event_ticks_remaining(SCHED_TIMERS);
+    uint32_t elapsed = remaining < timer_cx.armed_ticks ? timer_cx.armed_ticks - remaining : 0;
+    if (elapsed > timer_cx.synced_ticks) {
+        timer_cx_advance(1, elapsed - timer_cx.synced_ticks);
+        timer_cx_advance(2, elapsed - timer_cx.synced_ticks);
+        timer_cx.synced_ticks = elapsed;
+    }
+}
+// Needs timer_cx_sync first
+static void timer_cx_schedule() {
+    timer_cx.armed_ticks = timer_cx_next_event();
+    timer_cx.synced_ticks = 0;
+    event_set(SCHED_TIMERS, timer_cx.armed_ticks);
+}
+static void timer_cx_event(int index) {
+    timer_cx_advance(1, timer_cx.armed_ticks - timer_cx.synced_ticks);
+    timer_cx_advance(2, timer_cx.armed_ticks - timer_cx.synced_ticks);
+    timer_cx.armed_ticks = timer_cx_next_event();
+    timer_cx.synced_ticks = 0;
+    event_repeat(index, timer_cx.armed_ticks);
 }
 void timer_cx_reset() {
     memset(timer_cx.timer, 0, sizeof(timer_cx.timer));
@@ -640,8 +832,9 @@ void timer_cx_reset() {
             timer_cx.timer[which][i].control = 0x20;
         }
     }
-    sched.items[SCHED_TIMERS].clock = CLOCK_32K;
-    sched.items[SCHED_TIMERS].proc = timer_cx_event;
+    timer_cx.armed_ticks = 1;
+    timer_cx.synced_ticks = 0;
+    sched_init_item(SCHED_TIMERS, CLOCK_32K, timer_cx_event, true);
 }
 
 /* 900F0000 */
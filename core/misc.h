@@ -58,6 +58,10 @@ struct timerpair {
 
 typedef struct timer_state {
     struct timerpair pairs[3];
+    /* The counters are only brought up to date when accessed or when
+     * SCHED_TIMERS fires, which happens on the next interrupt. */
+    uint32_t armed_ticks;  // 32KHz ticks between the last sync point and the event
+    uint32_t synced_ticks; // Ticks of those already applied to the counters
 } timer_state;
 
 uint32_t timer_read(uint32_t addr);
@@ -157,6 +161,7 @@ struct cx_timer {
 
 typedef struct timer_cx_state {
     struct cx_timer timer[3][2];
+    uint32_t armed_ticks, synced_ticks; // See timer_state
 } timer_cx_state;
 
 uint32_t timer_cx_read(uint32_t addr);
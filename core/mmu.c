@@ -79,6 +79,8 @@ uint32_t mmu_translate(uint32_t addr, bool writing, fault_proc *fault, uint8_t *
     if (!(arm.control & 1))
         return addr;
 
+    mem_stats.mmu_walks++;
+
     uint32_t *table = mmu_translation_table;
     uint32_t entry = table[addr >> 20];
     uint32_t domain = entry >> 5 & 0x0F;
@@ -238,10 +240,11 @@ bool addr_cache_pagefault(void *addr) {
 #endif
 
 void *addr_cache_miss(uint32_t virt, bool writing, fault_proc *fault) {
+    mem_stats.ac_misses[writing]++;
     ac_entry entry;
     uintptr_t phys = mmu_translate(virt, writing, fault, NULL);
     uint8_t *ptr = phys_mem_ptr(phys, 1);
-    if (ptr && !(writing && (RAM_FLAGS((size_t)ptr & ~3) & RF_READ_ONLY))) {
+    if (ptr && !(writing && (RAM_PAGE_FLAGS(ptr) & RPF_READ_ONLY))) {
         AC_SET_ENTRY_PTR(entry, virt, ptr)
                 //printf("addr_cache_miss VA=%08x ptr=%p entry=%p\n", virt, ptr, entry);
     } else {
@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 
@@ -9,6 +10,15 @@
 #include "core/mmu.h"
 #include "os.h"
 
+enum os_hugepages_mode os_hugepages = OS_HUGEPAGES_OFF;
+int os_numa_node = -1;
+
+bool os_numa_node_exists(int node)
+{
+    (void) node;
+    return false;
+}
+
 FILE *fopen_utf8(const char *filename, const char *mode)
 {
     return fopen(filename, mode);
@@ -25,6 +35,56 @@ void os_free(void *ptr, size_t size)
     free(ptr);
 }
 
+void os_discard(void *addr, size_t size)
+{
+    memset(addr, 0, size);
+}
+
+// No page protection in wasm, but there's no JIT either
+bool os_write_protect_init(void *start, size_t size, os_write_fault_handler handler)
+{
+    (void) start;
+    (void) size;
+    (void) handler;
+    return false;
+}
+
+void os_write_protect_deinit() {}
+
+bool os_write_protect(void *addr, size_t size, bool protect)
+{
+    (void) addr;
+    (void) size;
+    (void) protect;
+    return false;
+}
+
+size_t os_page_size()
+{
+    return 0x1000;
+}
+
+double os_cpu_time()
+{
+    return 0;
+}
+
+bool os_file_write_at(FILE *fp, const void *data, size_t size, uint64_t offset)
+{
+    return fseek(fp, (long) offset, SEEK_SET) == 0 && fwrite(data, 1, size, fp) == size;
+}
+
+bool os_file_sync(FILE *fp)
+{
+    return fflush(fp) == 0;
+}
+
+bool os_file_sync_dir(const char *path)
+{
+    (void) path;
+    return true;
+}
+
 void *os_alloc_executable(size_t size)
 {
     (void) size;
@@ -50,6 +110,17 @@ void os_unmap_cow(void *addr, size_t size)
     free(addr);
 }
 
+void *os_map_file(void *addr, const char *filename, uint64_t offset, size_t size)
+{
+    (void) addr; (void) filename; (void) offset; (void) size;
+    return NULL;
+}
+
+void os_unmap_file(void *addr, size_t size)
+{
+    (void) addr; (void) size;
+}
+
 void addr_cache_init()
 {
     // Only run this if not already initialized
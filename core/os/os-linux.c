@@ -2,10 +2,28 @@
 #define _XOPEN_SOURCE
 
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
+#ifdef __linux__
+    #include <sys/syscall.h>
+    #if defined(__has_include)
+        #if __has_include(<linux/userfaultfd.h>)
+            #include <linux/userfaultfd.h>
+        #endif
+    #endif
+    #if defined(SYS_userfaultfd) && defined(UFFDIO_WRITEPROTECT_MODE_WP)
+        #define HAVE_UFFD_WP 1
+        #include <sys/ioctl.h>
+        #include <poll.h>
+        #include <pthread.h>
+    #endif
+#endif
 #ifdef __APPLE__
     #include <mach/clock.h>
     #include <mach/mach.h>
@@ -51,13 +69,84 @@ FILE *fopen_utf8(const char *filename, const char *mode)
 }
 #endif
 
+enum os_hugepages_mode os_hugepages = OS_HUGEPAGES_OFF;
+int os_numa_node = -1;
+
+#define HUGE_PAGE_SIZE (2u << 20)
+#define NUMA_MAX_NODES 256 // Size of the nodemask in mmap_anon
+
+bool os_numa_node_exists(int node)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", node);
+    return node >= 0 && node < NUMA_MAX_NODES && access(path, F_OK) == 0;
+#else
+    (void) node;
+    return false;
+#endif
+}
+
+/* Like mmap of anonymous memory, but applies os_hugepages and os_numa_node.
+ * Anything that isn't available is skipped, the result is printed if
+ * something was requested. Without hugetlb set, transparent huge pages are
+ * used instead of hugetlb pages, for memory which needs 4 KiB granularity. */
+static void *mmap_anon(const char *name, void *addr, size_t size, int prot, int flags, bool hugetlb)
+{
+    const char *backing = "4 KiB pages";
+    void *ptr = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if(os_hugepages == OS_HUGEPAGES_HUGETLB && hugetlb && size % HUGE_PAGE_SIZE == 0)
+    {
+        ptr = mmap(addr, size, prot, flags | MAP_HUGETLB, -1, 0);
+        if(ptr != MAP_FAILED)
+            backing = "hugetlb pages";
+    }
+#endif
+
+    if(ptr == MAP_FAILED)
+    {
+        ptr = mmap(addr, size, prot, flags, -1, 0);
+        if(ptr == MAP_FAILED)
+            return ptr;
+
+#ifdef MADV_HUGEPAGE
+        if(os_hugepages != OS_HUGEPAGES_OFF && madvise(ptr, size, MADV_HUGEPAGE) == 0)
+            backing = os_hugepages != OS_HUGEPAGES_HUGETLB ? "transparent huge pages"
+                      : hugetlb ? "transparent huge pages (no hugetlb pages available)"
+                      : "transparent huge pages (hugetlb pages can't be split)";
+#endif
+    }
+
+    bool numa_bound = false;
+#if defined(__linux__) && defined(SYS_mbind)
+    // Without libnuma. Has to happen before the pages are touched.
+    enum { MPOL_BIND_ = 2, LONG_BITS = 8 * sizeof(unsigned long) };
+    unsigned long nodemask[NUMA_MAX_NODES / LONG_BITS] = {0};
+    if(os_numa_node >= 0 && os_numa_node < NUMA_MAX_NODES)
+    {
+        nodemask[os_numa_node / LONG_BITS] = 1ul << (os_numa_node % LONG_BITS);
+        numa_bound = syscall(SYS_mbind, ptr, size, MPOL_BIND_, nodemask, sizeof(nodemask) * 8 + 1, 0) == 0;
+    }
+#endif
+
+    if(os_numa_node >= 0)
+        emuprintf("%s: %zu MiB, %s, %s NUMA node %d\n", name, size >> 20, backing, numa_bound ? "bound to" : "failed to bind to", os_numa_node);
+    else if(os_hugepages != OS_HUGEPAGES_OFF)
+        emuprintf("%s: %zu MiB, %s\n", name, size >> 20, backing);
+
+    return ptr;
+}
+
 void *os_reserve(size_t size)
 {
 #if !defined(AC_FLAGS)
     // Has to have bit 31 zero
-    void *ptr = mmap((void*)0x70000000, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON|MAP_32BIT, -1, 0);
+    void *ptr = mmap_anon("Memory", (void*)0x70000000, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON|MAP_32BIT, false);
 #else
-    void *ptr = mmap((void*)0, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON, -1, 0);
+    // Private, so that reading untouched pages (most of RAM_FLAGS) doesn't allocate anything
+    void *ptr = mmap_anon("Memory", (void*)0, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, false);
 #endif
 
     if(ptr == MAP_FAILED)
@@ -73,12 +162,295 @@ void os_free(void *ptr, size_t size)
         munmap(ptr, size);
 }
 
+void os_discard(void *addr, size_t size)
+{
+#ifdef __linux__
+    // Private anonymous pages read as zero afterwards. Keeps the huge page
+    // and NUMA settings of the mapping, unlike mapping new pages over it.
+    if(madvise(addr, size, MADV_DONTNEED) == 0)
+        return;
+#else
+    // MADV_DONTNEED doesn't zero on all platforms, so replace the pages instead
+    if(mmap(addr, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON|MAP_FIXED, -1, 0) != MAP_FAILED)
+        return;
+#endif
+    memset(addr, 0, size);
+}
+
+static os_write_fault_handler wp_handler;
+static uintptr_t wp_start, wp_size;
+
+size_t os_page_size()
+{
+    static size_t page_size;
+    if(!page_size)
+        page_size = sysconf(_SC_PAGE_SIZE);
+    return page_size;
+}
+
+double os_cpu_time()
+{
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+            + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+bool os_file_write_at(FILE *fp, const void *data, size_t size, uint64_t offset)
+{
+    int fd = fileno(fp);
+    const char *pos = data;
+    while(size)
+    {
+        ssize_t written = pwrite(fd, pos, size, offset);
+        if(written < 0 && errno == EINTR)
+            continue;
+        if(written <= 0)
+            return false;
+
+        pos += written;
+        size -= written;
+        offset += written;
+    }
+
+    return true;
+}
+
+bool os_file_sync(FILE *fp)
+{
+    if(fflush(fp) != 0)
+        return false;
+
+#ifdef __APPLE__
+    // fsync only hands the data to the drive there
+    if(fcntl(fileno(fp), F_FULLFSYNC) == 0)
+        return true;
+#endif
+    return fsync(fileno(fp)) == 0;
+}
+
+bool os_file_sync_dir(const char *path)
+{
+    char dir[4096];
+    const char *slash = strrchr(path, '/');
+    if(!slash)
+        strcpy(dir, ".");
+    else if(slash == path)
+        strcpy(dir, "/");
+    else if((size_t)(slash - path) < sizeof(dir))
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+    else
+        return false;
+
+    int fd = open(dir, O_RDONLY);
+    if(fd < 0)
+        return false;
+
+    // Some filesystems can't sync directories, their entries are safe anyway
+    bool ok = fsync(fd) == 0 || errno == EINVAL;
+    close(fd);
+    return ok;
+}
+
+#ifdef HAVE_UFFD_WP
+/* With userfaultfd, a thread gets notified about writes to protected pages
+ * while the writer is blocked. Unlike SIGSEGV, this also works for writes
+ * done by the kernel (read(2) into guest memory) and doesn't interfere with
+ * other signal handlers. */
+static int wp_uffd = -1, wp_stop_pipe[2] = {-1, -1};
+static pthread_t wp_thread;
+
+static void *uffd_thread(void *arg)
+{
+    (void) arg;
+    struct pollfd fds[2] = {{wp_uffd, POLLIN, 0}, {wp_stop_pipe[0], POLLIN, 0}};
+    for(;;)
+    {
+        if(poll(fds, 2, -1) < 0 && errno != EINTR)
+            return NULL;
+        if(fds[1].revents)
+            return NULL;
+
+        struct uffd_msg msg;
+        if(!(fds[0].revents & POLLIN) || read(wp_uffd, &msg, sizeof(msg)) != sizeof(msg))
+            continue;
+        if(msg.event != UFFD_EVENT_PAGEFAULT || !(msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP))
+            continue;
+
+        void *page = (void*)(uintptr_t)(msg.arg.pagefault.address & ~(uint64_t)(os_page_size() - 1));
+        wp_handler((void*)(uintptr_t)msg.arg.pagefault.address);
+        os_write_protect(page, os_page_size(), false); // Wakes the writer
+    }
+}
+
+static bool uffd_init()
+{
+    wp_uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if(wp_uffd < 0)
+        return false;
+
+    struct uffdio_api api = { .api = UFFD_API, .features = UFFD_FEATURE_PAGEFAULT_FLAG_WP };
+    struct uffdio_register reg = { .range = { wp_start, wp_size }, .mode = UFFDIO_REGISTER_MODE_WP };
+    if(ioctl(wp_uffd, UFFDIO_API, &api) == 0
+       && (api.features & UFFD_FEATURE_PAGEFAULT_FLAG_WP)
+       && ioctl(wp_uffd, UFFDIO_REGISTER, &reg) == 0
+       && (reg.ioctls & (1ull << _UFFDIO_WRITEPROTECT))
+       && pipe(wp_stop_pipe) == 0)
+    {
+        if(pthread_create(&wp_thread, NULL, uffd_thread, NULL) == 0)
+            return true;
+
+        close(wp_stop_pipe[0]);
+        close(wp_stop_pipe[1]);
+    }
+
+    close(wp_uffd);
+    wp_uffd = -1;
+    return false;
+}
+#endif
+
+/* Fallback: mprotect and catch the fault. Only works for writes by user space. */
+static bool wp_by_signal;
+
+/* addr_cache if its pages get filled on the first access, see addr_cache_init */
+static ac_entry *ac_lazy;
+
+static void ac_fill(size_t first, size_t count)
+{
+    #if !defined(AC_FLAGS)
+        for(size_t i = first; i < first + count; ++i)
+        {
+            AC_SET_ENTRY_INVALID(addr_cache[i], (i >> 1) << 10)
+        }
+    #else
+        memset(addr_cache + first, 0xFF, count * sizeof(ac_entry));
+    #endif
+}
+
+/* The handler for SIGSEGV and SIGBUS serves both the write protection and
+ * ac_lazy. It stays installed once set up, so that they don't depend on the
+ * order they get enabled and disabled in. */
+static struct sigaction old_segv, old_bus;
+static bool fault_signal_installed;
+
+static void fault_signal(int sig, siginfo_t *info, void *context)
+{
+    uintptr_t addr = (uintptr_t)info->si_addr, page = addr & ~(os_page_size() - 1);
+    if(ac_lazy && addr - (uintptr_t)ac_lazy < AC_NUM_ENTRIES * sizeof(ac_entry))
+    {
+        int saved_errno = errno;
+        bool filled = mprotect((void*)page, os_page_size(), PROT_READ | PROT_WRITE) == 0;
+        if(filled)
+            ac_fill((page - (uintptr_t)ac_lazy) / sizeof(ac_entry), os_page_size() / sizeof(ac_entry));
+        errno = saved_errno;
+        if(filled)
+            return; // Retry
+    }
+
+    if(wp_by_signal && addr - wp_start < wp_size)
+    {
+        int saved_errno = errno;
+        wp_handler(info->si_addr);
+        os_write_protect((void*)page, os_page_size(), false);
+        errno = saved_errno;
+        return; // Retry
+    }
+
+    // Not ours, pass it on
+    struct sigaction *old = sig == SIGSEGV ? &old_segv : &old_bus;
+    if(old->sa_flags & SA_SIGINFO)
+        old->sa_sigaction(sig, info, context);
+    else if(old->sa_handler != SIG_DFL && old->sa_handler != SIG_IGN)
+        old->sa_handler(sig);
+    else
+        sigaction(sig, old, NULL); // Faults again after returning
+}
+
+static bool fault_signal_install()
+{
+    if(fault_signal_installed)
+        return true;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = fault_signal;
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    // Some platforms report writes to read-only pages as SIGBUS
+    if(sigaction(SIGSEGV, &action, &old_segv) == 0)
+    {
+        if(sigaction(SIGBUS, &action, &old_bus) == 0)
+            return fault_signal_installed = true;
+
+        sigaction(SIGSEGV, &old_segv, NULL);
+    }
+
+    return false;
+}
+
+bool os_write_protect_init(void *start, size_t size, os_write_fault_handler handler)
+{
+    wp_handler = handler;
+    wp_start = (uintptr_t)start;
+    wp_size = size;
+
+#ifdef HAVE_UFFD_WP
+    if(uffd_init())
+        return true;
+#endif
+
+    if(fault_signal_install())
+        return wp_by_signal = true;
+
+    wp_handler = NULL;
+    return false;
+}
+
+void os_write_protect_deinit()
+{
+#ifdef HAVE_UFFD_WP
+    if(wp_uffd >= 0)
+    {
+        if(write(wp_stop_pipe[1], "", 1) == 1)
+            pthread_join(wp_thread, NULL);
+        close(wp_stop_pipe[0]);
+        close(wp_stop_pipe[1]);
+        close(wp_uffd); // Also unregisters the range
+        wp_uffd = -1;
+        wp_handler = NULL;
+        return;
+    }
+#endif
+
+    wp_by_signal = false;
+    wp_handler = NULL;
+}
+
+bool os_write_protect(void *addr, size_t size, bool protect)
+{
+#ifdef HAVE_UFFD_WP
+    if(wp_uffd >= 0)
+    {
+        struct uffdio_writeprotect wp = {
+            .range = { (uintptr_t)addr, size },
+            .mode = protect ? UFFDIO_WRITEPROTECT_MODE_WP : 0
+        };
+        return ioctl(wp_uffd, UFFDIO_WRITEPROTECT, &wp) == 0;
+    }
+#endif
+
+    return mprotect(addr, size, protect ? PROT_READ : PROT_READ | PROT_WRITE) == 0;
+}
+
 void *os_alloc_executable(size_t size)
 {
 #if defined(IS_IOS_BUILD)
-    void *ptr = mmap((void*)0x0, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON, -1, 0);
+    void *ptr = mmap_anon("JIT buffer", (void*)0x0, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON, true);
 #else
-    void *ptr = mmap((void*)0x0, size, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_SHARED|MAP_ANON, -1, 0);
+    void *ptr = mmap_anon("JIT buffer", (void*)0x0, size, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_SHARED|MAP_ANON, true);
 #endif
 
     if(ptr == MAP_FAILED)
@@ -107,6 +479,23 @@ void os_unmap_cow(void *addr, size_t size)
     munmap(addr, size);
 }
 
+void *os_map_file(void *addr, const char *filename, uint64_t offset, size_t size)
+{
+    FILE *f = fopen_utf8(filename, "rb");
+    if(!f)
+        return NULL;
+
+    void *ret = mmap(addr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | (addr ? MAP_FIXED : 0), fileno(f), offset);
+
+    fclose(f);
+    return ret == MAP_FAILED ? NULL : ret;
+}
+
+void os_unmap_file(void *addr, size_t size)
+{
+    munmap(addr, size);
+}
+
 __attribute__((unused)) static void make_writable(void *addr)
 {
     uintptr_t ps = sysconf(_SC_PAGE_SIZE);
@@ -121,7 +510,12 @@ void addr_cache_init()
     if(addr_cache)
         return;
 
-    addr_cache = mmap((void*)0, AC_NUM_ENTRIES * sizeof(ac_entry), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+    /* Filling all of it takes a while and most of it never gets used, so
+     * each page gets filled by fault_signal on the first access instead.
+     * Not with huge pages, which can't be unprotected one by one. */
+    bool lazy = os_hugepages == OS_HUGEPAGES_OFF && fault_signal_install();
+
+    addr_cache = mmap_anon("addr_cache", (void*)0, AC_NUM_ENTRIES * sizeof(ac_entry), lazy ? PROT_NONE : PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON|(lazy ? MAP_NORESERVE : 0), true);
     if(addr_cache == MAP_FAILED)
     {
         addr_cache = NULL;
@@ -131,14 +525,10 @@ void addr_cache_init()
 
     setbuf(stdout, NULL);
 
-    #if !defined(AC_FLAGS)
-        for(unsigned int i = 0; i < AC_NUM_ENTRIES; ++i)
-        {
-            AC_SET_ENTRY_INVALID(addr_cache[i], (i >> 1) << 10)
-        }
-    #else
-        memset(addr_cache, 0xFF, AC_NUM_ENTRIES * sizeof(ac_entry));
-    #endif
+    if(lazy)
+        ac_lazy = addr_cache;
+    else
+        ac_fill(0, AC_NUM_ENTRIES);
 
     #if defined(__i386__) && !defined(NO_TRANSLATION)
         // Relocate the assembly code that wants addr_cache at a fixed address
@@ -156,5 +546,5 @@ void addr_cache_deinit()
     if(addr_cache)
         munmap(addr_cache, AC_NUM_ENTRIES * sizeof(ac_entry));
 
-    addr_cache = NULL;
+    addr_cache = ac_lazy = NULL;
 }
@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <io.h>
 #include <share.h>
 
 #include "../emu.h"
@@ -15,6 +16,15 @@
 static HANDLE flash_mapping;
 static int flash_fd;
 
+enum os_hugepages_mode os_hugepages = OS_HUGEPAGES_OFF;
+int os_numa_node = -1;
+
+bool os_numa_node_exists(int node)
+{
+    (void) node;
+    return false;
+}
+
 FILE *fopen_utf8(const char *filename, const char *mode)
 {
     wchar_t filename_w[MAX_PATH];
@@ -35,6 +45,92 @@ void os_free(void *ptr, size_t size)
     VirtualFree(ptr, 0, MEM_RELEASE);
 }
 
+void os_discard(void *addr, size_t size)
+{
+    // Decommitted pages are zero when committed again
+    VirtualFree(addr, size, MEM_DECOMMIT);
+    VirtualAlloc(addr, size, MEM_COMMIT, PAGE_READWRITE);
+}
+
+// Not implemented, the x86 JIT calls write_action itself
+bool os_write_protect_init(void *start, size_t size, os_write_fault_handler handler)
+{
+    (void) start;
+    (void) size;
+    (void) handler;
+    return false;
+}
+
+void os_write_protect_deinit() {}
+
+bool os_write_protect(void *addr, size_t size, bool protect)
+{
+    (void) addr;
+    (void) size;
+    (void) protect;
+    return false;
+}
+
+size_t os_page_size()
+{
+    return 0x1000;
+}
+
+double os_cpu_time()
+{
+    FILETIME creation, exit, kernel, user;
+    if(!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+        return 0;
+
+    // In units of 100ns
+    ULARGE_INTEGER k = { { kernel.dwLowDateTime, kernel.dwHighDateTime } },
+                   u = { { user.dwLowDateTime, user.dwHighDateTime } };
+    return (k.QuadPart + u.QuadPart) / 1e7;
+}
+
+bool os_file_write_at(FILE *fp, const void *data, size_t size, uint64_t offset)
+{
+    int fd = _fileno(fp);
+    HANDLE file = (HANDLE) _get_osfhandle(fd);
+    // Unlike pwrite, WriteFile moves the file pointer on synchronous handles
+    __int64 file_pos = _lseeki64(fd, 0, SEEK_CUR);
+    if(file_pos < 0)
+        return false;
+
+    const char *pos = data;
+    bool ok = true;
+    while(size)
+    {
+        OVERLAPPED overlapped = {0};
+        overlapped.Offset = (DWORD) offset;
+        overlapped.OffsetHigh = (DWORD) (offset >> 32);
+        DWORD written;
+        if(!WriteFile(file, pos, size > 0x40000000 ? 0x40000000 : (DWORD) size, &written, &overlapped) || !written)
+        {
+            ok = false;
+            break;
+        }
+
+        pos += written;
+        size -= written;
+        offset += written;
+    }
+
+    return _lseeki64(fd, file_pos, SEEK_SET) == file_pos && ok;
+}
+
+bool os_file_sync(FILE *fp)
+{
+    return fflush(fp) == 0 && FlushFileBuffers((HANDLE) _get_osfhandle(_fileno(fp)));
+}
+
+bool os_file_sync_dir(const char *path)
+{
+    // NTFS journals directory changes itself
+    (void) path;
+    return true;
+}
+
 void *os_commit(void *addr, size_t size)
 {
     return VirtualAlloc(addr, size, MEM_COMMIT, PAGE_READWRITE);
@@ -95,6 +191,17 @@ void os_unmap_cow(void *addr, size_t size)
     _close(flash_fd);
 }
 
+void *os_map_file(void *addr, const char *filename, uint64_t offset, size_t size)
+{
+    (void) addr; (void) filename; (void) offset; (void) size;
+    return NULL;
+}
+
+void os_unmap_file(void *addr, size_t size)
+{
+    (void) addr; (void) size;
+}
+
 void addr_cache_init() {
     // Don't run more than once
     if(addr_cache)
@@ -1,6 +1,7 @@
 #ifndef OS_H
 #define OS_H
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -27,9 +28,54 @@ FILE *fopen_utf8(const char *filename, const char *mode);
 char *android_basename(const char *path);
 #endif
 
+/* Host memory backing of os_reserve, os_alloc_executable and addr_cache.
+ * Huge pages reduce TLB misses of the JIT and the RAM_FLAGS lookups, but
+ * make the flags use more memory. Only implemented on Linux, other platforms
+ * ignore these. Set before emu_start. */
+enum os_hugepages_mode {
+    OS_HUGEPAGES_OFF,
+    OS_HUGEPAGES_THP,     // madvise(MADV_HUGEPAGE)
+    /* MAP_HUGETLB, falls back to THP if none available. Only for the JIT
+     * buffer and addr_cache: os_reserve memory gets THP, as write
+     * protection, os_map_file and os_discard work on 4 KiB pages of it. */
+    OS_HUGEPAGES_HUGETLB
+};
+extern enum os_hugepages_mode os_hugepages;
+extern int os_numa_node; // Node to bind memory to, -1 for no binding
+// Whether memory can be bound to node on this host
+bool os_numa_node_exists(int node);
+
 void *os_reserve(size_t size);
 void *os_alloc_executable(size_t size);
 void os_free(void *ptr, size_t size);
+/* Zeroes memory from os_reserve and returns the backing pages to the OS.
+ * addr and size have to be page aligned. */
+void os_discard(void *addr, size_t size);
+
+/* Write protection of pages in [start, start + size) of memory from
+ * os_reserve, to notice writes without checking on every store.
+ * On a write to a protected page, handler gets called with the address,
+ * afterwards the page is unprotected and the write is retried. The handler
+ * may run on a different thread while the writer is blocked, or in a signal
+ * handler, so it must be async-signal-safe.
+ * Returns false if not supported by the host. */
+typedef void (*os_write_fault_handler)(void *addr);
+bool os_write_protect_init(void *start, size_t size, os_write_fault_handler handler);
+void os_write_protect_deinit();
+bool os_write_protect(void *addr, size_t size, bool protect);
+size_t os_page_size();
+
+// User + system CPU time used by the whole process so far, in seconds. 0 if unknown.
+double os_cpu_time();
+
+/* Writes size bytes at offset of fp without going through its stdio buffer,
+ * so don't mix with buffered writes to the same file. Safe to call from any
+ * thread while no other thread uses fp. */
+bool os_file_write_at(FILE *fp, const void *data, size_t size, uint64_t offset);
+/* Flushes fp and waits until its contents are on the disk */
+bool os_file_sync(FILE *fp);
+/* Waits until the directory entry of a newly created file is on the disk */
+bool os_file_sync_dir(const char *path);
 
 #if OS_HAS_PAGEFAULT_HANDLER
 // The Win32 mechanism to handle pagefaults uses SEH, which requires a linked
@@ -47,6 +93,13 @@ void os_sparse_decommit(void *page, size_t size);
 
 void *os_map_cow(const char *filename, size_t size);
 void os_unmap_cow(void *addr, size_t size);
+/* Private copy-on-write mapping of size bytes of a file, starting at offset,
+ * which has to be a multiple of os_page_size. If addr isn't NULL, the mapping
+ * replaces [addr, addr + size) of memory from os_reserve. Pages are only read
+ * from the file when touched. Returns NULL if not possible, the caller has
+ * to read the file instead. */
+void *os_map_file(void *addr, const char *filename, uint64_t offset, size_t size);
+void os_unmap_file(void *addr, size_t size);
 
 void addr_cache_init();
 void addr_cache_deinit();
@@ -0,0 +1,542 @@
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include <zlib.h>
+
+#include "cpu.h"
+#include "cycles.h"
+#include "emu.h"
+#include "keypad.h"
+#include "mem.h"
+#include "replay.h"
+#include "schedule.h"
+#include "translate.h"
+#include "usb.h"
+#include "usb_cx2.h"
+#include "os/os.h"
+
+enum replay_mode replay_mode = REPLAY_OFF;
+bool replay_exit_at_end = false;
+bool replay_diverged = false;
+
+#define REPLAY_SIG 0x50524246 // "FBRP"
+#define REPLAY_VER 2
+
+// A checkpoint every 100 throttle events, once per emulated second
+#define REPLAY_CHECK_INTERVAL 100
+
+struct replay_header {
+    uint32_t sig, version;
+    uint32_t product, features;
+    uint64_t start_cputick;
+    // Cycle counts depend on these
+    char cycle_model[16];
+    uint32_t miss_penalty, reserved;
+};
+
+enum replay_record_type : uint32_t {
+    RECORD_KEY,      // row, col, state
+    RECORD_TOUCHPAD, // x and y as float bits, contact | down << 1
+    RECORD_SERIAL,   // char
+    RECORD_RTC,      // low and high word of the time_t
+    RECORD_CHECK,    // checksum of the CPU state
+    RECORD_USB,      // kind | ep << 8, size, USB sync point, followed by the data
+    RECORD_MEMORY,   // physical address, size, PC, followed by the data
+    RECORD_END,
+};
+
+// Larger payloads mean the log is broken
+#define REPLAY_PAYLOAD_MAX 0x10000
+
+struct replay_record {
+    uint64_t cputick;
+    replay_record_type type;
+    uint32_t data[3];
+};
+
+static FILE *replay_file;
+static replay_record next_record; // Only while replaying
+static std::vector<uint8_t> next_payload;
+static unsigned int throttle_events, checks_passed;
+
+/* USB input is recorded with the number of replay_usb_sync points before it
+ * in the same cycle, the throttle event counts as one as well */
+static uint64_t usb_sync_cputick;
+static uint32_t usb_sync_count;
+
+// Input from other threads, waiting for the next throttle event while recording
+struct usb_input {
+    replay_usb_kind kind;
+    int ep;
+    std::vector<uint8_t> data;
+};
+static std::mutex usb_queue_mutex;
+static std::deque<usb_input> usb_queue;
+
+static uint32_t replay_checksum()
+{
+    uint32_t crc = crc32(0, reinterpret_cast<const Bytef *>(&arm), sizeof(arm));
+    uint32_t events = cpu_events & (EVENT_IRQ | EVENT_FIQ | EVENT_WAITING | EVENT_SLEEP);
+    return crc32(crc, reinterpret_cast<const Bytef *>(&events), sizeof(events));
+}
+
+static void replay_write(replay_record_type type, uint32_t a = 0, uint32_t b = 0, uint32_t c = 0,
+                         const void *payload = nullptr, uint32_t size = 0)
+{
+    if(!replay_file)
+        return;
+
+    replay_record record = { sched_current_cputick(), type, { a, b, c } };
+    if(fwrite(&record, sizeof(record), 1, replay_file) != 1
+       || (size && fwrite(payload, size, 1, replay_file) != 1))
+    {
+        gui_perror("Failed to write replay log");
+        fclose(replay_file);
+        replay_file = nullptr;
+        replay_mode = REPLAY_OFF;
+    }
+}
+
+static void replay_read_next()
+{
+    uint32_t size = 0;
+    bool complete = fread(&next_record, sizeof(next_record), 1, replay_file) == 1;
+    if(complete && (next_record.type == RECORD_USB || next_record.type == RECORD_MEMORY))
+    {
+        size = next_record.data[1];
+        complete = size <= REPLAY_PAYLOAD_MAX;
+    }
+
+    if(complete)
+    {
+        next_payload.resize(size);
+        complete = !size || fread(next_payload.data(), size, 1, replay_file) == 1;
+    }
+
+    if(!complete)
+    {
+        // Recording got interrupted, end at the last thing it saw
+        gui_debug_printf("Replay log is truncated\n");
+        next_record.type = RECORD_END;
+    }
+}
+
+static uint32_t usb_sync_point()
+{
+    uint64_t cputick = sched_current_cputick();
+    if(cputick != usb_sync_cputick)
+    {
+        usb_sync_cputick = cputick;
+        usb_sync_count = 0;
+    }
+
+    return usb_sync_count;
+}
+
+static bool usb_apply(replay_usb_kind kind, int ep, const void *data, uint32_t size)
+{
+    switch(kind)
+    {
+    case REPLAY_USB_RESET_ON:
+        emulate_cx2 ? usb_cx2_bus_reset_on() : usb_bus_reset_on();
+        return true;
+    case REPLAY_USB_RESET_OFF:
+        emulate_cx2 ? usb_cx2_bus_reset_off() : usb_bus_reset_off();
+        return true;
+    case REPLAY_USB_SETUP:
+        if(size != sizeof(usb_setup))
+            return false;
+        if(emulate_cx2)
+            usb_cx2_receive_setup_packet(static_cast<const usb_setup *>(data));
+        else
+            usb_receive_setup_packet(ep, data);
+        return true;
+    case REPLAY_USB_PACKET:
+        if(emulate_cx2)
+            return usb_cx2_packet_to_calc(uint8_t(ep), static_cast<const uint8_t *>(data), size);
+        usb_receive_packet(ep, data, size);
+        return true;
+    }
+
+    return false;
+}
+
+static void usb_queue_apply()
+{
+    std::deque<usb_input> queue;
+    {
+        std::lock_guard<std::mutex> lock(usb_queue_mutex);
+        queue.swap(usb_queue);
+    }
+
+    for(auto &input : queue)
+        replay_usb_input(input.kind, input.ep, input.data.data(), uint32_t(input.data.size()));
+}
+
+static void replay_close()
+{
+    if(replay_file)
+        fclose(replay_file);
+    replay_file = nullptr;
+    replay_mode = REPLAY_OFF;
+
+    // Not recording anymore, so it doesn't have to wait
+    usb_queue_apply();
+}
+
+static void replay_end(bool diverged)
+{
+    replay_close();
+    replay_diverged = diverged;
+    if(!diverged)
+        gui_status_printf("Replay finished, %u checkpoints matched", checks_passed);
+    if(replay_exit_at_end)
+        exiting = true;
+}
+
+static void replay_diverge(const char *what)
+{
+    gui_status_printf("Replay diverged at cycle %llu: %s (recorded at cycle %llu)",
+                      (unsigned long long) sched_current_cputick(), what,
+                      (unsigned long long) next_record.cputick);
+    replay_end(true);
+}
+
+static void apply_record(const replay_record &record)
+{
+    switch(record.type)
+    {
+    case RECORD_KEY:
+        keypad_apply_key(record.data[0], record.data[1], record.data[2]);
+        break;
+    case RECORD_TOUCHPAD:
+    {
+        float x, y;
+        memcpy(&x, &record.data[0], sizeof(x));
+        memcpy(&y, &record.data[1], sizeof(y));
+        touchpad_apply_state(x, y, record.data[2] & 1, record.data[2] & 2);
+        break;
+    }
+    case RECORD_USB:
+        usb_apply(replay_usb_kind(record.data[0] & 0xFF), int(record.data[0] >> 8),
+                  next_payload.data(), record.data[1]);
+        break;
+    case RECORD_MEMORY:
+    {
+        void *ptr = phys_mem_ptr(record.data[0], record.data[1]);
+        if(!ptr)
+            break;
+
+        if(record.cputick != sched_current_cputick() || record.data[2] != arm.reg[15])
+            gui_debug_printf("Replay: debugger write of cycle %llu applied at cycle %llu\n",
+                             (unsigned long long) record.cputick, (unsigned long long) sched_current_cputick());
+
+#ifndef NO_TRANSLATION
+        // Like gdbstub does
+        uintptr_t start = reinterpret_cast<uintptr_t>(ptr);
+        for(uintptr_t word = start & ~uintptr_t(3); word < start + record.data[1]; word += 4)
+        {
+            if(RAM_FLAGS(word) & RF_CODE_TRANSLATED)
+            {
+                flush_translations();
+                break;
+            }
+        }
+#endif
+        memcpy(ptr, next_payload.data(), record.data[1]);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+bool replay_record_start(const char *filename)
+{
+    replay_close();
+
+    replay_file = fopen_utf8(filename, "wb");
+    if(!replay_file)
+    {
+        gui_perror("Failed to create replay log");
+        return false;
+    }
+
+    replay_header header = { REPLAY_SIG, REPLAY_VER, product, features, sched_current_cputick(), {}, cycle_miss_penalty(), 0 };
+    strncpy(header.cycle_model, cycle_model_name(), sizeof(header.cycle_model) - 1);
+    if(fwrite(&header, sizeof(header), 1, replay_file) != 1)
+    {
+        gui_perror("Failed to write replay log");
+        replay_close();
+        return false;
+    }
+
+    throttle_events = 0;
+    replay_mode = REPLAY_RECORD;
+    return true;
+}
+
+bool replay_play_start(const char *filename)
+{
+    replay_close();
+
+    replay_file = fopen_utf8(filename, "rb");
+    if(!replay_file)
+    {
+        gui_perror("Failed to open replay log");
+        return false;
+    }
+
+    replay_header header;
+    if(fread(&header, sizeof(header), 1, replay_file) != 1
+       || header.sig != REPLAY_SIG || header.version != REPLAY_VER)
+    {
+        gui_debug_printf("Not a replay log of this version\n");
+        replay_close();
+        return false;
+    }
+
+    if(header.product != product || header.features != features
+       || header.start_cputick != sched_current_cputick())
+    {
+        gui_debug_printf("Replay log was recorded from a different state. Start from the same snapshot or images.\n");
+        replay_close();
+        return false;
+    }
+
+    header.cycle_model[sizeof(header.cycle_model) - 1] = 0;
+    if(strcmp(header.cycle_model, cycle_model_name()) != 0 || header.miss_penalty != cycle_miss_penalty())
+    {
+        gui_debug_printf("Replay log was recorded with the cycle model %s and a miss penalty of %u, use the same.\n",
+                         header.cycle_model, header.miss_penalty);
+        replay_close();
+        return false;
+    }
+
+    throttle_events = checks_passed = 0;
+    replay_diverged = false;
+    replay_read_next();
+    replay_mode = REPLAY_PLAY;
+    return true;
+}
+
+void replay_stop()
+{
+    if(replay_mode == REPLAY_RECORD)
+        replay_write(RECORD_END);
+
+    replay_close();
+}
+
+bool replay_key(int row, int col, bool state)
+{
+    if(replay_mode == REPLAY_RECORD)
+        replay_write(RECORD_KEY, uint32_t(row), uint32_t(col), state);
+
+    return replay_mode == REPLAY_PLAY;
+}
+
+bool replay_touchpad(float x, float y, bool contact, bool down)
+{
+    if(replay_mode == REPLAY_RECORD)
+    {
+        uint32_t x_bits, y_bits;
+        memcpy(&x_bits, &x, sizeof(x));
+        memcpy(&y_bits, &y, sizeof(y));
+        replay_write(RECORD_TOUCHPAD, x_bits, y_bits, uint32_t(contact | down << 1));
+    }
+
+    return replay_mode == REPLAY_PLAY;
+}
+
+bool replay_usb_input(replay_usb_kind kind, int ep, const void *data, uint32_t size)
+{
+    if(replay_mode == REPLAY_PLAY)
+        return true;
+
+    if(!usb_apply(kind, ep, data, size))
+        return false;
+
+    if(replay_mode == REPLAY_RECORD)
+        replay_write(RECORD_USB, kind | uint32_t(ep) << 8, size, usb_sync_point(), data, size);
+
+    return true;
+}
+
+void replay_usb_input_async(replay_usb_kind kind, int ep, const void *data, uint32_t size)
+{
+    if(replay_mode != REPLAY_RECORD)
+    {
+        replay_usb_input(kind, ep, data, size);
+        return;
+    }
+
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    std::lock_guard<std::mutex> lock(usb_queue_mutex);
+    usb_queue.push_back({kind, ep, std::vector<uint8_t>(bytes, bytes + size)});
+}
+
+/* Applies the USB input recorded at the current sync point. Returns false if
+ * the replay diverged. */
+static bool replay_usb_records()
+{
+    uint64_t cputick = sched_current_cputick();
+    uint32_t point = usb_sync_point();
+    while(replay_mode == REPLAY_PLAY && next_record.type == RECORD_USB
+          && next_record.cputick == cputick && next_record.data[2] == point)
+    {
+        apply_record(next_record);
+        replay_read_next();
+    }
+
+    if(replay_mode == REPLAY_PLAY && next_record.type == RECORD_USB
+       && (next_record.cputick < cputick || (next_record.cputick == cputick && next_record.data[2] < point)))
+    {
+        replay_diverge("USB input missed");
+        return false;
+    }
+
+    return true;
+}
+
+void replay_usb_sync()
+{
+    if(replay_mode == REPLAY_PLAY)
+        replay_usb_records();
+
+    usb_sync_point();
+    usb_sync_count++;
+}
+
+void replay_debugger_write(uint32_t addr, const void *data, uint32_t size)
+{
+    if(replay_mode == REPLAY_RECORD)
+        replay_write(RECORD_MEMORY, addr, size, arm.reg[15], data, size);
+}
+
+void replay_poll()
+{
+    uint64_t cputick = sched_current_cputick();
+    while(replay_mode == REPLAY_PLAY && next_record.type == RECORD_MEMORY && next_record.cputick <= cputick)
+    {
+        apply_record(next_record);
+        replay_read_next();
+    }
+}
+
+// The part of replay_throttle_event for replaying
+static void replay_throttle_records()
+{
+    uint64_t cputick = sched_current_cputick();
+    while(replay_mode == REPLAY_PLAY && next_record.cputick <= cputick)
+    {
+        const char *divergence = nullptr;
+        switch(next_record.type)
+        {
+        case RECORD_KEY:
+        case RECORD_TOUCHPAD:
+            if(next_record.cputick != cputick)
+                divergence = "input not at a throttle event";
+            else
+                apply_record(next_record);
+            break;
+        case RECORD_CHECK:
+            if(next_record.cputick != cputick || next_record.data[0] != replay_checksum())
+                divergence = "CPU state differs";
+            else
+                checks_passed++;
+            break;
+        case RECORD_USB:
+            // Input for a later sync point in this cycle stays
+            if(next_record.cputick == cputick && next_record.data[2] > usb_sync_point())
+                return;
+
+            replay_usb_records();
+            continue;
+        case RECORD_MEMORY:
+            // Late, but better than never
+            apply_record(next_record);
+            break;
+        case RECORD_SERIAL:
+            if(next_record.cputick == cputick)
+                return; // For replay_getchar
+
+            divergence = "serial input missed";
+            break;
+        case RECORD_RTC:
+            divergence = "RTC read missed";
+            break;
+        case RECORD_END:
+            replay_end(false);
+            return;
+        }
+
+        if(divergence)
+        {
+            replay_diverge(divergence);
+            return;
+        }
+
+        replay_read_next();
+    }
+}
+
+void replay_throttle_event()
+{
+    if(replay_mode == REPLAY_RECORD)
+    {
+        usb_queue_apply();
+
+        if(++throttle_events % REPLAY_CHECK_INTERVAL == 0 && replay_mode == REPLAY_RECORD)
+            replay_write(RECORD_CHECK, replay_checksum());
+    }
+    else if(replay_mode == REPLAY_PLAY)
+        replay_throttle_records();
+
+    // USB input from the throttle event is done now
+    usb_sync_point();
+    usb_sync_count++;
+}
+
+int replay_getchar()
+{
+    if(replay_mode == REPLAY_PLAY)
+    {
+        if(next_record.type != RECORD_SERIAL || next_record.cputick != sched_current_cputick())
+            return -1;
+
+        int c = next_record.data[0];
+        replay_read_next();
+        return c;
+    }
+
+    int c = gui_getchar();
+    if(c != -1 && replay_mode == REPLAY_RECORD)
+        replay_write(RECORD_SERIAL, uint8_t(c));
+
+    return c;
+}
+
+time_t replay_time()
+{
+    if(replay_mode == REPLAY_PLAY)
+    {
+        if(next_record.type != RECORD_RTC || next_record.cputick != sched_current_cputick())
+        {
+            replay_diverge("unexpected RTC read");
+            return time(nullptr);
+        }
+
+        time_t t = time_t(uint64_t(next_record.data[1]) << 32 | next_record.data[0]);
+        replay_read_next();
+        return t;
+    }
+
+    time_t t = time(nullptr);
+    if(replay_mode == REPLAY_RECORD)
+        replay_write(RECORD_RTC, uint32_t(uint64_t(t)), uint32_t(uint64_t(t) >> 32));
+
+    return t;
+}
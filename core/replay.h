@@ -0,0 +1,75 @@
+/* Declarations for replay.cpp */
+
+#ifndef _H_REPLAY
+#define _H_REPLAY
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Record and replay of emulation sessions. All input from the host which
+ * depends on when it happens (keys, touchpad, serial input and the RTC) gets
+ * logged with the CPU cycle it was seen at. While recording, keypad and
+ * touchpad changes from the GUI are only applied in the throttle event (see
+ * keypad_process_input), so that they happen at points replay can
+ * reproduce. Starting from the same state (the same snapshot or a reset
+ * with the same images), replay then runs the same session cycle by cycle at
+ * maximum speed. Checksums of the CPU state in the log detect if it
+ * diverges. The cycle model has to match as well.
+ *
+ * USB input from usblink and USBIP is recorded too, see replay_usb_input.
+ * Of the changes done by debuggers, only memory writes through GDB are
+ * recorded. They get replayed when the emulation loop first gets control at
+ * or after the cycle they were done at, which may be later than during the
+ * recording. Registers and breakpoints set by debuggers aren't recorded. */
+enum replay_mode { REPLAY_OFF, REPLAY_RECORD, REPLAY_PLAY };
+extern enum replay_mode replay_mode;
+/* Set exiting once the replay ended */
+extern bool replay_exit_at_end;
+/* Set if the replay didn't match the recording */
+extern bool replay_diverged;
+
+bool replay_record_start(const char *filename);
+bool replay_play_start(const char *filename);
+/* Finishes the recording or aborts the replay */
+void replay_stop(void);
+
+/* Called before applying input from the GUI. Return true if it has to be
+ * ignored, because the replay provides the input. */
+bool replay_key(int row, int col, bool state);
+bool replay_touchpad(float x, float y, bool contact, bool down);
+
+/* Everything usblink and the USBIP server pass to the USB controller goes
+ * through replay_usb_input, so that it can be recorded. While replaying, it
+ * gets dropped and the log provides the input instead. Only packets return
+ * false, if the controller couldn't take them. */
+enum replay_usb_kind { REPLAY_USB_RESET_ON, REPLAY_USB_RESET_OFF, REPLAY_USB_SETUP, REPLAY_USB_PACKET };
+bool replay_usb_input(enum replay_usb_kind kind, int ep, const void *data, uint32_t size);
+/* For other threads. While recording, the input gets applied at the next
+ * throttle event instead, so that replay can reproduce the point. */
+void replay_usb_input_async(enum replay_usb_kind kind, int ep, const void *data, uint32_t size);
+/* Marks a point where the USB controller handed something to usblink or
+ * USBIP, which may have replied with replay_usb_input. Replay applies the
+ * replies recorded there. */
+void replay_usb_sync(void);
+
+/* A GDB write to physical memory, after it got done */
+void replay_debugger_write(uint32_t addr, const void *data, uint32_t size);
+/* Called from the emulation loop while replaying */
+void replay_poll(void);
+
+/* Called from throttle_interval_event */
+void replay_throttle_event(void);
+/* gui_getchar and time(NULL) as seen by the emulated system */
+int replay_getchar(void);
+time_t replay_time(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
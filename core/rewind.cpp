@@ -0,0 +1,417 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <vector>
+
+#include "cpu.h"
+#include "emu.h"
+#include "mem.h"
+#include "mmu.h"
+#include "replay.h"
+#include "rewind.h"
+#include "schedule.h"
+#include "translate.h"
+
+unsigned int rewind_seconds = 0;
+
+// A state every 50 throttle events, twice per emulated second
+#define REWIND_INTERVAL 50
+#define REWIND_STATES_PER_SECOND (100 / REWIND_INTERVAL)
+
+struct rewind_state {
+    uint64_t cputick;
+    std::vector<uint8_t> devices; // CPU, scheduler and peripherals
+    // Pages which changed until the next state, and their contents in this one
+    std::vector<uint32_t> pages;
+    std::vector<uint8_t> undo;
+};
+
+static std::deque<rewind_state> states;
+// Copy of RAM as of states.back()
+static std::vector<uint8_t> shadow;
+static bool tracking, capture_due;
+static unsigned int throttle_events;
+static size_t restore_target = SIZE_MAX;
+
+// Reverse execution in progress, see rewind_reverse_request
+static struct {
+    bool active, to_breakpoint, hit, at_begin;
+    size_t state; // Index of the state the current pass started from
+    uint64_t end_cputick; // Position to go back from
+    uint64_t boundaries; // Instruction boundaries passed in the current pass
+    uint64_t last_hit; // Boundary of the last breakpoint hit
+    uint64_t target; // Boundary to stop at, UINT64_MAX while counting
+} reverse;
+
+// The part of mem_and_flags used by mem_areas
+static size_t rewind_mem_size()
+{
+    size_t size = 0;
+    for(auto &area : mem_areas)
+    {
+        if(area.size)
+            size = std::max(size, size_t(area.ptr - mem_and_flags) + area.size);
+    }
+
+    return (size + RAM_PAGE_SIZE - 1) & ~size_t(RAM_PAGE_SIZE - 1);
+}
+
+static bool page_dirty(size_t page)
+{
+    return !tracking || !(ram_page_flags[page] & RPF_CLEAN_REWIND);
+}
+
+static void start_tracking()
+{
+    tracking = memory_track_writes(mem_and_flags, mem_and_flags + shadow.size(), RPF_CLEAN_REWIND);
+}
+
+void rewind_reset()
+{
+    if(tracking && mem_and_flags)
+        memory_clear_page_flags(RPF_CLEAN_REWIND);
+
+    states.clear();
+    shadow.clear();
+    shadow.shrink_to_fit();
+    tracking = capture_due = false;
+    throttle_events = 0;
+    restore_target = SIZE_MAX;
+    reverse = {};
+}
+
+void rewind_enable(unsigned int seconds)
+{
+    rewind_reset();
+    rewind_seconds = seconds;
+}
+
+void rewind_throttle_event()
+{
+    // A reverse execution restores the same state index more than once
+    if(!rewind_seconds || replay_mode != REPLAY_OFF || reverse.active)
+        return;
+
+    if(throttle_events++ % REWIND_INTERVAL == 0)
+    {
+        capture_due = true;
+        cpu_events_set(EVENT_REWIND);
+    }
+}
+
+static void rewind_capture()
+{
+    // page_dirty looks at RPF_CLEAN_REWIND
+    memory_handle_writes();
+
+    size_t mem_size = rewind_mem_size();
+    if(shadow.size() != mem_size)
+    {
+        // First state or different memory layout
+        rewind_reset();
+        throttle_events = 1;
+        shadow.assign(mem_and_flags, mem_and_flags + mem_size);
+    }
+    else
+    {
+        rewind_state &prev = states.back();
+        for(size_t page = 0; page < mem_size / RAM_PAGE_SIZE; ++page)
+        {
+            if(!page_dirty(page))
+                continue;
+
+            uint8_t *cur = mem_and_flags + page * RAM_PAGE_SIZE, *old = shadow.data() + page * RAM_PAGE_SIZE;
+            if(memcmp(cur, old, RAM_PAGE_SIZE) == 0)
+                continue;
+
+            prev.pages.push_back(page);
+            prev.undo.insert(prev.undo.end(), old, old + RAM_PAGE_SIZE);
+            memcpy(old, cur, RAM_PAGE_SIZE);
+        }
+    }
+
+    snapshot_buffer buffer = {};
+    emu_snapshot snapshot = {};
+    snapshot.buffer = &buffer;
+    if(!cpu_suspend(&snapshot) || !sched_suspend(&snapshot) || !memory_suspend_peripherals(&snapshot))
+    {
+        free(buffer.data);
+        gui_debug_printf("Failed to save rewind state, disabling rewind\n");
+        rewind_enable(0);
+        return;
+    }
+
+    states.emplace_back();
+    states.back().cputick = sched_current_cputick();
+    states.back().devices.assign(buffer.data, buffer.data + buffer.size);
+    free(buffer.data);
+
+    while(states.size() > rewind_seconds * REWIND_STATES_PER_SECOND + 1)
+        states.pop_front();
+
+    start_tracking();
+}
+
+static bool rewind_restore(size_t index)
+{
+    memory_handle_writes();
+
+    // Back to states.back() first, only dirty pages differ from the shadow copy
+    for(size_t page = 0; page < shadow.size() / RAM_PAGE_SIZE; ++page)
+    {
+        uint8_t *cur = mem_and_flags + page * RAM_PAGE_SIZE, *old = shadow.data() + page * RAM_PAGE_SIZE;
+        if(page_dirty(page) && memcmp(cur, old, RAM_PAGE_SIZE) != 0)
+            memcpy(cur, old, RAM_PAGE_SIZE);
+    }
+
+    // Avoid faulting on every page written below
+    memory_clear_page_flags(RPF_WRITE_TRACKED);
+    tracking = false;
+
+    while(states.size() > index + 1)
+    {
+        states.pop_back();
+        rewind_state &state = states.back();
+        for(size_t i = 0; i < state.pages.size(); ++i)
+        {
+            const uint8_t *data = state.undo.data() + i * RAM_PAGE_SIZE;
+            memcpy(mem_and_flags + state.pages[i] * RAM_PAGE_SIZE, data, RAM_PAGE_SIZE);
+            memcpy(shadow.data() + state.pages[i] * RAM_PAGE_SIZE, data, RAM_PAGE_SIZE);
+        }
+
+        state.pages.clear();
+        state.undo.clear();
+    }
+
+    rewind_state &state = states.back();
+    snapshot_buffer buffer = {};
+    buffer.data = state.devices.data();
+    buffer.size = buffer.capacity = state.devices.size();
+    emu_snapshot snapshot = {};
+    snapshot.buffer = &buffer;
+    if(!cpu_resume(&snapshot) || !sched_resume(&snapshot) || !memory_resume_peripherals(&snapshot))
+        return false;
+
+    // RAM got replaced without going through write_action
+    flush_translations();
+    addr_cache_flush();
+
+    start_tracking();
+    throttle_events = 1; // Next state in REWIND_INTERVAL
+    return true;
+}
+
+bool rewind_handle_event()
+{
+    bool capture = capture_due;
+    capture_due = false;
+
+    // A new state could evict the target
+    if(restore_target == SIZE_MAX)
+    {
+        if(capture)
+            rewind_capture();
+        return false;
+    }
+
+    size_t index = restore_target;
+    restore_target = SIZE_MAX;
+    if(index >= states.size())
+        return false;
+
+    uint64_t cputick = sched_current_cputick();
+    if(!rewind_restore(index))
+    {
+        gui_debug_printf("Failed to restore rewind state, disabling rewind\n");
+        rewind_enable(0);
+        return false;
+    }
+
+    cpu_events_clear(EVENT_REWIND);
+    cpu_events_set(EVENT_DEBUG_STEP);
+    if(!reverse.active)
+        gui_debug_printf("Went back %.2f seconds\n", double(cputick - states.back().cputick) / sched.clock_rates[CLOCK_CPU]);
+    return true;
+}
+
+bool rewind_request(double seconds)
+{
+    if(replay_mode != REPLAY_OFF)
+    {
+        gui_debug_printf("Can't rewind while recording or replaying.\n");
+        return false;
+    }
+
+    if(states.empty())
+    {
+        gui_debug_printf(rewind_seconds ? "No state saved yet.\n" : "Rewind is off.\n");
+        return false;
+    }
+
+    uint64_t cputick = sched_current_cputick(),
+             ticks = uint64_t(seconds * sched.clock_rates[CLOCK_CPU]);
+
+    size_t index = 0;
+    for(size_t i = states.size(); i-- > 0;)
+    {
+        if(cputick - states[i].cputick >= ticks)
+        {
+            index = i;
+            break;
+        }
+    }
+
+    restore_target = index;
+    cpu_events_set(EVENT_REWIND);
+    return true;
+}
+
+void rewind_list()
+{
+    if(!rewind_seconds)
+    {
+        gui_debug_printf("Rewind is off.\n");
+        return;
+    }
+
+    uint64_t cputick = sched_current_cputick();
+    size_t total = shadow.size();
+    for(auto &state : states)
+    {
+        gui_debug_printf("%.2fs ago: %zu changed pages\n",
+                         double(cputick - state.cputick) / sched.clock_rates[CLOCK_CPU], state.pages.size());
+        total += state.devices.size() + state.undo.size();
+    }
+
+    gui_debug_printf("%zu states, %zu KiB, %s\n", states.size(), total / 1024,
+                     tracking ? "tracking writes" : "comparing all of RAM");
+}
+
+// Starts a pass from reverse.state with the next EVENT_REWIND
+static void reverse_restart()
+{
+    reverse.boundaries = 0;
+    reverse.hit = false;
+    restore_target = reverse.state;
+    cpu_events_set(EVENT_REWIND);
+}
+
+bool rewind_reverse_request(bool to_breakpoint)
+{
+    if(replay_mode != REPLAY_OFF)
+    {
+        gui_debug_printf("Can't rewind while recording or replaying.\n");
+        return false;
+    }
+
+    if(!rewind_seconds)
+    {
+        gui_debug_printf("Rewind is off, reverse execution needs it.\n");
+        return false;
+    }
+
+    reverse = {};
+    reverse.to_breakpoint = to_breakpoint;
+    reverse.end_cputick = sched_current_cputick();
+
+    size_t index = states.size();
+    while(index > 0 && states[index - 1].cputick >= reverse.end_cputick)
+        --index;
+
+    if(index == 0)
+    {
+        // Already at the oldest state, nothing to do
+        reverse.at_begin = true;
+        return true;
+    }
+
+    reverse.active = true;
+    reverse.state = index - 1;
+    reverse.target = UINT64_MAX;
+    reverse_restart();
+    return true;
+}
+
+bool rewind_reverse_debugger(enum DBG_REASON reason)
+{
+    if(!reverse.active)
+        return false;
+
+    if(reason == DBG_READ_BREAKPOINT || reason == DBG_WRITE_BREAKPOINT)
+    {
+        // Hit by the instruction after the last boundary
+        if(reverse.target == UINT64_MAX && reverse.boundaries > 0)
+        {
+            reverse.hit = true;
+            reverse.last_hit = reverse.boundaries - 1;
+        }
+        return true;
+    }
+
+    // Only single steps mark instruction boundaries
+    if(reason != DBG_EXEC_BREAKPOINT || !(cpu_events & EVENT_DEBUG_STEP))
+        return true;
+
+    uint64_t boundary = reverse.boundaries++;
+    if(reverse.target != UINT64_MAX)
+    {
+        if(boundary < reverse.target)
+            return true;
+
+        reverse.active = false;
+        return false;
+    }
+
+    if(sched_current_cputick() < reverse.end_cputick)
+    {
+        void *ptr = virt_mem_ptr(arm.reg[15] & ~3, 4);
+        if(ptr && (RAM_FLAGS(ptr) & RF_EXEC_BREAKPOINT))
+        {
+            reverse.hit = true;
+            reverse.last_hit = boundary;
+        }
+        return true;
+    }
+
+    /* Reached the position again, boundary is the instruction it was at.
+     * It can be the first one already if the CPU was idle in between. */
+    if(!reverse.to_breakpoint && boundary > 0)
+        reverse.target = boundary - 1;
+    else if(reverse.to_breakpoint && reverse.hit)
+        reverse.target = reverse.last_hit;
+    else if(reverse.state > 0)
+    {
+        // Nothing in this interval, look at the one before
+        reverse.end_cputick = states[reverse.state].cputick;
+        reverse.state--;
+        reverse_restart();
+        return true;
+    }
+    else
+    {
+        reverse.target = 0;
+        reverse.at_begin = true;
+    }
+
+    uint64_t target = reverse.target;
+    reverse_restart();
+    reverse.target = target;
+    return true;
+}
+
+void rewind_reverse_cancel()
+{
+    if(!reverse.active)
+        return;
+
+    reverse.active = false;
+    restore_target = SIZE_MAX;
+}
+
+bool rewind_reverse_at_begin()
+{
+    bool ret = reverse.at_begin;
+    reverse.at_begin = false;
+    return ret;
+}
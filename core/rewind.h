@@ -0,0 +1,62 @@
+/* Declarations for rewind.cpp */
+
+#ifndef _H_REWIND
+#define _H_REWIND
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "debug.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Rewind buffer: every half second of emulated time, the state of the CPU,
+ * the scheduler and the peripherals is kept in memory, together with the
+ * pages of RAM which changed since the previous state. Writes are tracked by
+ * write protecting RAM (memory_track_writes), where that isn't possible all
+ * of RAM gets compared. Going back applies the saved pages in reverse order,
+ * so it only touches what changed in between.
+ *
+ * Not rewound: the contents of the flash, usblink and debugger connections. */
+extern unsigned int rewind_seconds; // 0 if off
+
+/* Sets how many seconds to keep and drops the current buffer */
+void rewind_enable(unsigned int seconds);
+/* Drops the buffer, for when the state got replaced (reset, snapshots) */
+void rewind_reset(void);
+
+/* Called from throttle_interval_event, sets EVENT_REWIND if a state is due */
+void rewind_throttle_event(void);
+/* Handles EVENT_REWIND at an instruction boundary in emu_loop. Returns true
+ * if an older state got restored. Then EVENT_DEBUG_STEP is set as well. */
+bool rewind_handle_event(void);
+
+/* Requests going back to the newest state at least seconds old, or the oldest
+ * available. Happens with the next EVENT_REWIND. */
+bool rewind_request(double seconds);
+/* Prints the available states */
+void rewind_list(void);
+
+/* Reverse execution for the GDB stub: goes back to the newest state before the
+ * current position and single steps forward again in the interpreter, up to the
+ * instruction before it or, with to_breakpoint, to the last breakpoint or
+ * watchpoint hit before it, going through older states if needed. Positions
+ * are compared by cycle count. Returns false if rewind is off. Otherwise the
+ * debugger gets entered again at the target, unless rewind_reverse_at_begin()
+ * says that there is no older state to go back to. */
+bool rewind_reverse_request(bool to_breakpoint);
+/* Called by debugger(), returns true if the entry is part of a reverse
+ * execution in progress and has to be skipped */
+bool rewind_reverse_debugger(enum DBG_REASON reason);
+/* Stops a reverse execution in progress where it is */
+void rewind_reverse_cancel(void);
+/* Whether the last reverse execution ended at the oldest state, clears it */
+bool rewind_reverse_at_begin(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
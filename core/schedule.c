@@ -7,115 +7,207 @@
 
 sched_state sched;
 
-static inline uint32_t muldiv(uint32_t a, uint32_t b, uint32_t c) {
-#if defined(__i386__) || defined(__x86_64__)
-    __asm__ ("mull %1; divl %2" : "+a" (a) : "m" (b), "m" (c) : "edx");
-    return a;
-#else
-    uint64_t d = a;
-    d *= b;
-    return d / c;
-#endif
+/* a * b / c, rounded down or up. Exact as long as the result fits,
+ * which it does for any time until the heat death of the universe. */
+static inline uint64_t muldiv(uint64_t a, uint32_t b, uint32_t c, bool round_up) {
+    uint64_t rem = a % c * b;
+    return a / c * b + (rem + (round_up ? c - 1 : 0)) / c;
+}
+
+static uint64_t ticks_at(enum clock_id clock, uint64_t cputick) {
+    if (cputick == sched.epoch)
+        return 0; // Clock rates might not be set yet during reset
+    return muldiv(cputick - sched.epoch, sched.clock_rates[clock], sched.clock_rates[CLOCK_CPU], false);
+}
+
+// First CPU cycle at which ticks_at reaches tick
+static uint64_t cputick_at(enum clock_id clock, uint64_t tick) {
+    if (tick == 0)
+        return sched.epoch;
+    return sched.epoch + muldiv(tick, sched.clock_rates[CLOCK_CPU], sched.clock_rates[clock], true);
+}
+
+/* The heap is ordered by cputick, then index, so that items due at the same
+ * time always fire in the same order. */
+static bool heap_less(int a, int b) {
+    const struct sched_item *ia = &sched.items[a], *ib = &sched.items[b];
+    return ia->cputick < ib->cputick || (ia->cputick == ib->cputick && a < b);
+}
+
+static void heap_put(int pos, int index) {
+    sched.heap[pos] = index;
+    sched.items[index].heap_pos = pos;
+}
+
+static void heap_sift_up(int pos) {
+    int index = sched.heap[pos];
+    while (pos > 0) {
+        int parent = (pos - 1) / 2;
+        if (!heap_less(index, sched.heap[parent]))
+            break;
+        heap_put(pos, sched.heap[parent]);
+        pos = parent;
+    }
+    heap_put(pos, index);
+}
+
+static void heap_sift_down(int pos) {
+    int index = sched.heap[pos];
+    for (;;) {
+        int child = pos * 2 + 1;
+        if (child >= sched.heap_size)
+            break;
+        if (child + 1 < sched.heap_size && heap_less(sched.heap[child + 1], sched.heap[child]))
+            child++;
+        if (!heap_less(sched.heap[child], index))
+            break;
+        heap_put(pos, sched.heap[child]);
+        pos = child;
+    }
+    heap_put(pos, index);
+}
+
+static void heap_remove(int index) {
+    int pos = sched.items[index].heap_pos;
+    if (pos < 0)
+        return;
+    sched.items[index].heap_pos = -1;
+    int last = sched.heap[--sched.heap_size];
+    if (last == index)
+        return;
+    heap_put(pos, last);
+    heap_sift_up(pos);
+    heap_sift_down(sched.items[last].heap_pos);
+}
+
+// Call after changing the item's tick
+static void item_update(int index) {
+    struct sched_item *item = &sched.items[index];
+    item->cputick = cputick_at(item->clock, item->tick);
+    if (item->heap_pos < 0) {
+        item->heap_pos = sched.heap_size++;
+        sched.heap[item->heap_pos] = index;
+    }
+    heap_sift_up(item->heap_pos);
+    heap_sift_down(item->heap_pos);
 }
 
 void sched_reset(void) {
     const uint32_t def_rates[] = { 0, 0, 0, 27000000, 12000000, 32768 };
+    memset(&sched, 0, sizeof sched);
     memcpy(sched.clock_rates, def_rates, sizeof(def_rates));
-    memset(sched.items, 0, sizeof sched.items);
+    for (int i = 0; i < SCHED_MAX_ITEMS; i++)
+        sched.items[i].heap_pos = -1;
+    sched.num_items = SCHED_NUM_FIXED_ITEMS;
+    sched.next_index = -1;
+    cycle_count_delta = 0;
 }
 
-void event_repeat(int index, uint32_t ticks) {
+void sched_init_item(int index, enum clock_id clock, void (*proc)(int index), bool start) {
     struct sched_item *item = &sched.items[index];
-
-    uint32_t prev = item->tick;
-    item->second = ticks / sched.clock_rates[item->clock];
-    item->tick = ticks % sched.clock_rates[item->clock];
-    if (prev >= sched.clock_rates[item->clock] - item->tick) {
-        item->second++;
-        item->tick -= sched.clock_rates[item->clock];
+    heap_remove(index);
+    item->clock = clock;
+    item->proc = proc;
+    if (start) {
+        item->tick = ticks_at(clock, sched_current_cputick());
+        item_update(index);
     }
-    item->tick += prev;
+}
+
+int sched_register(enum clock_id clock, void (*proc)(int index)) {
+    if (sched.num_items >= SCHED_MAX_ITEMS)
+        error("Too many scheduler items");
+    int index = sched.num_items++;
+    sched_init_item(index, clock, proc, false);
+    return index;
+}
 
-    item->cputick = muldiv(item->tick, sched.clock_rates[CLOCK_CPU], sched.clock_rates[item->clock]);
+void event_repeat(int index, uint32_t ticks) {
+    sched.items[index].tick += ticks;
+    item_update(index);
 }
 
-void sched_update_next_event(uint32_t cputick) {
-    sched.next_cputick = sched.clock_rates[CLOCK_CPU];
+uint64_t sched_current_cputick(void) {
+    return sched.next_cputick + cycle_count_delta;
+}
+
+void sched_update_next_event(uint64_t cputick) {
+    // Keep cycle_count_delta in range by not looking further than a second ahead
+    sched.next_cputick = cputick + sched.clock_rates[CLOCK_CPU];
     sched.next_index = -1;
-    for (int i = 0; i < SCHED_NUM_ITEMS; i++) {
-        struct sched_item *item = &sched.items[i];
-        if (item->proc != NULL && item->second == 0 && item->cputick < sched.next_cputick) {
-            sched.next_cputick = item->cputick;
-            sched.next_index = i;
-        }
+    if (sched.heap_size > 0 && sched.items[sched.heap[0]].cputick < sched.next_cputick) {
+        sched.next_index = sched.heap[0];
+        sched.next_cputick = sched.items[sched.next_index].cputick;
     }
-    //printf("Next event: (%8d,%d)\n", next_cputick, next_index);
-    cycle_count_delta = cputick - sched.next_cputick;
-}
-
-uint32_t sched_process_pending_events() {
-    uint32_t cputick = sched.next_cputick + cycle_count_delta;
-    while (cputick >= sched.next_cputick) {
-        if (sched.next_index < 0) {
-            //printf("[%8d] New second\n", cputick);
-            int i;
-            for (i = 0; i < SCHED_NUM_ITEMS; i++) {
-                if (sched.items[i].second >= 0)
-                    sched.items[i].second--;
-            }
-            cputick -= sched.clock_rates[CLOCK_CPU];
-        } else {
-            //printf("[%8d/%8d] Event %d\n", cputick, next_cputick, next_index);
-            sched.items[sched.next_index].second = -1;
-            sched.items[sched.next_index].proc(sched.next_index);
-        }
-        sched_update_next_event(cputick);
+    //printf("Next event: (%8llu,%d)\n", next_cputick, next_index);
+    cycle_count_delta = (int)(cputick - sched.next_cputick);
+}
+
+uint64_t sched_process_pending_events() {
+    uint64_t cputick = sched_current_cputick();
+    while (sched.heap_size > 0 && sched.items[sched.heap[0]].cputick <= cputick) {
+        int index = sched.heap[0];
+        //printf("[%8llu/%8llu] Event %d\n", cputick, sched.items[index].cputick, index);
+        heap_remove(index);
+        sched.items[index].proc(index);
     }
+    sched_update_next_event(cputick);
     return cputick;
 }
 
 void event_clear(int index) {
-    uint32_t cputick = sched_process_pending_events();
+    uint64_t cputick = sched_process_pending_events();
 
-    sched.items[index].second = -1;
+    heap_remove(index);
 
     sched_update_next_event(cputick);
 }
+
 void event_set(int index, int ticks) {
-    uint32_t cputick = sched_process_pending_events();
+    uint64_t cputick = sched_process_pending_events();
 
     struct sched_item *item = &sched.items[index];
-    item->tick = muldiv(cputick, sched.clock_rates[item->clock], sched.clock_rates[CLOCK_CPU]);
-    event_repeat(index, ticks);
+    item->tick = ticks_at(item->clock, cputick) + ticks;
+    item_update(index);
 
     sched_update_next_event(cputick);
 }
 
 uint32_t event_ticks_remaining(int index) {
-    uint32_t cputick = sched_process_pending_events();
+    uint64_t cputick = sched_process_pending_events();
 
     struct sched_item *item = &sched.items[index];
-    return item->second * sched.clock_rates[item->clock]
-            + item->tick - muldiv(cputick, sched.clock_rates[item->clock], sched.clock_rates[CLOCK_CPU]);
+    if (item->heap_pos < 0)
+        return 0;
+    return item->tick - ticks_at(item->clock, cputick);
+}
+
+void sched_skip_to_next_tick(enum clock_id clock) {
+    uint64_t cputick = sched_current_cputick();
+    uint64_t next_cputick = cputick_at(clock, ticks_at(clock, cputick) + 1);
+    int delta = next_cputick < sched.next_cputick ? (int)(next_cputick - sched.next_cputick) : 0;
+    if (delta > cycle_count_delta)
+        cycle_count_delta = delta;
 }
 
 void sched_set_clocks(int count, uint32_t *new_rates) {
-    uint32_t cputick = sched_process_pending_events();
+    uint64_t cputick = sched_process_pending_events();
 
-    uint32_t remaining[SCHED_NUM_ITEMS];
+    // Ticks already elapsed stay as they are, so start counting anew from here
+    uint64_t remaining[SCHED_MAX_ITEMS];
     int i;
-    for (i = 0; i < SCHED_NUM_ITEMS; i++) {
+    for (i = 0; i < sched.num_items; i++) {
         struct sched_item *item = &sched.items[i];
-        if (item->second >= 0)
-            remaining[i] = event_ticks_remaining(i);
+        if (item->heap_pos >= 0)
+            remaining[i] = item->tick - ticks_at(item->clock, cputick);
     }
-    cputick = muldiv(cputick, new_rates[CLOCK_CPU], sched.clock_rates[CLOCK_CPU]);
     memcpy(sched.clock_rates, new_rates, sizeof(uint32_t) * count);
-    for (i = 0; i < SCHED_NUM_ITEMS; i++) {
+    sched.epoch = cputick;
+    for (i = 0; i < sched.num_items; i++) {
         struct sched_item *item = &sched.items[i];
-        if (item->second >= 0) {
-            item->tick = muldiv(cputick, sched.clock_rates[item->clock], sched.clock_rates[CLOCK_CPU]);
-            event_repeat(i, remaining[i]);
+        if (item->heap_pos >= 0) {
+            item->tick = remaining[i];
+            item_update(i);
         }
     }
 
@@ -128,11 +220,15 @@ bool sched_resume(const emu_snapshot *snapshot)
     if(!snapshot_read(snapshot, &new_sched, sizeof(new_sched)))
         return false;
 
+    // The same items have to be registered in the same order
+    if(new_sched.num_items != sched.num_items)
+        return false;
+
     // sched_item::proc is a function pointer.
     // Obviously, it's not possible to just save and restore that one,
     // so we use the already initialized sched_state as source
     // for the proper proc values.
-    for(int i = 0; i < SCHED_NUM_ITEMS; ++i)
+    for(int i = 0; i < SCHED_MAX_ITEMS; ++i)
     {
         if(new_sched.items[i].proc && !sched.items[i].proc)
             return false; // proc was set, but we don't have it
@@ -141,11 +237,13 @@ bool sched_resume(const emu_snapshot *snapshot)
     }
 
     sched = new_sched;
+    sched_update_next_event(sched.cputick);
 
     return true;
 }
 
 bool sched_suspend(emu_snapshot *snapshot)
 {
+    sched.cputick = sched_current_cputick();
     return snapshot_write(snapshot, &sched, sizeof(sched));
 }
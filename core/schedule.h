@@ -3,52 +3,71 @@
 #ifndef _H_SCHEDULE
 #define _H_SCHEDULE
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 enum clock_id { CLOCK_CPU, CLOCK_AHB, CLOCK_APB, CLOCK_27M, CLOCK_12M, CLOCK_32K };
 
+/* Items used by every model have a fixed index, others get one from
+ * sched_register in their reset proc. */
 enum sched_item_index {
         SCHED_THROTTLE,
         SCHED_KEYPAD,
         SCHED_LCD,
         SCHED_TIMERS,
         SCHED_WATCHDOG,
-        SCHED_NUM_ITEMS
+        SCHED_DMA,
+        SCHED_NUM_FIXED_ITEMS
 };
 
-#define SCHED_CASPLUS_TIMER1 SCHED_KEYPAD
-#define SCHED_CASPLUS_TIMER2 SCHED_LCD
-#define SCHED_CASPLUS_TIMER3 SCHED_TIMERS
+#define SCHED_MAX_ITEMS 32
 
 struct sched_item {
         enum clock_id clock;
-        int second; // -1 = disabled
-        uint32_t tick;
-        uint32_t cputick;
+        int heap_pos; // -1 = disabled
+        uint64_t tick; // Time of the next event, in ticks of clock since sched.epoch
+        uint64_t cputick; // Same in CPU cycles since reset, rounded up
         void (*proc)(int index);
 };
 
+/* Time is counted in CPU cycles since reset. It's sched.next_cputick + cycle_count_delta,
+ * so the CPU loops only have to check whether cycle_count_delta went positive. */
 typedef struct sched_state {
-    struct sched_item items[SCHED_NUM_ITEMS];
+    struct sched_item items[SCHED_MAX_ITEMS];
+    int num_items; // Fixed and registered ones
+    int heap[SCHED_MAX_ITEMS]; // Enabled items, as min-heap by cputick
+    int heap_size;
     uint32_t clock_rates[6];
-    uint32_t next_cputick;
-    int next_index; // -1 if no more events this second
+    uint64_t epoch; // CPU cycle at which all other clocks were at tick 0, moves on clock changes
+    uint64_t cputick; // Only valid in snapshots
+    uint64_t next_cputick;
+    int next_index; // -1 if there's no event before next_cputick
 } sched_state;
 
 extern sched_state sched;
 
 void sched_reset(void);
+/* For reset procs. The item is disabled, or fires right at the start if start is set. */
+void sched_init_item(int index, enum clock_id clock, void (*proc)(int index), bool start);
+/* Same for an item without a fixed index, returns the index */
+int sched_register(enum clock_id clock, void (*proc)(int index));
 typedef struct emu_snapshot emu_snapshot;
 bool sched_resume(const emu_snapshot *snapshot);
 bool sched_suspend(emu_snapshot *snapshot);
+/* Sets the next event to ticks after the previous one. Only valid in the item's proc. */
 void event_repeat(int index, uint32_t ticks);
-void sched_update_next_event(uint32_t cputick);
-uint32_t sched_process_pending_events();
+uint64_t sched_current_cputick(void);
+void sched_update_next_event(uint64_t cputick);
+uint64_t sched_process_pending_events();
 void event_clear(int index);
 void event_set(int index, int ticks);
 uint32_t event_ticks_remaining(int index);
+/* Skips idle cycles up to the next tick of clock, or to the next event if earlier */
+void sched_skip_to_next_tick(enum clock_id clock);
 void sched_set_clocks(int count, uint32_t *new_rates);
 
 #ifdef __cplusplus
@@ -0,0 +1,393 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <zlib.h>
+#ifdef HAVE_LZ4
+    #include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+    #include <zstd.h>
+#endif
+
+#include "emu.h"
+#include "snapshot_file.h"
+#include "os/os.h"
+
+// Set in the size of chunks which are stored uncompressed
+#define CHUNK_STORED 0x80000000u
+
+struct snapshot_file_header {
+    uint32_t sig; // SNAPSHOT_FILE_SIG
+    uint32_t codec;
+    uint32_t chunk_size, chunk_count;
+    uint64_t size; // Of the uncompressed stream
+    // Followed by uint32_t sizes[chunk_count] and the chunks
+};
+
+static const struct {
+    const char *name;
+    snapshot_codec codec;
+    int default_level;
+} codecs[] = {
+    { "store", SNAPSHOT_CODEC_STORE, 0 },
+    { "zlib", SNAPSHOT_CODEC_ZLIB, Z_DEFAULT_COMPRESSION },
+    { "map", SNAPSHOT_CODEC_MAP, 0 },
+#ifdef HAVE_LZ4
+    { "lz4", SNAPSHOT_CODEC_LZ4, 1 }, // The level is the acceleration
+#endif
+#ifdef HAVE_ZSTD
+    { "zstd", SNAPSHOT_CODEC_ZSTD, 3 },
+#endif
+};
+
+static snapshot_codec codec = SNAPSHOT_CODEC_ZLIB;
+static int level = Z_DEFAULT_COMPRESSION;
+
+bool snapshot_codec_set(const char *spec)
+{
+    const char *colon = strchr(spec, ':');
+    size_t len = colon ? size_t(colon - spec) : strlen(spec);
+    for(auto &c : codecs)
+    {
+        if(strlen(c.name) != len || strncmp(c.name, spec, len) != 0)
+            continue;
+
+        codec = c.codec;
+        level = colon ? atoi(colon + 1) : c.default_level;
+        return true;
+    }
+
+    return false;
+}
+
+const char *snapshot_codec_names()
+{
+    static std::string names;
+    if(names.empty())
+    {
+        for(auto &c : codecs)
+            names += (names.empty() ? "" : ", ") + std::string(c.name);
+    }
+
+    return names.c_str();
+}
+
+bool snapshot_codec_mappable()
+{
+    return codec == SNAPSHOT_CODEC_MAP;
+}
+
+static bool codec_supported(uint32_t id)
+{
+    return std::any_of(std::begin(codecs), std::end(codecs), [id](decltype(codecs[0]) &c) { return c.codec == id; });
+}
+
+// Offset of the first chunk in the file
+static uint64_t data_offset(const snapshot_file_header &header)
+{
+    uint64_t offset = sizeof(header) + uint64_t(header.chunk_count) * sizeof(uint32_t);
+    if(header.codec == SNAPSHOT_CODEC_MAP)
+        offset = (offset + SNAPSHOT_MAP_ALIGN - 1) & ~uint64_t(SNAPSHOT_MAP_ALIGN - 1);
+
+    return offset;
+}
+
+// Returns the compressed size, 0 if it doesn't fit into dest_size
+static size_t compress_chunk(uint8_t *dest, size_t dest_size, const uint8_t *src, size_t size)
+{
+    switch(codec)
+    {
+    case SNAPSHOT_CODEC_ZLIB:
+    {
+        uLongf dest_len = dest_size;
+        return compress2(dest, &dest_len, src, size, level) == Z_OK ? dest_len : 0;
+    }
+#ifdef HAVE_LZ4
+    case SNAPSHOT_CODEC_LZ4:
+        return std::max(0, LZ4_compress_fast(reinterpret_cast<const char *>(src), reinterpret_cast<char *>(dest), int(size), int(dest_size), level));
+#endif
+#ifdef HAVE_ZSTD
+    case SNAPSHOT_CODEC_ZSTD:
+    {
+        size_t dest_len = ZSTD_compress(dest, dest_size, src, size, level);
+        return ZSTD_isError(dest_len) ? 0 : dest_len;
+    }
+#endif
+    default:
+        return 0;
+    }
+}
+
+static bool decompress_chunk(uint32_t id, uint8_t *dest, size_t size, const uint8_t *src, size_t src_size)
+{
+    switch(id)
+    {
+    case SNAPSHOT_CODEC_ZLIB:
+    {
+        uLongf dest_len = size;
+        return uncompress(dest, &dest_len, src, src_size) == Z_OK && dest_len == size;
+    }
+#ifdef HAVE_LZ4
+    case SNAPSHOT_CODEC_LZ4:
+        return LZ4_decompress_safe(reinterpret_cast<const char *>(src), reinterpret_cast<char *>(dest), int(src_size), int(size)) == int(size);
+#endif
+#ifdef HAVE_ZSTD
+    case SNAPSHOT_CODEC_ZSTD:
+        return ZSTD_decompress(dest, size, src, src_size) == size;
+#endif
+    default:
+        return false;
+    }
+}
+
+// Calls work(i) for each i < count, spread over all cores
+template <typename F> static bool parallel_for(size_t count, F work)
+{
+    std::atomic<size_t> next(0);
+    std::atomic<bool> ok(true);
+    auto worker = [&] {
+        for(size_t i; ok && (i = next++) < count;)
+        {
+            if(!work(i))
+                ok = false;
+        }
+    };
+
+#ifdef __EMSCRIPTEN__
+    size_t threads = 1;
+#else
+    size_t threads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), count);
+#endif
+    std::vector<std::thread> pool;
+    for(size_t i = 1; i < threads; ++i)
+        pool.emplace_back(worker);
+
+    worker();
+    for(auto &thread : pool)
+        thread.join();
+
+    return ok;
+}
+
+/* Most of the memory in mappable snapshots is zero. Seeking over it leaves
+ * holes in the file, which read as zero without taking up disk space on
+ * most file systems. */
+static bool write_sparse(FILE *fp, const uint8_t *data, size_t size)
+{
+    for(size_t pos = 0; pos < size; pos += SNAPSHOT_MAP_ALIGN)
+    {
+        size_t len = std::min<size_t>(SNAPSHOT_MAP_ALIGN, size - pos);
+        bool zero = std::all_of(data + pos, data + pos + len, [](uint8_t b) { return b == 0; });
+        // The last part has to be written to give the file its size
+        if(zero && pos + len < size)
+        {
+            if(fseek(fp, long(len), SEEK_CUR) != 0)
+                return false;
+        }
+        else if(fwrite(data + pos, 1, len, fp) != len)
+            return false;
+    }
+
+    return true;
+}
+
+bool snapshot_file_write(const char *path, const snapshot_buffer *buffer)
+{
+    snapshot_file_header header = { SNAPSHOT_FILE_SIG, codec, SNAPSHOT_CHUNK_SIZE,
+                                    uint32_t((buffer->size + SNAPSHOT_CHUNK_SIZE - 1) / SNAPSHOT_CHUNK_SIZE), buffer->size };
+    std::vector<uint32_t> sizes(header.chunk_count);
+    std::vector<std::vector<uint8_t>> chunks(header.chunk_count);
+
+    parallel_for(header.chunk_count, [&](size_t i) {
+        const uint8_t *src = buffer->data + i * SNAPSHOT_CHUNK_SIZE;
+        size_t size = std::min<size_t>(SNAPSHOT_CHUNK_SIZE, buffer->size - i * SNAPSHOT_CHUNK_SIZE), compressed = 0;
+        if(codec != SNAPSHOT_CODEC_STORE && codec != SNAPSHOT_CODEC_MAP)
+        {
+            chunks[i].resize(size);
+            compressed = compress_chunk(chunks[i].data(), size - 1, src, size);
+            chunks[i].resize(compressed);
+        }
+
+        sizes[i] = compressed ? uint32_t(compressed) : uint32_t(size) | CHUNK_STORED;
+        return true;
+    });
+
+    std::string tmp_path = std::string(path) + ".tmp";
+    FILE *fp = fopen_utf8(tmp_path.c_str(), "wb");
+    if(!fp)
+        return false;
+
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1
+              && fwrite(sizes.data(), sizeof(uint32_t), sizes.size(), fp) == sizes.size();
+    for(uint64_t pos = sizeof(header) + sizes.size() * sizeof(uint32_t); ok && pos < data_offset(header); ++pos)
+        ok = fputc(0, fp) != EOF;
+    if(codec == SNAPSHOT_CODEC_MAP)
+        ok = ok && write_sparse(fp, buffer->data, buffer->size);
+    for(size_t i = 0; ok && codec != SNAPSHOT_CODEC_MAP && i < header.chunk_count; ++i)
+    {
+        if(sizes[i] & CHUNK_STORED)
+            ok = fwrite(buffer->data + i * SNAPSHOT_CHUNK_SIZE, 1, sizes[i] & ~CHUNK_STORED, fp) == (sizes[i] & ~CHUNK_STORED);
+        else
+            ok = fwrite(chunks[i].data(), 1, sizes[i], fp) == sizes[i];
+    }
+
+    if(fclose(fp) != 0 || !ok)
+    {
+        remove(tmp_path.c_str());
+        return false;
+    }
+
+    #ifdef _WIN32
+        remove(path); // rename doesn't replace files
+    #endif
+    return rename(tmp_path.c_str(), path) == 0;
+}
+
+#ifndef __EMSCRIPTEN__
+// Only accessed by the emulation thread
+static std::thread *writer;
+#endif
+
+void snapshot_file_write_async(const char *path, snapshot_buffer *buffer, emu_suspend_cb done)
+{
+    snapshot_buffer data = *buffer;
+    *buffer = {};
+
+#ifdef __EMSCRIPTEN__
+    bool success = snapshot_file_write(path, &data);
+    free(data.data);
+    done(success);
+#else
+    snapshot_file_wait();
+    writer = new std::thread([data, done](std::string path) mutable {
+        bool success = snapshot_file_write(path.c_str(), &data);
+        free(data.data);
+        done(success);
+    }, std::string(path));
+#endif
+}
+
+void snapshot_file_wait()
+{
+#ifndef __EMSCRIPTEN__
+    if(!writer)
+        return;
+
+    writer->join();
+    delete writer;
+    writer = nullptr;
+#endif
+}
+
+// Maps the whole file instead of reading it, if the host supports that
+static bool snapshot_file_map(const char *path, FILE *fp, const snapshot_file_header &header,
+                              const std::vector<uint32_t> &sizes, snapshot_buffer *buffer)
+{
+    for(size_t i = 0; i < header.chunk_count; ++i)
+    {
+        size_t size = std::min<uint64_t>(header.chunk_size, header.size - i * header.chunk_size);
+        if(sizes[i] != (size | CHUNK_STORED))
+            return false;
+    }
+
+    // Accessing a mapping beyond the end of the file is fatal
+    uint64_t offset = data_offset(header);
+    if(fseek(fp, 0, SEEK_END) != 0 || uint64_t(ftell(fp)) != offset + header.size)
+        return false;
+
+    uint8_t *data = static_cast<uint8_t *>(os_map_file(nullptr, path, 0, offset + header.size));
+    if(!data)
+        return false;
+
+    *buffer = {};
+    buffer->data = data + offset;
+    buffer->size = header.size;
+    buffer->file = path;
+    buffer->file_offset = offset;
+    return true;
+}
+
+bool snapshot_file_read(const char *path, snapshot_buffer *buffer)
+{
+    FILE *fp = fopen_utf8(path, "rb");
+    if(!fp)
+        return false;
+
+    snapshot_file_header header;
+    if(fread(&header, sizeof(header), 1, fp) != 1 || header.sig != SNAPSHOT_FILE_SIG
+       || header.chunk_size == 0 || header.chunk_size > CHUNK_STORED
+       || header.chunk_count != (header.size + header.chunk_size - 1) / header.chunk_size)
+    {
+        gui_debug_printf("Not a snapshot file of this version\n");
+        fclose(fp);
+        return false;
+    }
+
+    if(!codec_supported(header.codec))
+    {
+        gui_debug_printf("Snapshot compressed with a codec not supported by this build\n");
+        fclose(fp);
+        return false;
+    }
+
+    std::vector<uint32_t> sizes(header.chunk_count);
+    std::vector<uint64_t> offsets(header.chunk_count + 1);
+    bool ok = fread(sizes.data(), sizeof(uint32_t), sizes.size(), fp) == sizes.size();
+    for(size_t i = 0; i < header.chunk_count; ++i)
+        offsets[i + 1] = offsets[i] + (sizes[i] & ~CHUNK_STORED);
+
+    if(ok && header.codec == SNAPSHOT_CODEC_MAP && snapshot_file_map(path, fp, header, sizes, buffer))
+    {
+        fclose(fp);
+        return true;
+    }
+
+    std::vector<uint8_t> data;
+    if(ok && fseek(fp, long(data_offset(header)), SEEK_SET) == 0)
+    {
+        data.resize(offsets.back());
+        ok = fread(data.data(), 1, data.size(), fp) == data.size() && fgetc(fp) == EOF;
+    }
+
+    fclose(fp);
+
+    uint8_t *stream = ok ? static_cast<uint8_t *>(malloc(header.size)) : nullptr;
+    ok = stream && parallel_for(header.chunk_count, [&](size_t i) {
+        uint8_t *dest = stream + i * header.chunk_size;
+        size_t size = std::min<uint64_t>(header.chunk_size, header.size - i * header.chunk_size);
+        const uint8_t *src = data.data() + offsets[i];
+        if(!(sizes[i] & CHUNK_STORED))
+            return decompress_chunk(header.codec, dest, size, src, sizes[i]);
+        if((sizes[i] & ~CHUNK_STORED) != size)
+            return false;
+
+        memcpy(dest, src, size);
+        return true;
+    });
+
+    if(!ok)
+    {
+        free(stream);
+        return false;
+    }
+
+    *buffer = {};
+    buffer->data = stream;
+    buffer->size = buffer->capacity = header.size;
+    return true;
+}
+
+void snapshot_file_close(snapshot_buffer *buffer)
+{
+    if(buffer->file)
+        os_unmap_file(buffer->data - buffer->file_offset, buffer->file_offset + buffer->size);
+    else
+        free(buffer->data);
+
+    *buffer = {};
+}
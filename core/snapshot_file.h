@@ -0,0 +1,61 @@
+/* Declarations for snapshot_file.cpp */
+
+#ifndef _H_SNAPSHOT_FILE
+#define _H_SNAPSHOT_FILE
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "emu.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Snapshot files: the stream written by the suspend functions is split into
+ * chunks of SNAPSHOT_CHUNK_SIZE, which get compressed independently on all
+ * cores. A table of the compressed sizes follows the header, so a chunk can
+ * be found without decompressing the ones before it. Chunks which don't get
+ * smaller are stored as they are. */
+#define SNAPSHOT_FILE_SIG 0x43534246 // "FBSC"
+#define SNAPSHOT_CHUNK_SIZE (1024 * 1024)
+
+enum snapshot_codec {
+    SNAPSHOT_CODEC_STORE, // No compression, for local fast resume
+    SNAPSHOT_CODEC_ZLIB,
+    SNAPSHOT_CODEC_LZ4,   // Only if built with HAVE_LZ4
+    SNAPSHOT_CODEC_ZSTD,  // Only if built with HAVE_ZSTD
+    /* No compression, chunks start at a multiple of SNAPSHOT_MAP_ALIGN and
+     * memory is laid out for snapshot_read_map. Resuming maps the file
+     * instead of reading it, so only the pages which get touched are read
+     * and processes resuming the same file share the page cache. */
+    SNAPSHOT_CODEC_MAP,
+};
+
+/* Selects the codec for writing by name, optionally followed by the level:
+ * "store", "zlib", "zlib:9", "lz4", "zstd:3", "map". Reading works with any codec
+ * this build supports. */
+bool snapshot_codec_set(const char *spec);
+/* Names of the codecs this build supports, for help texts */
+const char *snapshot_codec_names(void);
+/* Whether the selected codec is SNAPSHOT_CODEC_MAP */
+bool snapshot_codec_mappable(void);
+
+/* The file gets written under a temporary name first and replaces path once
+ * complete, so an interrupted write doesn't destroy an older snapshot. */
+bool snapshot_file_write(const char *path, const snapshot_buffer *buffer);
+/* Takes over buffer->data and writes it on a background thread, after the
+ * previous background write finished. done is called from that thread. */
+void snapshot_file_write_async(const char *path, snapshot_buffer *buffer, emu_suspend_cb done);
+/* Waits until the background write, if any, is done */
+void snapshot_file_wait(void);
+/* On success, the buffer has to be released with snapshot_file_close. For
+ * SNAPSHOT_CODEC_MAP, path has to stay valid until then. */
+bool snapshot_file_read(const char *path, snapshot_buffer *buffer);
+void snapshot_file_close(snapshot_buffer *buffer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,144 @@
+/* Micro-benchmark for the interrupt controller: int_set plus the lookup of the
+ * current interrupt (classic) or vectored handler (CX). The results are checked
+ * against the straightforward loops over all sources and vectors.
+ *
+ * Build with "make interruptbench" in headless/. */
+
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+#include "cpu.h"
+#include "emu.h"
+#include "interrupt.h"
+#include "mem.h"
+
+// What interrupt.c needs from the rest of the emulator
+struct arm_state arm;
+uint32_t product;
+
+void cpu_int_check() {}
+uint32_t bad_read_word(uint32_t) { abort(); }
+void bad_write_word(uint32_t, uint32_t) { abort(); }
+bool snapshot_read(const emu_snapshot *, void *, int) { return false; }
+bool snapshot_write(emu_snapshot *, const void *, int) { return false; }
+
+static const uint32_t iterations = 20000000;
+
+// Highest priority (lowest value) first, then the lowest number
+static int reference_current_int()
+{
+	uint32_t masked_status = intr.status & intr.mask[0];
+	int current = 0, pri_limit = intr.priority_limit[0];
+	for(int i = 0; i < 32; i++)
+	{
+		if(masked_status & (1u << i) && intr.priority[i] < pri_limit)
+		{
+			current = i;
+			pri_limit = intr.priority[i];
+		}
+	}
+	return current;
+}
+
+// First enabled vector with an active source, otherwise the default handler
+static uint32_t reference_handler()
+{
+	uint32_t active_irqs = intr.active & intr.mask[0] & ~intr.mask[1];
+	for(int i = 0; i < 16; i++)
+	{
+		uint8_t ctrl = intr.irq_ctrl_vect[i];
+		if((ctrl & 0x20) && (active_irqs & (1u << (ctrl & 0x1F))))
+			return intr.irq_addr_vect[i];
+	}
+	return intr.irq_handler_def;
+}
+
+template <typename F> static void measure(const char *name, F f)
+{
+	auto start = std::chrono::steady_clock::now();
+	uint32_t sum = 0;
+	for(uint32_t i = 0; i < iterations; i++)
+		sum += f(i);
+
+	double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+	printf("%-40s %6.2f ns (%08x)\n", name, ns / iterations, sum);
+}
+
+static void classic()
+{
+	product = 0x0E0;
+	int_reset();
+
+	// A few sources with different priorities, like the OS sets them up
+	const uint32_t sources[] = {INT_SERIAL, INT_USB, INT_POWER, INT_KEYPAD, INT_TIMER0, INT_LCD};
+	for(uint32_t i = 0; i < sizeof(sources) / sizeof(*sources); i++)
+	{
+		int_write_word(0xDC000300 + sources[i] * 4, 7 - i);
+		int_write_word(0xDC000008, 1u << sources[i]);
+	}
+
+	// Check all combinations of the sources against the reference
+	for(uint32_t combination = 0; combination < 64; combination++)
+	{
+		for(uint32_t i = 0; i < 6; i++)
+			int_set(sources[i], combination >> i & 1);
+		intr.sticky_status = 0;
+		assert(int_read_word(0xDC000020) == uint32_t(reference_current_int()));
+	}
+
+	for(uint32_t i = 0; i < 6; i++)
+		int_set(sources[i], i & 1);
+
+	measure("classic: int_set + current interrupt", [](uint32_t i) {
+		int_set(INT_TIMER0, i & 1);
+		return int_read_word(0xDC000020);
+	});
+	measure("classic: reference loop", [](uint32_t i) {
+		int_set(INT_TIMER0, i & 1);
+		return uint32_t(reference_current_int());
+	});
+}
+
+static void cx(const char *label, int vectors)
+{
+	product = 0x0F0;
+	int_reset();
+
+	// The timer uses the last of the given vectors, the others use sources without interrupts
+	for(int i = 0; i < vectors; i++)
+	{
+		int_cx_write_word(0xDC000100 + i * 4, 0x1000 + i);
+		int_cx_write_word(0xDC000200 + i * 4, 0x20 | (i == vectors - 1 ? INT_TIMER0 : (20 + i) & 0x1F));
+	}
+	int_cx_write_word(0xDC000034, 0x2000);
+	int_cx_write_word(0xDC000010, 1u << INT_TIMER0 | 1u << INT_KEYPAD | 1u << INT_USB);
+	int_set(INT_KEYPAD, true);
+
+	for(int on = 0; on < 2; on++)
+	{
+		int_set(INT_TIMER0, on);
+		assert(int_cx_read_word(0xDC000030) == reference_handler());
+	}
+
+	char name[64];
+	snprintf(name, sizeof(name), "cx, %s: int_set + handler", label);
+	measure(name, [](uint32_t i) {
+		int_set(INT_TIMER0, i & 1);
+		return int_cx_read_word(0xDC000030);
+	});
+	snprintf(name, sizeof(name), "cx, %s: reference loop", label);
+	measure(name, [](uint32_t i) {
+		int_set(INT_TIMER0, i & 1);
+		return reference_handler();
+	});
+}
+
+int main()
+{
+	classic();
+	cx("vector 3", 4);
+	cx("vector 15", 16);
+	cx("default handler", 0);
+}
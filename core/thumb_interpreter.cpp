@@ -1,5 +1,6 @@
 #include "asmcode.h"
 #include "cpu.h"
+#include "cycles.h"
 #include "debug.h"
 #include "emu.h"
 #include "mem.h"
@@ -101,7 +102,7 @@ void cpu_thumb_loop() {
         }
 
         arm.reg[15] += 2;
-        cycle_count_delta++;
+        cycle_count_delta += thumb_insn_cycles(insn);
 
 #define CASE_x2(base) case base: case base+1
 #define CASE_x4(base) CASE_x2(base): CASE_x2(base+2)
@@ -4,6 +4,7 @@
 #define _H_TRANSLATE
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -11,7 +12,7 @@ extern "C" {
 #endif
 
 struct translation {
-    uintptr_t unused;
+    uint32_t *cycles; // See cycles_fill_block, indexed like jump_table
     void** jump_table;
     uint32_t *start_ptr;
     uint32_t *end_ptr;
@@ -24,6 +25,11 @@ void translate_deinit();
 void translate(uint32_t start_pc, uint32_t *insnp);
 void flush_translations();
 void invalidate_translation(int index);
+// Invalidates all translations of code in page page of RAM (see RAM_PAGE_SIZE)
+void invalidate_page_translations(size_t page);
+/* Whether the emulation thread is in translated code. Only reads a variable,
+ * so signal handlers can use it. */
+bool translation_active();
 void translate_fix_pc();
 
 #ifdef __cplusplus
@@ -20,9 +20,11 @@
  */
 #include <cassert>
 #include <cstdint>
+#include <cstring>
 
 #include "asmcode.h"
 #include "cpudefs.h"
+#include "cycles.h"
 #include "emu.h"
 #include "translate.h"
 #include "mem.h"
@@ -76,8 +78,32 @@ uint32_t *translate_buffer = nullptr,
 struct translation translation_table[MAX_TRANSLATIONS];
 uint32_t *jump_table[MAX_TRANSLATIONS*2],
          **jump_table_current = jump_table;
+// Parallel to jump_table
+static uint32_t cycles_table[MAX_TRANSLATIONS*2];
 static unsigned int next_translation_index = 0;
 
+/* Translations jump into each other directly with translation_jmp, so when one
+   gets invalidated, the ones jumping into it have to go as well. For each
+   translation, first_link has a list of them through links. Entries in both
+   are index + 1, so that 0 ends a list. */
+struct translation_link {
+	unsigned int from, next;
+};
+static translation_link links[MAX_TRANSLATIONS*2];
+static unsigned int first_link[MAX_TRANSLATIONS], next_link = 0;
+// A translation covers at most 0x400 bytes and links once per instruction and at the end
+#define MAX_LINKS_PER_TRANSLATION (0x400/4 + 1)
+// Translations by the RAM page they are in, as lists through next_in_page, like links
+static unsigned int page_translations[MEM_MAXSIZE / RAM_PAGE_SIZE], next_in_page[MAX_TRANSLATIONS];
+static bool translation_valid[MAX_TRANSLATIONS];
+
+// Notes that the translation being done jumps directly into translation index
+static void add_link(unsigned int index)
+{
+	links[next_link] = {next_translation_index, first_link[index]};
+	first_link[index] = ++next_link;
+}
+
 static void emit(const uint32_t instruction)
 {
 	*translate_current++ = instruction;
@@ -222,9 +248,13 @@ void translate_deinit()
 
 void translate(uint32_t pc_start, uint32_t *insn_ptr_start)
 {
-	if(next_translation_index >= MAX_TRANSLATIONS)
+	// Invalidated translations aren't freed, start over once full
+	if(next_translation_index >= MAX_TRANSLATIONS
+	   || next_link + MAX_LINKS_PER_TRANSLATION > sizeof(links)/sizeof(*links)
+	   || size_t((translate_current + 0x100) - translate_buffer) > (INSN_BUFFER_SIZE/sizeof(*translate_buffer)))
 	{
-		warn("Out of translation slots!");
+		gui_debug_printf("Out of translation space!");
+		flush_translations();
 		return;
 	}
 
@@ -250,6 +280,7 @@ void translate(uint32_t pc_start, uint32_t *insn_ptr_start)
 	// We know this already. end_ptr will be set after the loop
 	this_translation->jump_table = reinterpret_cast<void**>(jump_table_start);
 	this_translation->start_ptr = insn_ptr_start;
+	first_link[next_translation_index] = 0;
 
 	while(1)
 	{
@@ -743,6 +774,7 @@ void translate(uint32_t pc_start, uint32_t *insn_ptr_start)
 				// Get address of translated code to jump to it
 				translation *target_translation = &translation_table[RAM_FLAGS(ptr) >> RFS_TRANSLATION_INDEX];
 				uintptr_t jmp_target = reinterpret_cast<uintptr_t>(target_translation->jump_table[ptr - target_translation->start_ptr]);
+				add_link(RAM_FLAGS(ptr) >> RFS_TRANSLATION_INDEX);
 
 				// Update PC manually
 				emit_mov_imm(W0, addr);
@@ -774,6 +806,7 @@ void translate(uint32_t pc_start, uint32_t *insn_ptr_start)
 	// Throw away partial translation
 	translate_current = *jump_table_current;
 	RAM_FLAGS(insn_ptr) |= RF_CODE_NO_TRANSLATE;
+	RAM_PAGE_FLAGS(insn_ptr) |= RPF_CODE;
 
 	exit_translation:
 
@@ -812,6 +845,7 @@ void translate(uint32_t pc_start, uint32_t *insn_ptr_start)
 			// Get address of translated code to jump to it
 			translation *target_translation = &translation_table[RAM_FLAGS(ptr) >> RFS_TRANSLATION_INDEX];
 			uintptr_t jmp_target = reinterpret_cast<uintptr_t>(target_translation->jump_table[ptr - target_translation->start_ptr]);
+			add_link(RAM_FLAGS(ptr) >> RFS_TRANSLATION_INDEX);
 
 			// Update PC manually
 			emit_mov_imm(W0, pc);
@@ -827,7 +861,16 @@ void translate(uint32_t pc_start, uint32_t *insn_ptr_start)
 	literalpool_fill();
 
 	this_translation->end_ptr = insn_ptr;
-	this_translation->unused = reinterpret_cast<uintptr_t>(translate_current);
+	this_translation->cycles = &cycles_table[jump_table_start - jump_table];
+	cycles_fill_block(this_translation->cycles, insn_ptr_start, insn_ptr);
+	memory_mark_pages(insn_ptr_start, insn_ptr, RPF_TRANSLATED);
+	// The store path doesn't call write_action
+	memory_protect_code(insn_ptr_start, insn_ptr);
+
+	unsigned int page = (reinterpret_cast<uint8_t*>(insn_ptr_start) - mem_and_flags) / RAM_PAGE_SIZE;
+	next_in_page[next_translation_index] = page_translations[page];
+	page_translations[page] = next_translation_index + 1;
+	translation_valid[next_translation_index] = true;
 
 	next_translation_index += 1;
 
@@ -843,14 +886,6 @@ void translate(uint32_t pc_start, uint32_t *insn_ptr_start)
 
 static void _invalidate_translation(int index)
 {
-	/* Disabled for now. write_action not called in asmcode_aarch64.S so this can't happen
-	   and translation_pc_ptr is inaccurate due to translation_jmp anyway.
-
-	uint32_t flags = RAM_FLAGS(translation_pc_ptr);
-	if ((flags & RF_CODE_TRANSLATED) && (int)(flags >> RFS_TRANSLATION_INDEX) == index)
-		error("Cannot modify currently executing code block.");
-	*/
-
 	uint32_t *start = translation_table[index].start_ptr;
 	uint32_t *end   = translation_table[index].end_ptr;
 	for (; start < end; start++)
@@ -862,21 +897,63 @@ void flush_translations()
 	for(unsigned int index = 0; index < next_translation_index; index++)
 		_invalidate_translation(index);
 
+	memory_clear_page_flags(RPF_TRANSLATED | RPF_WRITE_PROTECTED);
+	memset(page_translations, 0, sizeof(page_translations));
+	memset(translation_valid, 0, sizeof(translation_valid));
 	next_translation_index = 0;
+	next_link = 0;
 	translate_current = translate_buffer;
 	jump_table_current = jump_table;
 }
 
 void invalidate_translation(int index)
 {
-	/* Due to translation_jmp using absolute pointers in the JIT, we can't just
-	   invalidate a single translation. */
-	#ifdef SUPPORT_LINUX
-		(void) index;
-		flush_translations();
-	#else
-		_invalidate_translation(index);
-	#endif
+	/* arm.reg[15] is where the translation was entered, as translation_jmp
+	   only happens after it got updated. */
+	if(translation_sp)
+	{
+		const uint32_t *insnp = reinterpret_cast<uint32_t*>(try_ptr(arm.reg[15]));
+		if(insnp && (RAM_FLAGS(insnp) & RF_CODE_TRANSLATED) && int(RAM_FLAGS(insnp) >> RFS_TRANSLATION_INDEX) == index)
+			error("Cannot modify currently executing code block.");
+	}
+
+	if(!translation_valid[index])
+		return;
+
+	// Each translation is only put onto the list once
+	static unsigned int worklist[MAX_TRANSLATIONS];
+	unsigned int count = 0;
+	translation_valid[index] = false;
+	worklist[count++] = index;
+
+	while(count)
+	{
+		unsigned int current = worklist[--count];
+		_invalidate_translation(current);
+
+		for(unsigned int link = first_link[current]; link; link = links[link - 1].next)
+		{
+			unsigned int from = links[link - 1].from;
+			if(!translation_valid[from])
+				continue;
+
+			translation_valid[from] = false;
+			worklist[count++] = from;
+		}
+	}
+}
+
+void invalidate_page_translations(size_t page)
+{
+	for(unsigned int entry = page_translations[page]; entry; entry = next_in_page[entry - 1])
+		invalidate_translation(entry - 1);
+
+	page_translations[page] = 0;
+}
+
+bool translation_active()
+{
+	return translation_sp != nullptr;
 }
 
 void translate_fix_pc()
@@ -901,7 +978,7 @@ void translate_fix_pc()
 	for(unsigned int i = jump_index; ret_pc > translation_table[index].jump_table[i] && i < translation_insts; ++i)
 		arm.reg[15] += 4;
 
-	cycle_count_delta -= translation_table[index].end_ptr - insnp;
+	cycle_count_delta -= translation_table[index].cycles[jump_index];
 	translation_sp = nullptr;
 
 	assert(!(arm.cpsr_low28 & 0x20));
@@ -1,10 +1,12 @@
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "os/os.h"
 #include "emu.h"
 #include "mem.h"
 #include "cpu.h"
+#include "cycles.h"
 #include "asmcode.h"
 #include "translate.h"
 #include "debug.h"
@@ -23,8 +25,17 @@ uint8_t *insn_buffer = NULL;
 uint8_t *insn_bufptr = NULL;
 static uint8_t *jtbl_buffer[500000];
 static uint8_t **jtbl_bufptr = jtbl_buffer;
+// Parallel to jtbl_buffer
+static uint32_t cycles_buffer[sizeof jtbl_buffer / sizeof *jtbl_buffer];
 static uint8_t *out;
 static uint8_t **outj;
+/* Translations by the RAM page they are in, as lists through next_in_page.
+ * Entries are index + 1, so that 0 ends a list. */
+static int page_translations[MEM_MAXSIZE / RAM_PAGE_SIZE];
+static int next_in_page[MAX_TRANSLATIONS];
+
+// A translation covers at most 0x400 bytes of ARM code
+#define MAX_TRANSLATION_INSNS (0x400 / 4)
 
 enum x86_reg { EAX, ECX, EDX, EBX, ESP, EBP, ESI, EDI };
 enum x86_reg8 { AL, CL, DL, BL, AH, CH, DH, BH };
@@ -253,14 +264,17 @@ void translate_deinit()
 }
 
 void translate(uint32_t start_pc, uint32_t *start_insnp) {
+    // Invalidated translations aren't freed, start over once full
+    if (next_index >= MAX_TRANSLATIONS
+        || insn_bufptr >= &insn_buffer[INSN_BUFFER_SIZE - MAX_TRANSLATION_INSNS * 1000]
+        || jtbl_bufptr + MAX_TRANSLATION_INSNS > &jtbl_buffer[sizeof jtbl_buffer / sizeof *jtbl_buffer])
+        flush_translations();
+
     out = insn_bufptr;
     outj = jtbl_bufptr;
     uint32_t pc = start_pc;
     uint32_t *insnp = start_insnp;
 
-    if (next_index >= MAX_TRANSLATIONS)
-        error("too many translations");
-
     uint8_t *insn_start;
     int stop_here = 0;
     while (1) {
@@ -938,6 +952,7 @@ data_proc_done:
 unimpl:
     out = insn_start;
     RAM_FLAGS(insnp) |= RF_CODE_NO_TRANSLATE;
+    RAM_PAGE_FLAGS(insnp) |= RPF_CODE;
 branch_conditional:
     emit_mov_x86reg_immediate(EAX, pc);
     emit_jump((uint32_t)translation_next);
@@ -950,6 +965,14 @@ branch_unconditional:
     translation_table[index].jump_table = (void**) ((uint32_t)jtbl_bufptr - (uint32_t)start_insnp);
     translation_table[index].start_ptr  = start_insnp;
     translation_table[index].end_ptr    = insnp;
+    uint32_t *cycles = &cycles_buffer[jtbl_bufptr - jtbl_buffer];
+    cycles_fill_block(cycles, start_insnp, insnp);
+    translation_table[index].cycles     = (uint32_t*) ((uint32_t)cycles - (uint32_t)start_insnp);
+    memory_mark_pages(start_insnp, insnp, RPF_TRANSLATED);
+
+    size_t page = ((uint8_t *)start_insnp - mem_and_flags) / RAM_PAGE_SIZE;
+    next_in_page[index] = page_translations[page];
+    page_translations[page] = index + 1;
 
     insn_bufptr = out;
     jtbl_bufptr = outj;
@@ -965,6 +988,8 @@ void flush_translations() {
         for (; start < end; start++)
             RAM_FLAGS(start) &= ~(RF_CODE_TRANSLATED | (~0u << RFS_TRANSLATION_INDEX));
     }
+    memory_clear_page_flags(RPF_TRANSLATED);
+    memset(page_translations, 0, sizeof(page_translations));
     next_index = 0;
     insn_bufptr = insn_buffer;
     jtbl_bufptr = jtbl_buffer;
@@ -976,7 +1001,25 @@ void invalidate_translation(int index) {
         if ((flags & RF_CODE_TRANSLATED) && (int)(flags >> RFS_TRANSLATION_INDEX) == index)
             error("Cannot modify currently executing code block.");
     }
-    flush_translations();
+
+    // Translations don't jump into each other directly, so others stay valid
+    uint32_t *start = translation_table[index].start_ptr;
+    uint32_t *end   = translation_table[index].end_ptr;
+    for (; start < end; start++) {
+        if ((RAM_FLAGS(start) & RF_CODE_TRANSLATED) && (int)(RAM_FLAGS(start) >> RFS_TRANSLATION_INDEX) == index)
+            RAM_FLAGS(start) &= ~(RF_CODE_TRANSLATED | (~0u << RFS_TRANSLATION_INDEX));
+    }
+}
+
+void invalidate_page_translations(size_t page) {
+    for (int entry = page_translations[page]; entry; entry = next_in_page[entry - 1])
+        invalidate_translation(entry - 1);
+
+    page_translations[page] = 0;
+}
+
+bool translation_active() {
+    return in_translation_esp != NULL;
 }
 
 void translate_fix_pc() {
@@ -997,7 +1040,7 @@ void translate_fix_pc() {
             break;
     }
     arm.reg[15] += (uint32_t)start - (uint32_t)insnp;
-    cycle_count_delta -= ((uint32_t)end - (uint32_t)insnp) >> 2;
+    cycle_count_delta -= *(uint32_t *)((uintptr_t)(translation_table[index].cycles) + (uint32_t)insnp);
     in_translation_esp = NULL;
 }
 
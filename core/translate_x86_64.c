@@ -1,8 +1,10 @@
 #include <assert.h>
+#include <string.h>
 
 #include "emu.h"
 #include "mem.h"
 #include "cpu.h"
+#include "cycles.h"
 #include "asmcode.h"
 #include "translate.h"
 #include "debug.h"
@@ -22,8 +24,17 @@ uint8_t *insn_buffer = NULL;
 uint8_t *insn_bufptr = NULL;
 static uint8_t *jtbl_buffer[500000];
 static uint8_t **jtbl_bufptr = jtbl_buffer;
+// Parallel to jtbl_buffer
+static uint32_t cycles_buffer[sizeof jtbl_buffer / sizeof *jtbl_buffer];
 static uint8_t *out;
 static uint8_t **outj;
+/* Translations by the RAM page they are in, as lists through next_in_page.
+ * Entries are index + 1, so that 0 ends a list. */
+static int page_translations[MEM_MAXSIZE / RAM_PAGE_SIZE];
+static int next_in_page[MAX_TRANSLATIONS];
+
+// A translation covers at most 0x400 bytes of ARM code
+#define MAX_TRANSLATION_INSNS (0x400 / 4)
 
 #define REG_ARG1 EDI
 #define REG_ARG2 ESI
@@ -346,14 +357,17 @@ void translate_deinit()
 }
 
 void translate(uint32_t start_pc, uint32_t *start_insnp) {
+    // Invalidated translations aren't freed, start over once full
+    if (next_index >= MAX_TRANSLATIONS
+        || insn_bufptr >= &insn_buffer[INSN_BUFFER_SIZE - MAX_TRANSLATION_INSNS * 1000 - GOT_SIZE]
+        || jtbl_bufptr + MAX_TRANSLATION_INSNS > &jtbl_buffer[sizeof jtbl_buffer / sizeof *jtbl_buffer])
+        flush_translations();
+
     out = insn_bufptr;
     outj = jtbl_bufptr;
     uint32_t pc = start_pc;
     uint32_t *insnp = start_insnp;
 
-    if (next_index >= MAX_TRANSLATIONS)
-        error("too many translations");
-
     uint8_t *insn_start;
     int stop_here = 0;
     while (1) {
@@ -1033,6 +1047,7 @@ data_proc_done:
 unimpl:
     out = insn_start;
     RAM_FLAGS(insnp) |= RF_CODE_NO_TRANSLATE;
+    RAM_PAGE_FLAGS(insnp) |= RPF_CODE;
 branch_conditional:
     emit_mov_x86reg_immediate(EAX, pc);
     emit_jump((uintptr_t)translation_next);
@@ -1048,6 +1063,13 @@ branch_unconditional:
     translation_table[index].jump_table = (void**) jtbl_bufptr;
     translation_table[index].start_ptr  = start_insnp;
     translation_table[index].end_ptr    = insnp;
+    translation_table[index].cycles     = &cycles_buffer[jtbl_bufptr - jtbl_buffer];
+    cycles_fill_block(translation_table[index].cycles, start_insnp, insnp);
+    memory_mark_pages(start_insnp, insnp, RPF_TRANSLATED);
+
+    size_t page = ((uint8_t *)start_insnp - mem_and_flags) / RAM_PAGE_SIZE;
+    next_in_page[index] = page_translations[page];
+    page_translations[page] = index + 1;
 
     insn_bufptr = out;
     jtbl_bufptr = outj;
@@ -1061,6 +1083,8 @@ void flush_translations() {
         for (; start < end; start++)
             RAM_FLAGS(start) &= ~(RF_CODE_TRANSLATED | (~0u << RFS_TRANSLATION_INDEX));
     }
+    memory_clear_page_flags(RPF_TRANSLATED);
+    memset(page_translations, 0, sizeof(page_translations));
     next_index = 0;
     insn_bufptr = insn_buffer;
     jtbl_bufptr = jtbl_buffer;
@@ -1072,7 +1096,25 @@ void invalidate_translation(int index) {
         if ((flags & RF_CODE_TRANSLATED) && (int)(flags >> RFS_TRANSLATION_INDEX) == index)
             error("Cannot modify currently executing code block.");
     }
-    flush_translations();
+
+    // Translations don't jump into each other directly, so others stay valid
+    uint32_t *start = translation_table[index].start_ptr;
+    uint32_t *end   = translation_table[index].end_ptr;
+    for (; start < end; start++) {
+        if ((RAM_FLAGS(start) & RF_CODE_TRANSLATED) && (int)(RAM_FLAGS(start) >> RFS_TRANSLATION_INDEX) == index)
+            RAM_FLAGS(start) &= ~(RF_CODE_TRANSLATED | (~0u << RFS_TRANSLATION_INDEX));
+    }
+}
+
+void invalidate_page_translations(size_t page) {
+    for (int entry = page_translations[page]; entry; entry = next_in_page[entry - 1])
+        invalidate_translation(entry - 1);
+
+    page_translations[page] = 0;
+}
+
+bool translation_active() {
+    return in_translation_rsp != NULL;
 }
 
 void translate_fix_pc() {
@@ -1095,7 +1137,7 @@ void translate_fix_pc() {
     for(unsigned int i = 0; ret_eip > translation_table[index].jump_table[i] && i < translation_insts; ++i)
         arm.reg[15] += 4;
 
-    cycle_count_delta -= ((uintptr_t)translation_table[index].end_ptr - (uintptr_t)insnp) >> 2;
+    cycle_count_delta -= translation_table[index].cycles[insnp - translation_table[index].start_ptr];
     in_translation_rsp = NULL;
 
     assert(!(arm.cpsr_low28 & 0x20));
@@ -6,6 +6,7 @@
 #include "usblink.h"
 #include "interrupt.h"
 #include "mem.h"
+#include "replay.h"
 
 extern void usblink_receive(int ep, uint8_t *buf, uint32_t size);
 extern void usblink_complete_send(int ep);
@@ -226,6 +227,7 @@ void usb_write_word(uint32_t addr, uint32_t value) {
                     usb_prime(qh, 1 << ep);
 
                     usblink_complete_send(ep);
+                    replay_usb_sync();
                 }
                 if (value & (0x10000 << ep)) {
                     //printf("Priming endpoint %d for transmit\n", ep);
@@ -239,6 +241,7 @@ void usb_write_word(uint32_t addr, uint32_t value) {
                         uint32_t size = qh->overlay.flags >> 16 & 0x7FFF;
                         uint8_t *buf = (uint8_t*)(intptr_t)phys_mem_ptr(qh->overlay.bufptr[0], size);
                         usblink_receive(ep, buf, size);
+                        replay_usb_sync();
 
                         usb_complete(qh, 0x10000 << ep, size);
                     } while(!(qh->overlay.next_td & 1));
@@ -39,6 +39,11 @@ uint8_t usb_read_byte(uint32_t addr);
 uint16_t usb_read_half(uint32_t addr);
 uint32_t usb_read_word(uint32_t addr);
 void usb_write_word(uint32_t addr, uint32_t value);
+// Host side of the bus, used by usblink through replay_usb_input
+void usb_bus_reset_on(void);
+void usb_bus_reset_off(void);
+void usb_receive_setup_packet(int endpoint, const void *packet);
+void usb_receive_packet(int endpoint, const void *packet, uint32_t size);
 
 #ifdef __cplusplus
 }
@@ -4,6 +4,7 @@
 #include "emu.h"
 #include "interrupt.h"
 #include "mem.h"
+#include "replay.h"
 #include "usb.h"
 #include "usb_cx2.h"
 #include "usblink_cx2.h"
@@ -109,13 +110,12 @@ static void usb_cx2_packet_from_calc(uint8_t ep, uint8_t *packet, size_t size) {
   if (ep != 1 && ep != 0) // Allow EP0 too?
     error("Got packet on unknown EP");
 
-  if (USBIPServer::instance().isRunning()) {
+  if (USBIPServer::instance().isRunning())
     USBIPServer::instance().onPacketFromCalc(ep, packet, size);
-    return;
-  }
-
-  if (!usblink_cx2_handle_packet(packet, size))
+  else if (!usblink_cx2_handle_packet(packet, size))
     warn("Packet not handled");
+
+  replay_usb_sync();
 }
 
 void usb_cx2_reset() {
@@ -1,6 +1,7 @@
 #include "usbip_server.h"
 #include "debug.h"
 #include "emu.h"
+#include "replay.h"
 #include "usb_cx2.h"
 
 #ifdef _WIN32
@@ -98,17 +99,17 @@ void USBIPServer::start() {
   m_serverThread = std::thread(&USBIPServer::serverLoop, this);
 
   // Pulse reset to trigger enumeration in the emulated OS
-  usb_cx2_set_present(true);
+  replay_usb_input_async(REPLAY_USB_RESET_ON, 0, nullptr, 0);
   std::thread([]() {
     std::this_thread::sleep_for(std::chrono::milliseconds(100));
-    usb_cx2_set_present(false);
+    replay_usb_input_async(REPLAY_USB_RESET_OFF, 0, nullptr, 0);
   }).detach();
 
   LOG("Server started on port 3240");
 }
 
 void USBIPServer::stop() {
-  usb_cx2_set_present(false);
+  replay_usb_input_async(REPLAY_USB_RESET_OFF, 0, nullptr, 0);
   m_running = false;
 
   if (m_serverSock != -1) {
@@ -181,9 +182,9 @@ void USBIPServer::serverLoop() {
     }
 
     // Pulse USB reset so the OS sees a fresh connection
-    usb_cx2_bus_reset_on();
+    replay_usb_input_async(REPLAY_USB_RESET_ON, 0, nullptr, 0);
     std::this_thread::sleep_for(std::chrono::milliseconds(50));
-    usb_cx2_bus_reset_off();
+    replay_usb_input_async(REPLAY_USB_RESET_OFF, 0, nullptr, 0);
 
     clientHandler(clientSock);
 
@@ -409,15 +410,15 @@ void USBIPServer::handleCmdSubmit(int sock, const uint8_t *header) {
 
   if (ep == 0) {
     if (dir == 0) { // OUT
-      usb_cx2_receive_setup_packet((const usb_setup *)cmd->setup);
+      replay_usb_input_async(REPLAY_USB_SETUP, 0, cmd->setup, sizeof(cmd->setup));
       if (len > 0) {
         std::vector<uint8_t> data(len);
         recv(sock, data.data(), len, MSG_WAITALL);
-        usb_cx2_packet_to_calc(0, data.data(), len);
+        replay_usb_input_async(REPLAY_USB_PACKET, 0, data.data(), len);
       }
       sendRetSubmit(sock, seq, 0, dir, ep, 0, len, nullptr);
     } else { // IN
-      usb_cx2_receive_setup_packet((const usb_setup *)cmd->setup);
+      replay_usb_input_async(REPLAY_USB_SETUP, 0, cmd->setup, sizeof(cmd->setup));
 
       // Queue request for data
       std::lock_guard<std::mutex> lock(m_queueMutex);
@@ -431,7 +432,7 @@ void USBIPServer::handleCmdSubmit(int sock, const uint8_t *header) {
     if (dir == 0) { // OUT
       std::vector<uint8_t> data(len);
       recv(sock, data.data(), len, MSG_WAITALL);
-      usb_cx2_packet_to_calc(ep, data.data(), len);
+      replay_usb_input_async(REPLAY_USB_PACKET, ep, data.data(), len);
       sendRetSubmit(sock, seq, 0, dir, ep, 0, len, nullptr);
     } else { // IN
       std::lock_guard<std::mutex> lock(m_queueMutex);
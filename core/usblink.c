@@ -7,6 +7,7 @@
 
 #include "emu.h"
 #include "os/os.h"
+#include "replay.h"
 #include "usb.h"
 #include "usb_cx2.h"
 #include "usblink.h"
@@ -757,11 +758,6 @@ void usblink_delete(const char *path, bool is_dir, usblink_progress_cb callback,
 bool usblink_sending, usblink_connected = false;
 int usblink_state;
 
-extern void usb_bus_reset_on(void);
-extern void usb_bus_reset_off(void);
-extern void usb_receive_setup_packet(int endpoint, void *packet);
-extern void usb_receive_packet(int endpoint, void *packet, uint32_t size);
-
 void usblink_reset() {
   if (put_file_state) {
     put_file_state = 0;
@@ -788,23 +784,15 @@ void usblink_connect() {
 void usblink_timer() {
   switch (usblink_state) {
   case 1:
-    if (emulate_cx2)
-      usb_cx2_bus_reset_on();
-    else
-      usb_bus_reset_on();
+    replay_usb_input(REPLAY_USB_RESET_ON, 0, NULL, 0);
 
     usblink_state++;
     break;
   case 2: {
     // printf("Sending SET_ADDRESS\n");
     struct usb_setup packet = {0, 5, 1, 0, 0};
-    if (emulate_cx2) {
-      usb_cx2_bus_reset_off();
-      usb_cx2_receive_setup_packet(&packet);
-    } else {
-      usb_bus_reset_off();
-      usb_receive_setup_packet(0, &packet);
-    }
+    replay_usb_input(REPLAY_USB_RESET_OFF, 0, NULL, 0);
+    replay_usb_input(REPLAY_USB_SETUP, 0, &packet, sizeof(packet));
 
     usblink_state++;
     break;
@@ -818,7 +806,7 @@ void usblink_receive(int ep, void *buf, uint32_t size) {
     if (usblink_state == 3) {
       // printf("Sent SET_ADDRESS, sending SET_CONFIGURATION\n");
       struct usb_setup packet = {0, 9, 1, 0, 0};
-      usb_receive_setup_packet(0, &packet);
+      replay_usb_input(REPLAY_USB_SETUP, 0, &packet, sizeof(packet));
       usblink_state = 0;
     }
   } else {
@@ -830,7 +818,7 @@ void usblink_receive(int ep, void *buf, uint32_t size) {
 void usblink_complete_send(int ep) {
   if (ep != 0 && usblink_sending) {
     uint32_t size = 16 + usblink_send_buffer.data_size;
-    usb_receive_packet(ep, &usblink_send_buffer, size);
+    replay_usb_input(REPLAY_USB_PACKET, ep, &usblink_send_buffer, size);
     usblink_sending = false;
     // printf("send complete\n");
   }
@@ -12,6 +12,7 @@
 #endif
 
 #include "emu.h"
+#include "replay.h"
 #include "usb_cx2.h"
 #include "usblink.h"
 #include "usblink_cx2.h"
@@ -135,8 +136,7 @@ static bool writePacket(NNSEMessage *message) {
   dumpPacket(message);
 #endif
 
-  return usb_cx2_packet_to_calc(1, reinterpret_cast<uint8_t *>(message),
-                                length);
+  return replay_usb_input(REPLAY_USB_PACKET, 1, message, length);
 }
 
 static uint16_t nextSeqno() { return usblink_cx2_state.seqno++; }
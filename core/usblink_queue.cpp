@@ -4,6 +4,7 @@
 #include <chrono>
 #include <thread>
 
+#include "iothread.h"
 #include "usblink_queue.h"
 
 struct usblink_queue_action {
@@ -42,6 +43,8 @@ static void dirlist_callback(struct usblink_file *f, bool is_error, void *user_d
     {
         usblink_queue.pop();
         busy = false;
+        if(!usblink_queue.empty())
+            io_notify(IO_USBLINK);
     }
 }
 
@@ -68,6 +71,8 @@ static void progress_callback(int progress, void *user_data)
     {
         usblink_queue.pop();
         busy = false;
+        if(!usblink_queue.empty())
+            io_notify(IO_USBLINK);
     }
 }
 
@@ -143,6 +148,9 @@ void usblink_queue_add(usblink_queue_action &action)
 
     if(!usblink_connected)
         usblink_connect();
+
+    // Start it right away instead of at the next throttle event
+    io_notify(IO_USBLINK);
 }
 
 void usblink_queue_delete(std::string path, bool is_dir, usblink_progress_cb callback, void *user_data)
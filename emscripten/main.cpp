@@ -101,6 +101,9 @@ void step(void*)
 
                 arm.reg[15] += 4;
                 cpu_exception((cpu_events & EVENT_FIQ) ? EX_FIQ : EX_IRQ);
+            } else if (cpu_events & EVENT_WAITING) {
+                cycle_count_delta = 0; // No sleeping on the main thread
+                break;
             }
             cpu_events &= ~EVENT_WAITING;
 
@@ -124,15 +127,14 @@ void emscripten_loop(bool reset)
         cpu_events &= EVENT_DEBUG_STEP;
 
         sched_reset();
-        sched.items[SCHED_THROTTLE].clock = CLOCK_27M;
-        sched.items[SCHED_THROTTLE].proc = do_stuff;
+        sched_init_item(SCHED_THROTTLE, CLOCK_27M, do_stuff, true);
 
         memory_reset();
     }
 
     addr_cache_flush();
 
-    sched_update_next_event(0);
+    sched_update_next_event(sched_current_cputick());
 
     exiting = false;
 
@@ -119,6 +119,12 @@ EmuThread::EmuThread(QObject *parent) :
     debug_on_start = debug_on_warn = false;
 }
 
+// Called from the thread which wrote the snapshot
+static void suspendDone(bool success)
+{
+    emit emu_thread.suspended(success);
+}
+
 //Called occasionally, only way to do something in the same thread the emulator runs in.
 void EmuThread::doStuff(bool wait)
 {
@@ -126,9 +132,9 @@ void EmuThread::doStuff(bool wait)
     {
         if(do_suspend)
         {
-            bool success = emu_suspend(snapshot_path.c_str());
             do_suspend = false;
-            emit suspended(success);
+            if(!emu_suspend_async(snapshot_path.c_str(), suspendDone))
+                emit suspended(false);
         }
 
         if(enter_debugger)
@@ -225,6 +231,7 @@ bool EmuThread::stop()
 
     // Cause the cpu core to leave the loop and check for events
     cycle_count_delta = 0;
+    emu_wakeup();
 
     if(!this->wait(200))
     {
@@ -44,6 +44,17 @@ QMAKE_CFLAGS += -g -std=gnu11 -Wall -Wextra
 QMAKE_CXXFLAGS += -g -Wall -Wextra -D QT_NO_CAST_FROM_ASCII
 LIBS += -lz
 
+# Optional snapshot codecs
+CONFIG += link_pkgconfig
+packagesExist(liblz4) {
+    DEFINES += HAVE_LZ4
+    PKGCONFIG += liblz4
+}
+packagesExist(libzstd) {
+    DEFINES += HAVE_ZSTD
+    PKGCONFIG += libzstd
+}
+
 # Override bad default options to enable better optimizations
 QMAKE_CFLAGS_RELEASE = -O3 -DNDEBUG
 QMAKE_CXXFLAGS_RELEASE = -O3 -DNDEBUG
@@ -167,20 +178,25 @@ SOURCES += $$ASMCODE_IMPL \
     core/usblink_queue.cpp \
     core/armsnippets_loader.c \
     core/casplus.c \
+    core/cycles.c \
     core/des.c \
     core/disasm.c \
     core/gdbstub.c \
     core/gif.cpp \
     core/interrupt.c \
+    core/iothread.cpp \
     core/keypad.cpp \
     core/lcd.c \
     core/link.c \
     core/mem.c \
     core/misc.c \
     core/mmu.c \
+    core/replay.cpp \
+    core/rewind.cpp \
     core/schedule.c \
     core/serial.c \
     core/sha256.c \
+    core/snapshot_file.cpp \
     core/usb.c \
     core/usb_cx2.cpp \
     core/usbip_server.cpp \
@@ -218,6 +234,7 @@ HEADERS += \
     core/casplus.h \
     core/cpu.h \
     core/cpudefs.h \
+    core/cycles.h \
     core/debug.h \
     core/des.h \
     core/disasm.h \
@@ -226,14 +243,18 @@ HEADERS += \
     core/gdbstub.h \
     core/gif.h \
     core/interrupt.h \
+    core/iothread.h \
     core/keypad.h \
     core/lcd.h \
     core/link.h \
     core/mem.h \
     core/misc.h \
     core/mmu.h \
+    core/replay.h \
+    core/rewind.h \
     core/schedule.h \
     core/sha256.h \
+    core/snapshot_file.h \
     core/translate.h \
     core/usb.h \
     core/usb_cx2.h \
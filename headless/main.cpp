@@ -1,10 +1,24 @@
+#include <algorithm>
+#include <chrono>
 #include <errno.h>
+#include <signal.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 
+#include "core/cycles.h"
 #include "core/debug.h"
 #include "core/emu.h"
 #include "core/mem.h"
 #include "core/mmu.h"
+#include "core/replay.h"
+#include "core/rewind.h"
+#include "core/snapshot_file.h"
 #include "core/usblink_queue.h"
+#include "core/os/os.h"
 
 void gui_do_stuff(bool wait)
 {
@@ -63,12 +77,224 @@ void gui_show_speed(double d) {}
 void gui_usblink_changed(bool state) {}
 void throttle_timer_off() {}
 void throttle_timer_on() {}
-void throttle_timer_wait(unsigned int usec) {}
+void throttle_timer_wait(unsigned int usec) { std::this_thread::sleep_for(std::chrono::microseconds(usec)); }
+
+static void stop_emulation(int sig)
+{
+	(void) sig;
+	exiting = true;
+}
+
+static FILE *open_stats_file(const char *path)
+{
+	if(strcmp(path, "-") == 0)
+		return stdout;
+
+	FILE *f = fopen(path, "w");
+	if(!f)
+		perror(path);
+	return f;
+}
+
+// Per run options of the fork server
+struct run_options {
+	unsigned int port_gdb = 0, port_rdbg = 0;
+	std::string suspend, stats, flash_overlay;
+};
+
+static bool read_request(int fd, run_options &options)
+{
+	std::string line;
+	char c;
+	// One byte at a time, the rest of the connection is the child's stdin
+	while(read(fd, &c, 1) == 1 && c != '\n')
+		line += c;
+
+	std::vector<std::string> args;
+	for(size_t pos = 0; (pos = line.find_first_not_of(" \t\r", pos)) != std::string::npos;)
+	{
+		size_t end = line.find_first_of(" \t\r", pos);
+		args.push_back(line.substr(pos, end - pos));
+		pos = end;
+	}
+
+	for(size_t i = 0; i < args.size(); ++i)
+	{
+		// All of them take a value
+		if(i + 1 == args.size())
+			return false;
+
+		if(args[i] == "--gdb")
+			options.port_gdb = strtoul(args[++i].c_str(), nullptr, 0);
+		else if(args[i] == "--rdebug")
+			options.port_rdbg = strtoul(args[++i].c_str(), nullptr, 0);
+		else if(args[i] == "--suspend")
+			options.suspend = args[++i];
+		else if(args[i] == "--stats")
+			options.stats = args[++i];
+		else if(args[i] == "--flash-overlay")
+			options.flash_overlay = args[++i];
+		else
+			return false;
+	}
+
+	return true;
+}
+
+/* Waits for connections on a Unix socket at path, after the emulator got
+ * started and warmed up. Without --snapshot, --fork-warmup <seconds> lets the
+ * emulator boot for that long in emulated time before the first child gets
+ * forked, else each child boots from reset on its own. Each connection is a request for a run: a line of options
+ * (--gdb <port>, --rdebug <port>, --suspend <file>, --stats <file>,
+ * --flash-overlay <file>), which
+ * is answered with "pid <pid>" of a forked child. That child uses the
+ * connection as stdin, stdout and stderr and runs until the emulation ends,
+ * for instance on SIGINT or SIGTERM. The client has to keep reading the
+ * connection, else the child blocks once serial output fills the socket
+ * buffer. It gets killed by SIGPIPE if it writes after the client closed
+ * the connection. Returns true in the child, false
+ * in the server once it got stopped or failed. */
+static bool fork_server(const char *path, run_options &options)
+{
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "Socket path '%s' is too long.\n", path);
+		return false;
+	}
+
+	strcpy(addr.sun_path, path);
+	unlink(path);
+
+	int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(server == -1 || bind(server, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || listen(server, 16) != 0)
+	{
+		perror("Fork server");
+		if(server != -1)
+			close(server);
+		return false;
+	}
+
+	emu_fork_prepare();
+
+	// Children get reaped automatically
+	signal(SIGCHLD, SIG_IGN);
+	// Without SA_RESTART, so that accept returns
+	struct sigaction action = {};
+	action.sa_handler = stop_emulation;
+	sigaction(SIGINT, &action, nullptr);
+	sigaction(SIGTERM, &action, nullptr);
+
+	fprintf(stderr, "Fork server listening on %s\n", path);
+
+	while(!exiting)
+	{
+		int conn = accept4(server, nullptr, nullptr, SOCK_CLOEXEC);
+		if(conn == -1)
+		{
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			perror("Fork server: accept");
+			break;
+		}
+
+		pid_t pid = fork();
+		if(pid == -1)
+			perror("Fork server: fork");
+		if(pid != 0)
+		{
+			close(conn);
+			continue;
+		}
+
+		close(server);
+		signal(SIGCHLD, SIG_DFL);
+
+		bool valid = read_request(conn, options);
+		dprintf(conn, valid ? "pid %d\n" : "error invalid request\n", int(getpid()));
+		if(!valid)
+			_exit(2);
+
+		dup2(conn, STDIN_FILENO);
+		dup2(conn, STDOUT_FILENO);
+		dup2(conn, STDERR_FILENO);
+		close(conn);
+
+		emu_fork_child(options.port_gdb, options.port_rdbg);
+		return true;
+	}
+
+	close(server);
+	unlink(path);
+	return false;
+}
+
+// Prints the header, the section table and the registers of a snapshot file
+static int snapshot_info(const char *path)
+{
+	snapshot_buffer buffer = {};
+	if(!snapshot_file_read(path, &buffer))
+	{
+		fprintf(stderr, "Could not read snapshot '%s'.\n", path);
+		return 1;
+	}
+
+	emu_snapshot snapshot = {};
+	snapshot.buffer = &buffer;
+	if(!snapshot_read_header(&snapshot))
+	{
+		fprintf(stderr, "'%s' is not a snapshot of a compatible version.\n", path);
+		snapshot_file_close(&buffer);
+		return 1;
+	}
+
+	printf("boot1: %.*s\n", int(sizeof(snapshot.header.path_boot1)), snapshot.header.path_boot1);
+	printf("flash: %.*s\n", int(sizeof(snapshot.header.path_flash)), snapshot.header.path_flash);
+	printf("id: %016llx\n", (unsigned long long) snapshot.header.id);
+	if(snapshot.header.path_parent[0])
+		printf("parent: %.*s (id %016llx)\n", int(sizeof(snapshot.header.path_parent)), snapshot.header.path_parent,
+		       (unsigned long long) snapshot.header.parent_id);
+
+	for(uint32_t i = 0; i < snapshot.header.sections; i++)
+	{
+		snapshot_section section;
+		if(!snapshot_get_section(&snapshot, i, &section))
+		{
+			fprintf(stderr, "Section %u is invalid.\n", i);
+			break;
+		}
+
+		char id[5] = {};
+		memcpy(id, &section.id, 4);
+		printf("section %s version %u offset %llu size %llu\n", id, section.version,
+		       (unsigned long long) section.offset, (unsigned long long) section.size);
+	}
+
+	arm_state regs;
+	snapshot_section cpu;
+	if(snapshot_read_section(&snapshot, SNAPSHOT_SECTION_ID('C', 'P', 'U', ' '), &cpu)
+	   && snapshot_read(&snapshot, &regs, sizeof(regs)))
+	{
+		for(int i = 0; i < 16; i++)
+			printf("r%d=%08x%c", i, regs.reg[i], i % 4 == 3 ? '\n' : ' ');
+	}
+
+	snapshot_file_close(&buffer);
+	return 0;
+}
 
 int main(int argc, char *argv[])
 {
-	const char *boot1 = nullptr, *flash = nullptr, *snapshot = nullptr, *rampayload = nullptr;
+	const char *boot1 = nullptr, *flash = nullptr, *snapshot = nullptr, *rampayload = nullptr, *stats = nullptr,
+	           *record = nullptr, *replay = nullptr, *cycle_model = cycle_model_name(),
+	           *suspend = nullptr, *compact = nullptr, *fork_socket = nullptr, *overlay = nullptr,
+	           *overlay_rebase = nullptr;
+	bool overlay_commit = false, overlay_discard = false;
 	uint32_t rampayload_base = 0x10000000;
+	unsigned int miss_penalty = 0, fork_warmup_ms = 0;
+	bool turbo = true;
 
 	for(int argi = 1; argi < argc; ++argi)
 	{
@@ -86,10 +312,123 @@ int main(int argc, char *argv[])
 			debug_on_start = true;
 		else if(strcmp(argv[argi], "--debug-on-warn") == 0)
 			debug_on_warn = true;
+		else if(strcmp(argv[argi], "--startup-times") == 0)
+			print_start_times = true;
 		else if(strcmp(argv[argi], "--print-on-warn") == 0)
 			print_on_warn = true;
 		else if(strcmp(argv[argi], "--diags") == 0)
 			boot_order = ORDER_DIAGS;
+		else if(strcmp(argv[argi], "--hugepages") == 0 && argi + 1 < argc)
+		{
+			const char *mode = argv[++argi];
+			if(strcmp(mode, "off") == 0)
+				os_hugepages = OS_HUGEPAGES_OFF;
+			else if(strcmp(mode, "thp") == 0)
+				os_hugepages = OS_HUGEPAGES_THP;
+			else if(strcmp(mode, "hugetlb") == 0)
+				os_hugepages = OS_HUGEPAGES_HUGETLB;
+			else
+			{
+				fprintf(stderr, "Unknown huge page mode '%s', use off, thp or hugetlb.\n", mode);
+				return 1;
+			}
+		}
+		else if(strcmp(argv[argi], "--numa-node") == 0 && argi + 1 < argc)
+		{
+			const char *node = argv[++argi];
+			char *end;
+			os_numa_node = strtol(node, &end, 10);
+			if(end == node || *end || !os_numa_node_exists(os_numa_node))
+			{
+				fprintf(stderr, "'%s' is not a NUMA node of this host.\n", node);
+				return 1;
+			}
+		}
+		else if(strcmp(argv[argi], "--stats") == 0 && argi + 1 < argc)
+			stats = argv[++argi];
+		else if(strcmp(argv[argi], "--stats-sample") == 0 && argi + 1 < argc)
+		{
+			if(!(mem_stats_sample_file = open_stats_file(argv[++argi])))
+				return 1;
+		}
+		else if(strcmp(argv[argi], "--stats-interval") == 0 && argi + 1 < argc)
+			mem_stats_sample_ms = strtoul(argv[++argi], nullptr, 0);
+		else if(strcmp(argv[argi], "--speed") == 0 && argi + 1 < argc)
+		{
+			const char *speed = argv[++argi];
+			char *end = nullptr;
+			speed_target = strcmp(speed, "max") == 0 ? 0 : strtod(speed, &end);
+			// Written like this to reject NaN as well
+			if(end && (end == speed || *end || !(speed_target >= 0.25 && speed_target <= 16)))
+			{
+				fprintf(stderr, "'%s' is not a speed between 0.25 and 16, or max.\n", speed);
+				return 1;
+			}
+			turbo = speed_target == 0;
+		}
+		else if(strcmp(argv[argi], "--cpu-limit") == 0 && argi + 1 < argc)
+		{
+			const char *limit = argv[++argi];
+			char *end;
+			unsigned long percent = strtoul(limit, &end, 10);
+			if(end == limit || *end || percent < 1 || percent > 100)
+			{
+				fprintf(stderr, "'%s' is not a CPU limit between 1 and 100 percent.\n", limit);
+				return 1;
+			}
+			cpu_limit = percent;
+		}
+		else if(strcmp(argv[argi], "--record") == 0 && argi + 1 < argc)
+			record = argv[++argi];
+		else if(strcmp(argv[argi], "--replay") == 0 && argi + 1 < argc)
+			replay = argv[++argi];
+		else if(strcmp(argv[argi], "--rewind") == 0 && argi + 1 < argc)
+			rewind_enable(strtoul(argv[++argi], nullptr, 0));
+		else if(strcmp(argv[argi], "--suspend") == 0 && argi + 1 < argc)
+			suspend = argv[++argi];
+		else if(strcmp(argv[argi], "--fork-server") == 0 && argi + 1 < argc)
+			fork_socket = argv[++argi];
+		else if(strcmp(argv[argi], "--fork-warmup") == 0 && argi + 1 < argc)
+		{
+			const char *seconds = argv[++argi];
+			char *end;
+			double warmup = strtod(seconds, &end);
+			// Written like this to reject NaN as well
+			if(end == seconds || *end || !(warmup > 0 && warmup <= 3600))
+			{
+				fprintf(stderr, "'%s' is not a warm-up time between 0 and 3600 seconds.\n", seconds);
+				return 1;
+			}
+			fork_warmup_ms = std::max(1u, (unsigned int) (warmup * 1000));
+		}
+		else if(strcmp(argv[argi], "--deltas") == 0)
+			snapshot_deltas = true;
+		else if(strcmp(argv[argi], "--compact") == 0 && argi + 1 < argc)
+			compact = argv[++argi];
+		else if(strcmp(argv[argi], "--flash-overlay") == 0 && argi + 1 < argc)
+			overlay = argv[++argi];
+		else if(strcmp(argv[argi], "--flash-writeback") == 0 && argi + 1 < argc)
+			flash_writeback_ms = strtoul(argv[++argi], nullptr, 0);
+		else if(strcmp(argv[argi], "--overlay-commit") == 0)
+			overlay_commit = true;
+		else if(strcmp(argv[argi], "--overlay-discard") == 0)
+			overlay_discard = true;
+		else if(strcmp(argv[argi], "--overlay-rebase") == 0 && argi + 1 < argc)
+			overlay_rebase = argv[++argi];
+		else if(strcmp(argv[argi], "--snapshot-info") == 0 && argi + 1 < argc)
+			return snapshot_info(argv[++argi]);
+		else if(strcmp(argv[argi], "--snapshot-codec") == 0 && argi + 1 < argc)
+		{
+			if(!snapshot_codec_set(argv[++argi]))
+			{
+				fprintf(stderr, "Unknown snapshot codec '%s', use %s.\n", argv[argi], snapshot_codec_names());
+				return 1;
+			}
+		}
+		else if(strcmp(argv[argi], "--cycle-model") == 0 && argi + 1 < argc)
+			cycle_model = argv[++argi];
+		else if(strcmp(argv[argi], "--miss-penalty") == 0 && argi + 1 < argc)
+			miss_penalty = strtoul(argv[++argi], nullptr, 0);
 		else
 		{
 			fprintf(stderr, "Unknown argument '%s'.\n", argv[argi]);
@@ -97,6 +436,33 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if(!cycle_model_set(cycle_model, miss_penalty))
+	{
+		fprintf(stderr, "Unknown cycle model '%s', use flat or arm926.\n", cycle_model);
+		return 1;
+	}
+
+	if(overlay_commit || overlay_discard || overlay_rebase)
+	{
+		// Only work on the files
+		if(!overlay || (!flash && !overlay_discard))
+		{
+			fprintf(stderr, "Overlay operations need --flash-overlay and --flash.\n");
+			return 2;
+		}
+
+		bool done = overlay_commit ? flash_overlay_commit(flash, overlay)
+		            : overlay_discard ? flash_overlay_discard(overlay)
+		            : flash_overlay_rebase(flash, overlay, overlay_rebase);
+		if(!done)
+		{
+			fprintf(stderr, "Could not update overlay '%s'.\n", overlay);
+			return 1;
+		}
+
+		return 0;
+	}
+
 	if(!boot1 || !flash)
 	{
 		fprintf(stderr, "You need to specify at least Boot1 and Flash images.\n");
@@ -105,10 +471,41 @@ int main(int argc, char *argv[])
 
 	path_boot1 = boot1;
 	path_flash = flash;
+	if(overlay)
+		path_flash_overlay = overlay;
+
+	if(compact && !snapshot)
+	{
+		fprintf(stderr, "--compact needs a snapshot to start from.\n");
+		return 2;
+	}
+
+	if(fork_warmup_ms && !fork_socket)
+	{
+		fprintf(stderr, "--fork-warmup is for --fork-server only.\n");
+		return 2;
+	}
+
+	if(fork_socket && !snapshot && !fork_warmup_ms)
+		fprintf(stderr, "Warning: --fork-server without --snapshot or --fork-warmup boots each child from reset.\n");
 
 	if(!emu_start(0, 0, snapshot))
 		return 1;
 
+	if(compact)
+	{
+		// Merge the chain of deltas into a complete snapshot
+		snapshot_deltas = false;
+		if(!emu_suspend(compact))
+		{
+			fprintf(stderr, "Could not save snapshot to '%s'.\n", compact);
+			return 1;
+		}
+
+		emu_cleanup();
+		return 0;
+	}
+
 	if(rampayload)
 	{
 		FILE *f = fopen(rampayload, "rb");
@@ -141,8 +538,96 @@ int main(int argc, char *argv[])
 		arm.reg[15] = rampayload_base;
 	}
 
-	turbo_mode = true;
+	if(fork_socket)
+	{
+		if(fork_warmup_ms)
+		{
+			signal(SIGINT, stop_emulation);
+			signal(SIGTERM, stop_emulation);
+
+			turbo_mode = turbo;
+			emu_stop_after_ms = fork_warmup_ms;
+			emu_loop(false);
+			// Got stopped before the time was over
+			if(emu_stop_after_ms)
+			{
+				emu_cleanup();
+				return 0;
+			}
+			exiting = false;
+		}
+
+		run_options options;
+		if(!fork_server(fork_socket, options))
+		{
+			emu_cleanup();
+			return exiting ? 0 : 1;
+		}
+
+		if(!options.suspend.empty())
+			suspend = options.suspend.c_str();
+		if(!options.stats.empty())
+			stats = options.stats.c_str();
+
+		// The overlay of the server is shared, so only save into one of our own
+		overlay = nullptr;
+		if(options.flash_overlay.empty())
+			flash_writeback_ms = 0; // Would write into the shared image
+		else
+		{
+			if(!flash_overlay_switch(options.flash_overlay.c_str()))
+				return 1;
+			overlay = options.flash_overlay.c_str();
+		}
+	}
+
+	if(record && !replay_record_start(record))
+		return 1;
+
+	replay_exit_at_end = true;
+	if(replay && !replay_play_start(replay))
+		return 1;
+
+	// Leave emu_loop normally, so that the stats get written
+	signal(SIGINT, stop_emulation);
+	signal(SIGTERM, stop_emulation);
+
+	auto start = std::chrono::steady_clock::now();
+
+	turbo_mode = turbo;
 	emu_loop(false);
 
-	return 0;
+	replay_stop();
+
+	if(suspend && !emu_suspend(suspend))
+	{
+		fprintf(stderr, "Could not save snapshot to '%s'.\n", suspend);
+		return 1;
+	}
+
+	// Without an overlay or writeback, changes to the flash get lost as before
+	if(((overlay && flash_overlay_path()) || flash_writeback_ms) && !flash_save_changes())
+		return 1;
+
+	if(flash_writeback_ms)
+	{
+		flash_save_stats saved;
+		flash_get_save_stats(&saved);
+		fprintf(stderr, "Flash: %llu saves, %llu blocks, %llu bytes, latency %.1f ms avg, %.1f ms max, %llu failed\n",
+		        (unsigned long long) saved.saves, (unsigned long long) saved.blocks, (unsigned long long) saved.bytes,
+		        saved.saves ? saved.total_ms / saved.saves : 0.0, saved.max_ms, (unsigned long long) saved.failures);
+	}
+
+	if(stats)
+	{
+		FILE *f = open_stats_file(stats);
+		if(!f)
+			return 1;
+
+		mem_stats_write_json(f, nullptr, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+		if(f != stdout)
+			fclose(f);
+	}
+
+	return replay_diverged ? 6 : 0;
 }
@@ -21,19 +21,21 @@ void LCDWidget::mousePressEvent(QMouseEvent *event)
 
 void LCDWidget::mouseReleaseEvent(QMouseEvent *event)
 {
+    float x, y;
+    bool contact, down;
+    touchpad_get_state(&x, &y, &contact, &down);
     if(event->button() == Qt::RightButton)
-        keypad.touchpad_down = keypad.touchpad_contact = false;
-    else
-        keypad.touchpad_contact = false;
+        down = false;
 
-    the_qml_bridge->touchpadStateChanged();
-    keypad.kpc.gpio_int_active |= 0x800;
-    keypad_int_check();
+    the_qml_bridge->setTouchpadState(x, y, false, down);
 }
 
 void LCDWidget::mouseMoveEvent(QMouseEvent *event)
 {
-    the_qml_bridge->setTouchpadState((qreal)event->x() / width(), (qreal)event->y() / height(), keypad.touchpad_contact, keypad.touchpad_down);
+    float x, y;
+    bool contact, down;
+    touchpad_get_state(&x, &y, &contact, &down);
+    the_qml_bridge->setTouchpadState((qreal)event->x() / width(), (qreal)event->y() / height(), contact, down);
 }
 
 void LCDWidget::showEvent(QShowEvent *e)
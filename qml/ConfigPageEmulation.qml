@@ -138,6 +138,78 @@ ColumnLayout {
         }
     }
 
+    FBLabel {
+        text: qsTr("Speed")
+        font.pixelSize: TextMetrics.title2Size
+        Layout.topMargin: 10
+        Layout.bottomMargin: 5
+    }
+
+    FBLabel {
+        Layout.maximumWidth: parent.width
+        wrapMode: Text.WordWrap
+        text: qsTr("Emulation speed relative to a real calculator when turbo mode is off. The CPU limit caps how much of one host core Firebird may use, which is useful for instances running in the background.")
+        font.pixelSize: TextMetrics.normalSize
+    }
+
+    RowLayout {
+        spacing: 10
+        width: parent.width
+        Layout.fillWidth: true
+
+        FBLabel {
+            text: qsTr("Target speed")
+            Layout.alignment: Qt.AlignVCenter
+        }
+
+        ComboBox {
+            id: speedCombo
+            Layout.fillWidth: true
+            // Other speeds (e.g. from --speed) get listed too, so that they're kept
+            property var speeds: {
+                var list = [0.25, 0.5, 1, 2, 4, 8, 16, 0];
+                if (list.indexOf(Emu.speedTarget) < 0) {
+                    var pos = 0;
+                    while (list[pos] !== 0 && list[pos] < Emu.speedTarget)
+                        pos++;
+                    list.splice(pos, 0, Emu.speedTarget);
+                }
+                return list;
+            }
+            model: speeds.map(function(speed) { return speed === 0 ? qsTr("Maximum") : speed + "x"; })
+            currentIndex: speeds.indexOf(Emu.speedTarget)
+            // Not onCurrentIndexChanged, which also fires while the model changes
+            onActivated: {
+                Emu.speedTarget = speeds[index];
+                currentIndex = Qt.binding(function() { return speeds.indexOf(Emu.speedTarget); });
+            }
+        }
+    }
+
+    RowLayout {
+        spacing: 10
+        width: parent.width
+        Layout.fillWidth: true
+
+        FBLabel {
+            text: qsTr("CPU limit in % (0 for none)")
+            Layout.alignment: Qt.AlignVCenter
+        }
+
+        SpinBox {
+            Layout.maximumWidth: TextMetrics.normalSize * 8
+
+            minimumValue: 0
+            maximumValue: 100
+
+            value: Emu.cpuLimit
+            onValueChanged: {
+                Emu.cpuLimit = value;
+                value = Qt.binding(function() { return Emu.cpuLimit; });
+            }
+        }
+    }
+
     FBLabel {
         text: qsTr("External Connectivity")
         font.pixelSize: TextMetrics.title2Size
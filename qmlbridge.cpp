@@ -64,6 +64,9 @@ QMLBridge::QMLBridge(QObject *parent)
 
   print_on_warn = getPrintOnWarn();
 
+  speed_target = getSpeedTarget();
+  cpu_limit = getCPULimit();
+
   connect(&kit_model, SIGNAL(anythingChanged()), this, SLOT(saveKits()),
           Qt::QueuedConnection);
 
@@ -207,6 +210,32 @@ void QMLBridge::setSuspendOnClose(bool e) {
   emit suspendOnCloseChanged();
 }
 
+double QMLBridge::getSpeedTarget() {
+  return settings.value(QStringLiteral("speedTarget"), 1.0).toDouble();
+}
+
+void QMLBridge::setSpeedTarget(double speed) {
+  if (getSpeedTarget() == speed)
+    return;
+
+  speed_target = speed;
+  settings.setValue(QStringLiteral("speedTarget"), speed);
+  emit speedTargetChanged();
+}
+
+unsigned int QMLBridge::getCPULimit() {
+  return settings.value(QStringLiteral("cpuLimit"), 0).toUInt();
+}
+
+void QMLBridge::setCPULimit(unsigned int percent) {
+  if (getCPULimit() == percent)
+    return;
+
+  cpu_limit = percent;
+  settings.setValue(QStringLiteral("cpuLimit"), percent);
+  emit cpuLimitChanged();
+}
+
 QString QMLBridge::getUSBDir() {
   return settings.value(QStringLiteral("usbdirNew"), QStringLiteral("/ndless"))
       .toString();
@@ -638,9 +667,10 @@ void QMLBridge::notifyButtonStateChanged(int row, int col, bool state) {
 }
 
 void QMLBridge::touchpadStateChanged() {
-  touchpadStateChanged(float(keypad.touchpad_x) / TOUCHPAD_X_MAX,
-                       1.0f - (float(keypad.touchpad_y) / TOUCHPAD_Y_MAX),
-                       keypad.touchpad_contact, keypad.touchpad_down);
+  float x, y;
+  bool contact, down;
+  touchpad_get_state(&x, &y, &contact, &down);
+  touchpadStateChanged(x, y, contact, down);
 }
 
 #include "core/usbip_server.h"
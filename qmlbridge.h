@@ -23,6 +23,8 @@ public:
     Q_PROPERTY(unsigned int defaultKit READ getDefaultKit WRITE setDefaultKit NOTIFY defaultKitChanged)
     Q_PROPERTY(bool leftHanded READ getLeftHanded WRITE setLeftHanded NOTIFY leftHandedChanged)
     Q_PROPERTY(bool suspendOnClose READ getSuspendOnClose WRITE setSuspendOnClose NOTIFY suspendOnCloseChanged)
+    Q_PROPERTY(double speedTarget READ getSpeedTarget WRITE setSpeedTarget NOTIFY speedTargetChanged)
+    Q_PROPERTY(unsigned int cpuLimit READ getCPULimit WRITE setCPULimit NOTIFY cpuLimitChanged)
     Q_PROPERTY(QString usbdir READ getUSBDir WRITE setUSBDir NOTIFY usbDirChanged)
     Q_PROPERTY(QString version READ getVersion CONSTANT)
     Q_PROPERTY(bool isRunning READ getIsRunning NOTIFY isRunningChanged)
@@ -62,6 +64,10 @@ public:
   void setLeftHanded(bool e);
   bool getSuspendOnClose();
   void setSuspendOnClose(bool e);
+  double getSpeedTarget();
+  void setSpeedTarget(double speed);
+  unsigned int getCPULimit();
+  void setCPULimit(unsigned int percent);
   QString getUSBDir();
   void setUSBDir(QString dir);
   bool getIsRunning();
@@ -169,6 +175,8 @@ signals:
     void defaultKitChanged();
     void leftHandedChanged();
     void suspendOnCloseChanged();
+    void speedTargetChanged();
+    void cpuLimitChanged();
     void usbDirChanged();
     void isRunningChanged();
     void keypadLayoutChanged();
@@ -200,6 +200,32 @@ void keyToKeypad(QKeyEvent *event)
     }
 }
 
+// The arrow keys touch the edges of the touchpad
+static bool arrowKeyPosition(Qt::Key key, float *x, float *y)
+{
+    switch(key)
+    {
+    case Qt::Key_Down:
+        *x = 0.5f;
+        *y = 1.0f;
+        return true;
+    case Qt::Key_Up:
+        *x = 0.5f;
+        *y = 0.0f;
+        return true;
+    case Qt::Key_Left:
+        *x = 0.0f;
+        *y = 0.5f;
+        return true;
+    case Qt::Key_Right:
+        *x = 1.0f;
+        *y = 0.5f;
+        return true;
+    default:
+        return false;
+    }
+}
+
 void QtKeypadBridge::keyPressEvent(QKeyEvent *event)
 {
     // Ignore autorepeat, calc os must handle it on its own
@@ -208,35 +234,14 @@ void QtKeypadBridge::keyPressEvent(QKeyEvent *event)
 
     Qt::Key key = static_cast<Qt::Key>(event->key());
 
-    switch(key)
+    float x, y;
+    if(!arrowKeyPosition(key, &x, &y))
     {
-    case Qt::Key_Down:
-        keypad.touchpad_x = TOUCHPAD_X_MAX / 2;
-        keypad.touchpad_y = 0;
-        break;
-    case Qt::Key_Up:
-        keypad.touchpad_x = TOUCHPAD_X_MAX / 2;
-        keypad.touchpad_y = TOUCHPAD_Y_MAX;
-        break;
-    case Qt::Key_Left:
-        keypad.touchpad_y = TOUCHPAD_Y_MAX / 2;
-        keypad.touchpad_x = 0;
-        break;
-    case Qt::Key_Right:
-        keypad.touchpad_y = TOUCHPAD_Y_MAX / 2;
-        keypad.touchpad_x = TOUCHPAD_X_MAX;
-        break;
-    default:
         keyToKeypad(event);
-
         return;
     }
 
-    keypad.touchpad_contact = keypad.touchpad_down = true;
-    the_qml_bridge->touchpadStateChanged();
-    keypad.kpc.gpio_int_active |= 0x800;
-
-    keypad_int_check();
+    the_qml_bridge->setTouchpadState(x, y, true, true);
 }
 
 void QtKeypadBridge::keyReleaseEvent(QKeyEvent *event)
@@ -247,37 +252,19 @@ void QtKeypadBridge::keyReleaseEvent(QKeyEvent *event)
 
     Qt::Key key = static_cast<Qt::Key>(event->key());
 
-    switch(key)
+    float x, y;
+    if(!arrowKeyPosition(key, &x, &y))
     {
-    case Qt::Key_Down:
-        if(keypad.touchpad_x == TOUCHPAD_X_MAX / 2
-            && keypad.touchpad_y == 0)
-            keypad.touchpad_contact = keypad.touchpad_down = false;
-        break;
-    case Qt::Key_Up:
-        if(keypad.touchpad_x == TOUCHPAD_X_MAX / 2
-            && keypad.touchpad_y == TOUCHPAD_Y_MAX)
-            keypad.touchpad_contact = keypad.touchpad_down = false;
-        break;
-    case Qt::Key_Left:
-        if(keypad.touchpad_y == TOUCHPAD_Y_MAX / 2
-            && keypad.touchpad_x == 0)
-            keypad.touchpad_contact = keypad.touchpad_down = false;
-        break;
-    case Qt::Key_Right:
-        if(keypad.touchpad_y == TOUCHPAD_Y_MAX / 2
-            && keypad.touchpad_x == TOUCHPAD_X_MAX)
-            keypad.touchpad_contact = keypad.touchpad_down = false;
-        break;
-    default:
         keyToKeypad(event);
-
         return;
     }
 
-    the_qml_bridge->touchpadStateChanged();
-    keypad.kpc.gpio_int_active |= 0x800;
-    keypad_int_check();
+    // Only release if the touchpad wasn't touched elsewhere in the meantime
+    float cur_x, cur_y;
+    bool contact, down;
+    touchpad_get_state(&cur_x, &cur_y, &contact, &down);
+    if(cur_x == x && cur_y == y)
+        the_qml_bridge->setTouchpadState(x, y, false, false);
 }
 
 bool QtKeypadBridge::eventFilter(QObject *obj, QEvent *event)
@@ -0,0 +1,68 @@
+#!/usr/bin/env python3
+# Checks the GDB stub's reverse execution support like GDB uses it
+# Usage: ./gdb_reverse_check.py [host:]port
+# Needs a running emulator with the GDB stub on port and rewind enabled.
+
+import socket
+import sys
+
+# What GDB 12 sends on connect
+GDB_QSUPPORTED = ("qSupported:multiprocess+;swbreak+;hwbreak+;qRelocInsn+;fork-events+;"
+                  "vfork-events+;exec-events+;vContSupported+;QThreadEvents+;no-resumed+;"
+                  "memory-tagging+;xmlRegisters=i386")
+
+def packet(data):
+    return ("$%s#%02x" % (data, sum(data.encode()) & 0xff)).encode()
+
+class Stub:
+    def __init__(self, host, port):
+        self.sock = socket.create_connection((host, port))
+        self.sock.settimeout(30)
+        self.buf = b""
+
+    def command(self, data):
+        self.sock.sendall(packet(data))
+        while b"#" not in self.buf or len(self.buf) < self.buf.index(b"#") + 3:
+            self.buf += self.sock.recv(4096)
+        end = self.buf.index(b"#")
+        reply = self.buf[self.buf.index(b"$") + 1:end].decode()
+        self.buf = self.buf[end + 3:]
+        self.sock.sendall(b"+")
+        return reply
+
+    def pc(self):
+        return int.from_bytes(bytes.fromhex(self.command("pf")), "little")
+
+def main():
+    host, _, port = sys.argv[1].rpartition(":") if len(sys.argv) > 1 else ("", "", "3333")
+    stub = Stub(host or "localhost", int(port))
+
+    features = stub.command(GDB_QSUPPORTED).split(";")
+    for feature in ("ReverseStep+", "ReverseContinue+", "vContSupported+"):
+        if feature not in features:
+            sys.exit("qSupported reply lacks %s: %s" % (feature, ";".join(features)))
+    if not any(f.startswith("PacketSize=") for f in features):
+        sys.exit("qSupported reply lacks PacketSize")
+
+    stub.command("?")
+    # The stub may have stopped between instructions, the first step ends at the next one
+    stub.command("s")
+    pcs = [stub.pc()]
+    for _ in range(3):
+        stub.command("s")
+        pcs.append(stub.pc())
+
+    for expected in reversed(pcs[:-1]):
+        reply = stub.command("bs")
+        if reply.startswith("E"):
+            sys.exit("bs failed with %s, is rewind enabled?" % reply)
+        if "replaylog:begin" in reply:
+            break
+        if stub.pc() != expected:
+            sys.exit("bs went to %08x instead of %08x" % (stub.pc(), expected))
+
+    stub.sock.sendall(packet("c"))
+    print("OK")
+
+if __name__ == "__main__":
+    main()